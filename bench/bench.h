@@ -0,0 +1,23 @@
+#ifndef ASSERTIONS_BENCH_H
+#define ASSERTIONS_BENCH_H
+
+#include <stdint.h>
+
+// Each benchmark defines one of these, and is linked with harness.c, once
+// compiled as is and once instrumented.
+typedef struct {
+  const char *name;
+  // The assertion kind being measured.
+  const char *kind;
+  // How many asserted values are updated (checked) per iteration.
+  unsigned updates;
+  void (*run)(uint64_t iterations);
+} bench_t;
+
+extern const bench_t bench;
+
+// Keeps results alive, so that the uninstrumented loops aren't optimised
+// away.
+extern volatile int64_t bench_sink;
+
+#endif
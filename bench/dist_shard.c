@@ -0,0 +1,16 @@
+#include "Assertions.h"
+#include "bench.h"
+
+// Picks a shard by hashing, as a load balancer would.
+static void run(uint64_t iterations) {
+  int shard __assert_uniform(0, 15) = 0;
+  int64_t sum = 0;
+  for (uint64_t i = 0; i < iterations; ++i) {
+    uint64_t h = i * 0x9E3779B97F4A7C15ull;
+    shard = (int) (h >> 60);
+    sum += shard;
+  }
+  bench_sink = sum;
+}
+
+const bench_t bench = { "dist_shard", "dist", 1, run };
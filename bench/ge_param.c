@@ -0,0 +1,17 @@
+#include "Assertions.h"
+#include "bench.h"
+
+// A small function whose parameter is checked on every call.
+__attribute__((noinline))
+static int64_t scale(int32_t weight __assert_ge(0)) {
+  return (int64_t) weight * 3;
+}
+
+static void run(uint64_t iterations) {
+  int64_t sum = 0;
+  for (uint64_t i = 0; i < iterations; ++i)
+    sum += scale((int32_t) (i & 0xffff));
+  bench_sink = sum;
+}
+
+const bench_t bench = { "ge_param", "ge", 1, run };
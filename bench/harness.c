@@ -0,0 +1,95 @@
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+volatile int64_t bench_sink;
+
+// Counts the instructions retired by this thread, in user space. -1 if the
+// kernel doesn't let us.
+static int open_instruction_counter(void) {
+#ifdef __linux__
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return (int) syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+  return -1;
+#endif
+}
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Usage: <bench> [variant] [iterations] [repetitions]
+//
+// Prints one JSON object with the best of the repetitions.
+int main(int argc, char **argv) {
+  const char *variant = argc > 1 ? argv[1] : "unknown";
+  uint64_t iterations = argc > 2 ? strtoull(argv[2], NULL, 0) : 10000000;
+  int repetitions = argc > 3 ? atoi(argv[3]) : 5;
+  if (iterations == 0 || repetitions <= 0) {
+    fprintf(stderr, "usage: %s [variant] [iterations] [repetitions]\n",
+            argv[0]);
+    return 1;
+  }
+
+  int counter = open_instruction_counter();
+  double best_ns = -1;
+  long long best_instructions = -1;
+  // Warm up caches and branch predictors first.
+  bench.run(iterations / 10 + 1);
+  for (int r = 0; r < repetitions; ++r) {
+#ifdef __linux__
+    if (counter >= 0) {
+      ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+      ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+    double start = now_ns();
+    bench.run(iterations);
+    double ns = now_ns() - start;
+    long long instructions = -1;
+#ifdef __linux__
+    if (counter >= 0) {
+      ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+      if (read(counter, &instructions, sizeof(instructions)) !=
+          sizeof(instructions))
+        instructions = -1;
+    }
+#endif
+    if (best_ns < 0 || ns < best_ns)
+      best_ns = ns;
+    if (instructions >= 0 &&
+        (best_instructions < 0 || instructions < best_instructions))
+      best_instructions = instructions;
+  }
+
+  printf("{\"bench\": \"%s\", \"kind\": \"%s\", \"variant\": \"%s\", "
+         "\"iterations\": %llu, \"updates_per_iteration\": %u, "
+         "\"ns_per_iteration\": %.4f, \"instructions_per_iteration\": ",
+         bench.name, bench.kind, variant, (unsigned long long) iterations,
+         bench.updates, best_ns / iterations);
+  if (best_instructions >= 0)
+    printf("%.4f}\n", (double) best_instructions / iterations);
+  else
+    printf("null}\n");
+  return 0;
+}
@@ -0,0 +1,14 @@
+#include "Assertions.h"
+#include "bench.h"
+
+// A counter that only goes up, updated in a tight loop.
+static void run(uint64_t iterations) {
+  int64_t counter __assert_monotonic = 0;
+  for (uint64_t i = 0; i < iterations; ++i) {
+    // Not a constant step, so the check can't be decided at compile time.
+    counter = counter + (int64_t) (i & 3);
+  }
+  bench_sink = counter;
+}
+
+const bench_t bench = { "monotonic_loop", "monotonic", 1, run };
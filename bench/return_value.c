@@ -0,0 +1,19 @@
+#include "Assertions.h"
+#include "bench.h"
+
+static uint32_t next;
+
+// A small hot function whose return value is checked on every call.
+__attribute__((noinline))
+__assert_monotonic uint32_t next_ticket(void) {
+  return ++next;
+}
+
+static void run(uint64_t iterations) {
+  uint64_t sum = 0;
+  for (uint64_t i = 0; i < iterations; ++i)
+    sum += next_ticket();
+  bench_sink = (int64_t) sum;
+}
+
+const bench_t bench = { "return_value", "monotonic", 1, run };
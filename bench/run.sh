@@ -0,0 +1,69 @@
+#!/bin/sh
+#
+# Runs every benchmark built in DIR, plain and instrumented, and prints what
+# the instrumentation costs, as JSON:
+#
+#   {"benchmarks": [{"bench": ..., "kind": ..., "ns_per_update": ...,
+#                    "instructions_per_check": ..., "text_bytes_delta": ...,
+#                    "plain": {...}, "instrumented": {...}}, ...]}
+#
+# instructions_per_check is null where hardware counters aren't available.
+# The text size of the instrumented object includes the run-time linked into
+# it.
+#
+# Usage: run.sh DIR [SIZE] [ITERATIONS] [REPETITIONS]
+#   SIZE is size(1) or llvm-size, found in PATH by default.
+
+set -e
+
+dir=${1:?usage: run.sh DIR [SIZE] [ITERATIONS] [REPETITIONS]}
+size=${2:-size}
+iterations=${3:-10000000}
+repetitions=${4:-5}
+
+# field NAME JSON: the value of a top level number or string field.
+field() {
+  printf '%s\n' "$2" | sed -n "s/.*\"$1\": \"*\([^,\"}]*\)\"*[,}].*/\1/p"
+}
+
+# Size of the text section of an object file, from the Berkeley format.
+text_size() {
+  "$size" "$1" | awk 'NR == 2 { print $1 }'
+}
+
+printf '{"benchmarks": ['
+sep=''
+for plain in "$dir"/*.plain; do
+  bench=${plain%.plain}
+  name=${bench##*/}
+  instrumented="$bench.instrumented"
+  [ -x "$instrumented" ] || continue
+
+  p=$("$plain" plain "$iterations" "$repetitions")
+  i=$("$instrumented" instrumented "$iterations" "$repetitions")
+
+  updates=$(field updates_per_iteration "$p")
+  ns=$(awk -v p="$(field ns_per_iteration "$p")" \
+           -v i="$(field ns_per_iteration "$i")" -v u="$updates" \
+           'BEGIN { printf "%.4f", (i - p) / u }')
+  p_instr=$(field instructions_per_iteration "$p")
+  i_instr=$(field instructions_per_iteration "$i")
+  if [ "$p_instr" = null ] || [ "$i_instr" = null ]; then
+    instr=null
+  else
+    instr=$(awk -v p="$p_instr" -v i="$i_instr" -v u="$updates" \
+                'BEGIN { printf "%.2f", (i - p) / u }')
+  fi
+  p_text=$(text_size "$bench.plain.o")
+  i_text=$(text_size "$bench.instrumented.o")
+
+  printf '%s\n  {"bench": "%s", "kind": "%s", "ns_per_update": %s, ' \
+         "$sep" "$name" "$(field kind "$p")" "$ns"
+  printf '"instructions_per_check": %s, "text_bytes_plain": %s, ' \
+         "$instr" "$p_text"
+  printf '"text_bytes_instrumented": %s, "text_bytes_delta": %s,\n' \
+         "$i_text" "$((i_text - p_text))"
+  printf '   "plain": %s,\n   "instrumented": %s}' "$p" "$i"
+  sep=','
+done
+printf '\n]}\n'
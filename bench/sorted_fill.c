@@ -0,0 +1,15 @@
+#include "Assertions.h"
+#include "bench.h"
+
+// An array refilled in order by a loop, checked once the loop is done.
+static void run(uint64_t iterations) {
+  int32_t keys[256] __assert_sorted;
+  for (uint64_t i = 0; i < iterations; i += 256) {
+    int32_t base = (int32_t) (i & 0xffff);
+    for (unsigned j = 0; j < 256; ++j)
+      keys[j] = base + (int32_t) (j * 3);
+    bench_sink += keys[i & 255];
+  }
+}
+
+const bench_t bench = { "sorted_fill", "sorted", 1, run };
@@ -36,6 +36,13 @@ find_program(LLVM_OPT_EXECUTABLE opt
 )
 find_program(LLVM_OPT_EXECUTABLE opt)
 
+find_program(LLVM_LINK_EXECUTABLE llvm-link
+  PATHS
+  $ENV{LLVM_HOME}
+  NO_DEFAULT_PATH
+)
+find_program(LLVM_LINK_EXECUTABLE llvm-link)
+
 if (NOT LLVM_CONFIG_EXECUTABLE)
   message(FATAL_ERROR "Could not find llvm-config")
 endif (NOT LLVM_CONFIG_EXECUTABLE)
@@ -48,9 +55,14 @@ if (NOT LLVM_OPT_EXECUTABLE)
   message(FATAL_ERROR "Could not find llvm opt")
 endif (NOT LLVM_OPT_EXECUTABLE)
 
+if (NOT LLVM_LINK_EXECUTABLE)
+  message(FATAL_ERROR "Could not find llvm-link")
+endif (NOT LLVM_LINK_EXECUTABLE)
+
 message(STATUS "LLVM llvm-config found at: ${LLVM_CONFIG_EXECUTABLE}")
 message(STATUS "LLVM clang++ found at: ${LLVM_CLANG_EXECUTABLE}")
 message(STATUS "LLVM opt found at: ${LLVM_OPT_EXECUTABLE}")
+message(STATUS "LLVM llvm-link found at: ${LLVM_LINK_EXECUTABLE}")
 
 execute_process(
   COMMAND ${LLVM_CONFIG_EXECUTABLE} --includedir
@@ -9,14 +9,56 @@
 extern void InitializeAllAssertions();
 #endif
 
+// Turns the checks of a kind, a "<file>:<line>" or "all" on or off at run
+// time, in modules instrumented with -assertions-switches. Returns how many
+// check sites were switched.
+#ifndef __ASSERTIONS_ANALYSER__
+#define SetAssertionsEnabled(PATTERN, ON) 0
+#else
+extern int __assertions_set_enabled(const char *pattern, int on);
+#define SetAssertionsEnabled(PATTERN, ON) \
+  __assertions_set_enabled(PATTERN, ON)
+#endif
+
+// Turns all checks on or off, for the calls to functions with assertions
+// made from then on, in modules instrumented with -assertions-clones.
+#ifndef __ASSERTIONS_ANALYSER__
+#define SetAssertionsChecked(ON)
+#else
+extern void __assertions_set_checked(int on);
+#define SetAssertionsChecked(ON) __assertions_set_checked(ON)
+#endif
+
+// Drops the states of the asserted fields of the struct PTR points to, for
+// objects whose memory is reused without going through free() or delete
+// (e.g. a pool allocator). PTR must have the struct's pointer type.
+#ifndef __ASSERTIONS_ANALYSER__
+#define ForgetAssertedFields(PTR)
+#else
+extern void __assertions_forget_fields(const void *obj);
+#define ForgetAssertedFields(PTR) __assertions_forget_fields(PTR)
+#endif
+
 #define __assert_monotonic \
   __attribute__((annotate("assertion,monotonic")))
 
 #define __assert_ge(NR)  __attribute__(( annotate("assertion,ge("#NR")" )))
 
+// Values spread evenly over [FROM, TO], for integer variables of any width.
+// FROM and TO are ints.
 #define __assert_uniform(FROM, TO) \
   __attribute__((annotate("assertion,dist(uniform," #FROM "," #TO ")")))
 
+// On arrays: every element is >= the one before it, >= NR, or in [LO, HI].
+#define __assert_sorted \
+  __attribute__((annotate("assertion,sorted")))
+
+#define __assert_all_ge(NR) \
+  __attribute__((annotate("assertion,all_ge(" #NR ")")))
+
+#define __assert_all_within(LO, HI) \
+  __attribute__((annotate("assertion,all_within(" #LO "," #HI ")")))
+
 // #define __default_state(...) 
 
 #endif
@@ -14,10 +14,268 @@
 #endif
 
 
+// Every instrumented module gets linked with its own copy of the run-time
+// (Assertions.bc), so anything shared between them must be weak, and the
+// program's linker keeps only one of each.
+#define RUNTIME_SHARED __attribute__((weak))
+
 #define STRUCT(ASSERTION)  ASSERTION##_state
 
 #define STRUCT_DEFAULT(ASSERTION) \
-  const STRUCT(ASSERTION) ASSERTION##_state_default
+  RUNTIME_SHARED const STRUCT(ASSERTION) ASSERTION##_state_default
+
+// Site descriptors
+// ==============================================
+
+// Where an assertion is checked. The instrumenter emits a read-only table of
+// these for each module, and registers it from a constructor. The run-time
+// functions get passed the address of the site's descriptor, a link-time
+// constant.
+typedef struct {
+  // Index into all the tables registered so far. UINT32_MAX until the
+  // table is registered: failures are then still reported, not counted.
+  uint32_t id;
+  // Where sites can't be switched by patching code (see below), whether
+  // the site's checks run; starts at 1.
+  uint8_t on;
+} __assertion_site_data;
+
+typedef struct {
+  const char *file;
+  int line;
+  const char *kind;
+  const char **props;
+  // What the run-time writes about the site, in a separate writable array
+  // of the module.
+  __assertion_site_data *data;
+} __assertion_site;
+
+// Gives the sites their ids, which follow those of earlier tables.
+void __assertions_register_sites(const __assertion_site *sites,
+                                 uint32_t count);
+
+// NULL if the site isn't registered.
+const __assertion_site *__assertions_site(uint32_t id);
+
+// Site switches
+// ==============================================
+
+// With -assertions-switches, each check site starts by moving an immediate
+// (1) into a register, and skips the check if it is 0. The instrumenter
+// puts one of these in the assertions_keys section for each such move.
+// This needs x86 and ELF; on other targets, sites load the on flag of their
+// data instead. So do keyed sites that are on, once the run-time failed to
+// make some code writable and set __assertions_switch_by_flag.
+typedef struct {
+  uint8_t *end;                  // right past the move; the immediate is before
+  const __assertion_site *site;
+} __assertion_key;
+
+// Registers the keys in [begin, end), which are those of every module linked
+// into the same executable or shared object, and switches them as
+// ASSERTIONS_DISABLE and ASSERTIONS_ENABLE (and any __assertions_set_enabled()
+// so far) say. Each such module registers the same range; only the first
+// call does anything.
+void __assertions_register_keys(__assertion_key *begin, __assertion_key *end);
+
+// Registers a module's sites that are switched by their on flag, and
+// switches them in the same way.
+void __assertions_register_flags(const __assertion_site *sites,
+                                 uint32_t count);
+
+// Turns the checks of the sites matching pattern on or off: a kind, a
+// "<file>:<line>" (the file may be given without its directories), or "all".
+// Also applies to modules registered later. Returns how many check sites
+// were switched, counting a patched site once for each copy the optimizer
+// made of it.
+int __assertions_set_enabled(const char *pattern, int on);
+
+// Unchecked clones
+// ==============================================
+
+// With -assertions-clones, functions with assertions start by reading this,
+// and run their unchecked copy if it is 0. 1 unless ASSERTIONS_CHECKED=0.
+extern uint8_t __assertions_checked;
+
+// Turns checking on (1) or off (0) for the calls that start from now on.
+void __assertions_set_checked(int on);
+
+// Profiling
+// ==============================================
+
+// With -assertions-profile, every check at a site is followed by this, with
+// the cycles it took (0 if only hits are counted). Counts go to the
+// thread's own block, and a report of the sites by total cost is written at
+// exit, to stderr or to the file ASSERTIONS_PROFILE names.
+void __assertions_profile(const __assertion_site *site, uint64_t cycles);
+
+// Writes the report now.
+void __assertions_dump_profile(void);
+
+// Failure handling
+// ==============================================
+
+// What to do when an assertion fails, chosen at run time through the
+// ASSERTIONS_ON_FAILURE environment variable (abort, log-once, count or
+// rate-limit), or __assertions_set_failure_policy().
+typedef enum {
+  // Report the failure and abort() (default).
+  FAILURE_ABORT,
+  // Report only the first failure of each site, keep going.
+  FAILURE_LOG_ONCE,
+  // Only count failures. They are listed at exit.
+  FAILURE_COUNT,
+  // Report at most one failure per site every ASSERTIONS_LOG_INTERVAL
+  // seconds (1 by default), keep going.
+  FAILURE_RATE_LIMIT
+} failure_policy;
+
+void __assertions_set_failure_policy(failure_policy policy);
+
+// Counts a failure of the site, and returns whether it should be reported,
+// in which case it already printed the first line of the report.
+int __assertions_fail(const __assertion_site *site, const char *assertion,
+                      const char *cond, const char *src_file, int src_line);
+
+// Called once the report of a failure is complete.
+void __assertions_fail_done(void);
+
+// Prints how many times each site failed so far, in all threads. Also called
+// at exit, and on the signal given in ASSERTIONS_DUMP_SIGNAL (a number).
+void __assertions_dump_failures(void);
+
+// State pool
+// ==============================================
+
+// Returns a block of at least size bytes, 16-byte aligned, from the calling
+// thread's pool. Never calls malloc(). Aborts if out of memory.
+void *__assertions_pool_alloc(uint32_t size);
+
+// The blocks a thread allocated after taking a mark go back to its pool, all
+// at once, when it releases to that mark. Marks nest like function calls.
+void *__assertions_pool_mark(void);
+void __assertions_pool_release(void *mark);
+
+// Asynchronous checks
+// ==============================================
+
+// With -assertions-async, the init, update and check calls of local
+// variables that need no state become entries in a queue of the calling
+// thread, which a checker thread started by the run-time goes through in
+// order. Each entry holds a function made by the instrumenter that makes
+// the call (drain), the state, the value (as 64 bits) and the site. When the queue is full, the thread
+// waits for room if ASSERTIONS_ASYNC_FULL=block, and otherwise runs the
+// queued calls and its own itself. Calls from a signal handler that
+// interrupted its thread in the queue run right away. The checker thread is
+// started again in children after fork().
+typedef void (*__assertions_drain)(uint64_t value, void *state,
+                                   const __assertion_site *site);
+void __assertions_async(__assertions_drain drain, void *state,
+                        uint64_t value, const __assertion_site *site);
+
+// Shadow map
+// ==============================================
+
+// States of the assertions on fields of heap objects, looked up by the
+// address of the field, since the object has nowhere to keep them.
+
+// The state of the field at addr, or NULL if it has none yet.
+void *__assertions_shadow_lookup(const void *addr);
+
+// Gives the field at addr a new, zeroed state of size bytes, and returns it.
+// If another thread's first store to the field created one meanwhile,
+// returns that one instead.
+void *__assertions_shadow_create(const void *addr, uint32_t size);
+
+// Drops the states of the fields at the given offsets in the object at obj.
+// The instrumenter calls it with the asserted fields of the object's struct
+// type before each free() or delete of the object, and where the program
+// calls ForgetAssertedFields().
+void __assertions_shadow_forget(const void *obj, const uint32_t *offsets,
+                                uint32_t count);
+
+// The same for the object realloc() moved from `from` to `to`, if it did.
+void __assertions_shadow_moved(const void *from, const void *to,
+                               const uint32_t *offsets, uint32_t count);
+
+// Value types
+// ==============================================
+
+// The types of values that assertions can be put on, as
+// X(SUFFIX, CTYPE, SLOT). An assertion that works on all of them defines its
+// functions once, in a macro taking these, and expands it with
+// FOR_EACH_VALUE_TYPE. The instrumenter then calls e.g. __update_ge_u16 for
+// an unsigned short variable, with no conversions. Signedness comes from the
+// debug info, and defaults to signed.
+#define FOR_EACH_VALUE_TYPE(X)                   \
+  FOR_EACH_INT_VALUE_TYPE(X)                     \
+  X(f32, float,    f)  X(f64, double,   f)
+
+// The same, for assertions that only make sense on integers.
+#define FOR_EACH_INT_VALUE_TYPE(X)               \
+  X(i8,  int8_t,   i)  X(u8,  uint8_t,  u)       \
+  X(i16, int16_t,  i)  X(u16, uint16_t, u)       \
+  X(i32, int32_t,  i)  X(u32, uint32_t, u)       \
+  X(i64, int64_t,  i)  X(u64, uint64_t, u)
+
+// Holds a value of any of those types in a state, in the slot named by SLOT,
+// so that one state type does for all of them.
+typedef union {
+  int64_t i;
+  uint64_t u;
+  double f;
+} assertion_value;
+
+// printf() format and argument for a value, by SLOT.
+#define VALUE_FMT_i "%lld"
+#define VALUE_FMT_u "%llu"
+#define VALUE_FMT_f "%g"
+#define VALUE_ARG_i(V) ((long long) (V))
+#define VALUE_ARG_u(V) ((unsigned long long) (V))
+#define VALUE_ARG_f(V) ((double) (V))
+// The C type of the slot.
+#define VALUE_TYPE_i int64_t
+#define VALUE_TYPE_u uint64_t
+#define VALUE_TYPE_f double
+
+#define INSTRUMENT_update_typed(ASSERTION, SUFFIX, CTYPE)   \
+   inline extern                                            \
+   void __update_##ASSERTION##_##SUFFIX(                    \
+      const CTYPE newVal, STRUCT(ASSERTION) *state,         \
+      const __assertion_site *site)
+
+#define INSTRUMENT_update_atomic_typed(ASSERTION, SUFFIX, CTYPE) \
+   inline extern                                            \
+   void __update_atomic_##ASSERTION##_##SUFFIX(             \
+      const CTYPE newVal, STRUCT(ASSERTION) *state,         \
+      const __assertion_site *site)
+
+#define INSTRUMENT_init_typed(ASSERTION, SUFFIX)            \
+   inline extern                                            \
+   void __init_##ASSERTION##_##SUFFIX(                      \
+      STRUCT(ASSERTION) *state,                             \
+      const uint8_t *addr, const char **props,              \
+      const __assertion_site *site)
+
+#define INSTRUMENT_refresh_typed(ASSERTION, SUFFIX, CTYPE)  \
+   inline extern                                            \
+   void __refresh_##ASSERTION##_##SUFFIX(                   \
+      const CTYPE newVal, STRUCT(ASSERTION) *state)
+
+// Assertions whose props are all integers can do without a state by
+// defining this, with one integer parameter per prop, in order, e.g.
+// INSTRUMENT_check_typed(ge, SUFFIX, CTYPE, int than). The instrumenter
+// then calls it for the initial value of the variable, instead of the init
+// function, and for each update, instead of the update function. It passes
+// the props as constants, to a copy of the function specialized for them,
+// so that checking compares against immediates.
+#define INSTRUMENT_check_typed(ASSERTION, SUFFIX, CTYPE, ...) \
+   inline extern                                            \
+   void __check_##ASSERTION##_##SUFFIX(                     \
+      const CTYPE newVal, __VA_ARGS__, const __assertion_site *site)
+
+// Functions of assertions on one type only
+// ==============================================
 
 // CTYPE should take the form of /u?int\d+_t/, e.g. uint8_t
 // These types are defined in stdint.h
@@ -25,7 +283,39 @@
    inline extern                                     \
    void __update_##ASSERTION(                        \
       const CTYPE newVal, STRUCT(ASSERTION) *state,  \
-      const char *file, int line)
+      const __assertion_site *site)
+
+// Assertions on every element of an array define this instead: it checks
+// the count elements from first on, all at once, and takes the props as
+// parameters too, like INSTRUMENT_check_typed. The instrumenter calls it on
+// the range written after memcpy(), memset() or a store into the array, and
+// on the whole array after a loop that writes to it.
+#define INSTRUMENT_range_typed(ASSERTION, SUFFIX, CTYPE, ...) \
+   inline extern                                            \
+   void __range_##ASSERTION##_##SUFFIX(                     \
+      const CTYPE *first, uint64_t count, ##__VA_ARGS__,    \
+      const __assertion_site *site)
+
+#define INSTRUMENT_check(ASSERTION, CTYPE, ...)      \
+   inline extern                                     \
+   void __check_##ASSERTION(                         \
+      const CTYPE newVal, __VA_ARGS__, const __assertion_site *site)
+
+// Same as the update function, but safe to run concurrently on the same
+// state, without locks. Return value assertions use it when the instrumenter
+// is asked to share their state between threads (-assertions-callee-state=
+// atomic). Kinds whose update doesn't write the state don't need one.
+#define INSTRUMENT_update_atomic(ASSERTION, CTYPE)   \
+   inline extern                                     \
+   void __update_atomic_##ASSERTION(                 \
+      const CTYPE newVal, STRUCT(ASSERTION) *state,  \
+      const __assertion_site *site)
+
+// The props passed to init and alloc functions are a NULL-terminated array,
+// with integer props cast to pointers. An integer prop of 0 can't be told
+// from the end, so the array is preceded by the number of props, which this
+// reads.
+#define PROPS_COUNT(props) ((int) (intptr_t) (props)[-1])
 
 // State is being allocated automatically, and passed to the function to avoid
 // Clang ABI lowering. (for instance, returning an { i32 } would be lowered to
@@ -35,21 +325,40 @@
    void __init_##ASSERTION(                        \
       STRUCT(ASSERTION) *state,                    \
       const uint8_t *addr, const char **props,     \
-      const char *file, int line)
+      const __assertion_site *site)
+
+// Only used by sampled checking: called instead of the update function for
+// the updates that are not checked, so that assertions which keep track of
+// previous values (e.g. monotonic) can still do so, cheaply. Stateless
+// assertions don't need to provide one.
+#define INSTRUMENT_refresh(ASSERTION, CTYPE)          \
+   inline extern                                      \
+   void __refresh_##ASSERTION(                        \
+      const CTYPE newVal, STRUCT(ASSERTION) *state)
 
+// States too large for the stack (histograms, windows of values, ...) can
+// come from the per-thread state pool instead, by defining this for the
+// assertion, usually as
+//   { return __assertions_pool_alloc(sizeof(STRUCT(ASSERTION))); }
+// The instrumenter then calls it when the function declaring the variable
+// is entered, before the init function, and the state goes back to the pool
+// when the function returns.
 #define INSTRUMENT_alloc(ASSERTION)                \
    inline extern                                   \
-    STRUCT(ASSERTION) __alloc_##ASSERTION(         \
-      const uint8_t *addr, const char **props)
+   STRUCT(ASSERTION) *__alloc_##ASSERTION(         \
+      const char **props)
 
 
 
+// FAIL_BLOCK adds details to the report, so it only runs when the failure is
+// reported.
 #define EXPECT(ASSERTION, COND, FAIL_BLOCK)        \
   do {                                             \
-    if (__builtin_expect(!COND, 0)) {              \
-      fprintf(stderr, "%s:%d: failed "ASSERTION" assertion `%s' (%s:%d).\n", file, line, #COND, __FILE__, __LINE__); \
-      do { FAIL_BLOCK } while(0);                  \
-      abort();                                     \
+    if (__builtin_expect(!(COND), 0)) {            \
+      if (__assertions_fail(site, ASSERTION, #COND, __FILE__, __LINE__)) { \
+        do { FAIL_BLOCK } while(0);                \
+        __assertions_fail_done();                  \
+      }                                            \
     }                                              \
   } while (0)
   // __assert(#COND, file, line); \
@@ -1,44 +1,417 @@
 #include "AssertionBase.h"
 #include <limits.h>
+#include <string.h>
 
 // monotonic
 // ==============================================
 
 typedef struct {
-  int prev;
+  assertion_value prev;
 } STRUCT(monotonic);
 
-STRUCT_DEFAULT(monotonic) = { .prev = 0 }; // INT_MIN?
+STRUCT_DEFAULT(monotonic) = { .prev = { .i = 0 } }; // INT_MIN?
 
-INSTRUMENT_init(monotonic) {
-  // Initialise "prev" with the current value.
-  state->prev = *(const int *)addr;
+#define MONOTONIC(SUFFIX, CTYPE, SLOT)                                      \
+  INSTRUMENT_init_typed(monotonic, SUFFIX) {                                \
+    /* Initialise "prev" with the current value. */                         \
+    state->prev.SLOT = *(const CTYPE *) addr;                               \
+  }                                                                         \
+                                                                            \
+  INSTRUMENT_update_typed(monotonic, SUFFIX, CTYPE) {                       \
+    EXPECT("monotonic", newVal >= (CTYPE) state->prev.SLOT,                 \
+    {                                                                       \
+      printf("While updating: old=" VALUE_FMT_##SLOT                        \
+             ", new=" VALUE_FMT_##SLOT "\n",                                \
+             VALUE_ARG_##SLOT(state->prev.SLOT), VALUE_ARG_##SLOT(newVal)); \
+    });                                                                     \
+    state->prev.SLOT = newVal;                                              \
+  }                                                                         \
+                                                                            \
+  INSTRUMENT_update_atomic_typed(monotonic, SUFFIX, CTYPE) {                \
+    /* Swapping the value in gives the one it follows, whichever thread */  \
+    /* stored it. */                                                        \
+    assertion_value next, prev;                                             \
+    next.SLOT = newVal;                                                     \
+    __atomic_exchange(&state->prev, &next, &prev, __ATOMIC_RELAXED);        \
+    EXPECT("monotonic", newVal >= (CTYPE) prev.SLOT,                        \
+    {                                                                       \
+      printf("While updating: old=" VALUE_FMT_##SLOT                        \
+             ", new=" VALUE_FMT_##SLOT "\n",                                \
+             VALUE_ARG_##SLOT(prev.SLOT), VALUE_ARG_##SLOT(newVal));        \
+    });                                                                     \
+  }                                                                         \
+                                                                            \
+  INSTRUMENT_refresh_typed(monotonic, SUFFIX, CTYPE) {                      \
+    state->prev.SLOT = newVal;                                              \
+  }
+
+FOR_EACH_VALUE_TYPE(MONOTONIC)
+
+// ge (greater or equal)
+// ==============================================
+
+// Checked with __check_ge_*, against the bound as a constant, whenever the
+// instrumenter knows it. Otherwise the bound is kept in the value's own
+// slot, so checking is still one comparison.
+typedef struct { assertion_value than; } STRUCT(ge);
+
+// Sets the slot from the (int) bound. No unsigned value is below a negative
+// bound.
+#define GE_BOUND_i(THAN) (THAN)
+#define GE_BOUND_u(THAN) ((THAN) < 0 ? 0 : (THAN))
+#define GE_BOUND_f(THAN) (THAN)
+
+#define GE(SUFFIX, CTYPE, SLOT)                                             \
+  INSTRUMENT_update_typed(ge, SUFFIX, CTYPE) {                              \
+    EXPECT("ge", newVal >= state->than.SLOT,                                \
+    {                                                                       \
+      printf("New value " VALUE_FMT_##SLOT " is not >= " VALUE_FMT_##SLOT   \
+             "\n", VALUE_ARG_##SLOT(newVal),                                \
+             VALUE_ARG_##SLOT(state->than.SLOT));                           \
+    });                                                                     \
+  }                                                                         \
+                                                                            \
+  INSTRUMENT_check_typed(ge, SUFFIX, CTYPE, int than) {                     \
+    const VALUE_TYPE_##SLOT bound = GE_BOUND_##SLOT(than);                  \
+    EXPECT("ge", newVal >= bound,                                           \
+    {                                                                       \
+      printf("New value " VALUE_FMT_##SLOT " is not >= " VALUE_FMT_##SLOT   \
+             "\n", VALUE_ARG_##SLOT(newVal), VALUE_ARG_##SLOT(bound));      \
+    });                                                                     \
+  }                                                                         \
+                                                                            \
+  INSTRUMENT_init_typed(ge, SUFFIX) {                                       \
+    /* *props has to be the number */                                       \
+    state->than.SLOT = GE_BOUND_##SLOT((int) (intptr_t) *props);            \
+    CTYPE val = *(const CTYPE *) addr;                                      \
+    /* Just call the update function to check the assertion. */             \
+    __update_ge_##SUFFIX(val, state, site);                                 \
+  }
+
+FOR_EACH_VALUE_TYPE(GE)
+
+// dist (values follow a distribution)
+// ==============================================
+
+// Only "uniform" for now: dist(uniform, FROM, TO), both ends included, on
+// integers of any width.
+//
+// Values are counted into a fixed number of buckets, and every DIST_WINDOW
+// values a chi-square test checks the counts against the distribution, then
+// starts over. So the state has a constant size, an update is a
+// multiplication and an increment, and a distribution that drifts away
+// later on is still caught.
+
+#define DIST_BUCKETS 16
+#define DIST_WINDOW 4096
+
+typedef struct {
+  int64_t from;
+  // How many values are in [from, to], and how many of them fall into each
+  // bucket. The bounds are ints, so there are at most 2^32.
+  uint64_t values;
+  uint32_t width[DIST_BUCKETS];
+  uint32_t buckets;
+  // 32.32 fixed point: bucket = (value - from) * scale >> 32.
+  uint64_t scale;
+  uint32_t samples;
+  uint32_t counts[DIST_BUCKETS];
+} STRUCT(dist);
+
+STRUCT_DEFAULT(dist) = { .values = 1, .buckets = 1, .scale = 0 };
+
+// Too large to take a frame's cache lines from the other states.
+INSTRUMENT_alloc(dist) {
+  return __assertions_pool_alloc(sizeof(STRUCT(dist)));
 }
 
-INSTRUMENT_update(monotonic, int32_t) {
-  // DEBUG(printf("MONOTONIC: old=%d, new=%d\n", state->prev, newVal));
-  EXPECT("monotonic", newVal >= state->prev, 
+// Chi-square values that a uniform sample exceeds with probability 1e-6, by
+// degrees of freedom (buckets - 1). Failures are checked continuously, so
+// this has to be low enough not to report a correct distribution every few
+// million updates.
+static const double dist_chi2_limit[DIST_BUCKETS] = {
+  0.0, 23.93, 27.63, 30.66, 33.38, 35.89, 38.26, 40.52,
+  42.70, 44.81, 46.86, 48.87, 50.83, 52.75, 54.64, 56.49
+};
+
+__attribute__((noinline))
+static void dist_test(STRUCT(dist) *state, const __assertion_site *site) {
+  double chi2 = 0;
+  for (uint32_t b = 0; b < state->buckets; ++b) {
+    double expected = (double) DIST_WINDOW * state->width[b] / state->values;
+    double diff = state->counts[b] - expected;
+    chi2 += diff * diff / expected;
+  }
+  EXPECT("dist", chi2 <= dist_chi2_limit[state->buckets - 1],
   {
-    printf("While updating: old=%d, new=%d\n", state->prev, newVal);
+    printf("Last %d values are not uniform (chi-square %.2f > %.2f), "
+           "counts per bucket:", DIST_WINDOW, chi2,
+           dist_chi2_limit[state->buckets - 1]);
+    for (uint32_t b = 0; b < state->buckets; ++b)
+      printf(" %u", state->counts[b]);
+    printf("\n");
   });
-  state->prev = newVal;
+  state->samples = 0;
+  memset(state->counts, 0, sizeof(state->counts));
 }
 
-// ge (greater or equal)
+__attribute__((noinline))
+static void dist_start(STRUCT(dist) *state, const char **props, int unsign) {
+  if (PROPS_COUNT(props) != 3 || strcmp(props[0], "uniform")) {
+    fprintf(stderr, "dist: only dist(uniform, FROM, TO) is supported\n");
+    abort();
+  }
+  int from = (int) (intptr_t) props[1], to = (int) (intptr_t) props[2];
+  // No unsigned value is below 0.
+  if (unsign && from < 0)
+    from = 0;
+  if (to < from) {
+    fprintf(stderr, "dist: empty range [%d, %d]\n", from, to);
+    abort();
+  }
+  memset(state, 0, sizeof(*state));
+  state->from = from;
+  state->values = (uint64_t) ((int64_t) to - from) + 1;
+  state->buckets = state->values < DIST_BUCKETS ?
+    (uint32_t) state->values : DIST_BUCKETS;
+  // Rounded down, so the last value still lands in the last bucket.
+  state->scale = ((uint64_t) state->buckets << 32) / state->values;
+  // Bucket b starts at the first offset with offset * scale >= b << 32.
+  uint64_t start = 0;
+  for (uint32_t b = 0; b < state->buckets; ++b) {
+    uint64_t next = b + 1 == state->buckets ? state->values :
+      (((uint64_t) (b + 1) << 32) + state->scale - 1) / state->scale;
+    if (next > state->values)
+      next = state->values;
+    state->width[b] = (uint32_t) (next - start);
+    start = next;
+  }
+}
+
+// In 64 bits, values below "from" wrap around to far above the range, which
+// spans at most 2^32 values, whatever the type.
+#define DIST(SUFFIX, CTYPE, SLOT)                                           \
+  INSTRUMENT_update_typed(dist, SUFFIX, CTYPE) {                            \
+    uint64_t offset = (uint64_t) newVal - (uint64_t) state->from;           \
+    EXPECT("dist", offset < state->values,                                  \
+    {                                                                       \
+      printf("Value " VALUE_FMT_##SLOT " is outside of [%lld, %lld]\n",     \
+             VALUE_ARG_##SLOT(newVal), (long long) state->from,             \
+             (long long) (state->from + state->values - 1));                \
+    });                                                                     \
+    if (__builtin_expect(offset >= state->values, 0))                       \
+      return;                                                               \
+    state->counts[(offset * state->scale) >> 32]++;                         \
+    if (__builtin_expect(++state->samples == DIST_WINDOW, 0))               \
+      dist_test(state, site);                                               \
+  }                                                                         \
+                                                                            \
+  INSTRUMENT_init_typed(dist, SUFFIX) {                                     \
+    /* The initial value at addr is not a sample. */                        \
+    dist_start(state, props, #SLOT[0] == 'u');                              \
+  }
+
+FOR_EACH_INT_VALUE_TYPE(DIST)
+
+// sorted, all_ge, all_within (every element of an array)
 // ==============================================
-typedef struct { int than; } STRUCT(ge);
 
-INSTRUMENT_update(ge, int32_t) {
-  EXPECT("ge", newVal >= state->than, 
-  {
-    printf("New value %d is not >= %d\n", newVal, state->than);
-  });
+// sorted: each element is >= the one before it. all_ge(N): each element is
+// >= N. all_within(LO, HI): each element is in [LO, HI]. Checked over whole
+// ranges of the array at once (see INSTRUMENT_range_typed), and stateless.
+//
+// A range is gone through in blocks. Whether a block holds a bad element is
+// found without branching on each one: 8 (AVX2) or 4 (SSE2) 32-bit elements
+// per instruction, or, for the other types, in loops the vectorizer can
+// turn into the same. Only a block that holds one is searched for it.
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define RANGE_LANES 8
+typedef __m256i range_vec;
+#define RANGE_LOAD(P)     _mm256_loadu_si256((const __m256i *) (P))
+#define RANGE_SPLAT(X)    _mm256_set1_epi32(X)
+#define RANGE_ZERO()      _mm256_setzero_si256()
+#define RANGE_GT(A, B)    _mm256_cmpgt_epi32(A, B)
+#define RANGE_OR(A, B)    _mm256_or_si256(A, B)
+#define RANGE_XOR(A, B)   _mm256_xor_si256(A, B)
+#define RANGE_ANY(M)      (_mm256_movemask_epi8(M) != 0)
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define RANGE_LANES 4
+typedef __m128i range_vec;
+#define RANGE_LOAD(P)     _mm_loadu_si128((const __m128i *) (P))
+#define RANGE_SPLAT(X)    _mm_set1_epi32(X)
+#define RANGE_ZERO()      _mm_setzero_si128()
+#define RANGE_GT(A, B)    _mm_cmpgt_epi32(A, B)
+#define RANGE_OR(A, B)    _mm_or_si128(A, B)
+#define RANGE_XOR(A, B)   _mm_xor_si128(A, B)
+#define RANGE_ANY(M)      (_mm_movemask_epi8(M) != 0)
+#endif
+
+#define RANGE_BLOCK 256
+
+#ifdef RANGE_LANES
+// 32-bit elements. Flipping the sign bit of unsigned ones orders them as
+// signed ones, which is all SSE2 and AVX2 compare.
+#define RANGE_SIMD_i 1
+#define RANGE_SIMD_u 1
+#define RANGE_SIMD_f 0
+#define RANGE_FLIP_i 0
+#define RANGE_FLIP_u INT32_MIN
+#define RANGE_FLIP_f 0
+
+// Whether any of v[0, n) is below lo, or above hi.
+static int range_simd_outside(const int32_t *v, uint64_t n, int32_t lo,
+                              int32_t hi, int32_t flip) {
+  range_vec f = RANGE_SPLAT(flip);
+  range_vec l = RANGE_SPLAT(lo ^ flip), h = RANGE_SPLAT(hi ^ flip);
+  range_vec bad = RANGE_ZERO();
+  uint64_t i = 0;
+  for (; i + RANGE_LANES <= n; i += RANGE_LANES) {
+    range_vec x = RANGE_XOR(RANGE_LOAD(v + i), f);
+    bad = RANGE_OR(bad, RANGE_OR(RANGE_GT(l, x), RANGE_GT(x, h)));
+  }
+  int any = RANGE_ANY(bad);
+  for (; i < n; ++i)
+    any |= ((v[i] ^ flip) < (lo ^ flip)) | ((v[i] ^ flip) > (hi ^ flip));
+  return any;
 }
 
-INSTRUMENT_init(ge) {
-  // *props has to be the number
-  state->than = (int) *props;
-  int val = *(const int *) addr;
-  // Just call the update function to check the assertion.
-  __update_ge(val, state, file, line);
+// Whether any of v[1, n) is below the element before it.
+static int range_simd_descent(const int32_t *v, uint64_t n, int32_t flip) {
+  range_vec f = RANGE_SPLAT(flip);
+  range_vec bad = RANGE_ZERO();
+  uint64_t i = 1;
+  for (; i + RANGE_LANES <= n; i += RANGE_LANES) {
+    range_vec prev = RANGE_XOR(RANGE_LOAD(v + i - 1), f);
+    bad = RANGE_OR(bad, RANGE_GT(prev, RANGE_XOR(RANGE_LOAD(v + i), f)));
+  }
+  int any = RANGE_ANY(bad);
+  for (; i < n; ++i)
+    any |= (v[i - 1] ^ flip) > (v[i] ^ flip);
+  return any;
 }
+#endif
+
+// No unsigned value is in a range that ends below 0.
+#define RANGE_EMPTY_i(HI) 0
+#define RANGE_EMPTY_u(HI) ((HI) < 0)
+#define RANGE_EMPTY_f(HI) 0
+
+// Bounds are compared in the slot's type, so that they don't wrap around
+// in narrower ones. NaN is never in order, nor in bounds.
+#define RANGE(SUFFIX, CTYPE, SLOT)                                          \
+  static int range_any_outside_##SUFFIX(const CTYPE *v, uint64_t n,         \
+                                        VALUE_TYPE_##SLOT lo,               \
+                                        VALUE_TYPE_##SLOT hi) {             \
+    if (RANGE_SIMD(SLOT) && sizeof(CTYPE) == 4)                             \
+      return RANGE_SIMD_OUTSIDE(SLOT, v, n, lo, hi);                        \
+    int any = 0;                                                            \
+    for (uint64_t i = 0; i < n; ++i)                                        \
+      any |= !(v[i] >= lo) | !(v[i] <= hi);                                 \
+    return any;                                                             \
+  }                                                                         \
+                                                                            \
+  static int range_any_descent_##SUFFIX(const CTYPE *v, uint64_t n) {       \
+    if (RANGE_SIMD(SLOT) && sizeof(CTYPE) == 4)                             \
+      return RANGE_SIMD_DESCENT(SLOT, v, n);                                \
+    int any = 0;                                                            \
+    for (uint64_t i = 1; i < n; ++i)                                        \
+      any |= !(v[i] >= v[i - 1]);                                           \
+    return any;                                                             \
+  }                                                                         \
+                                                                            \
+  /* The first element of v[0, n) out of [lo, hi], or n. */                 \
+  static uint64_t range_first_outside_##SUFFIX(const CTYPE *v, uint64_t n,  \
+                                               VALUE_TYPE_##SLOT lo,        \
+                                               VALUE_TYPE_##SLOT hi) {      \
+    for (uint64_t b = 0; b < n; b += RANGE_BLOCK) {                         \
+      uint64_t e = n - b < RANGE_BLOCK ? n : b + RANGE_BLOCK;               \
+      if (__builtin_expect(range_any_outside_##SUFFIX(v + b, e - b, lo, hi),\
+                           0)) {                                            \
+        for (uint64_t i = b; i < e; ++i)                                    \
+          if (!(v[i] >= lo) || !(v[i] <= hi))                               \
+            return i;                                                       \
+      }                                                                     \
+    }                                                                       \
+    return n;                                                               \
+  }                                                                         \
+                                                                            \
+  /* The first element of v[1, n) below the one before it, or n. */         \
+  static uint64_t range_first_descent_##SUFFIX(const CTYPE *v, uint64_t n) {\
+    for (uint64_t b = 1; b < n; b += RANGE_BLOCK) {                         \
+      uint64_t e = n - b < RANGE_BLOCK ? n : b + RANGE_BLOCK;               \
+      /* Including the pair across the start of the block. */               \
+      if (__builtin_expect(range_any_descent_##SUFFIX(v + b - 1, e - b + 1),\
+                           0)) {                                            \
+        for (uint64_t i = b; i < e; ++i)                                    \
+          if (!(v[i] >= v[i - 1]))                                          \
+            return i;                                                       \
+      }                                                                     \
+    }                                                                       \
+    return n;                                                               \
+  }                                                                         \
+                                                                            \
+  INSTRUMENT_range_typed(sorted, SUFFIX, CTYPE) {                           \
+    uint64_t bad = count ? range_first_descent_##SUFFIX(first, count) : 0;  \
+    EXPECT("sorted", bad == count,                                          \
+    {                                                                       \
+      printf("Element %llu (" VALUE_FMT_##SLOT ") is less than the one "    \
+             "before it (" VALUE_FMT_##SLOT ")\n", (unsigned long long) bad,\
+             VALUE_ARG_##SLOT(first[bad]),                                  \
+             VALUE_ARG_##SLOT(first[bad - 1]));                             \
+    });                                                                     \
+  }                                                                         \
+                                                                            \
+  INSTRUMENT_range_typed(all_ge, SUFFIX, CTYPE, int than) {                 \
+    const VALUE_TYPE_##SLOT lo = GE_BOUND_##SLOT(than);                     \
+    uint64_t bad = range_first_outside_##SUFFIX(first, count, lo,           \
+                                                RANGE_MAX_##SUFFIX);        \
+    EXPECT("all_ge", bad == count,                                          \
+    {                                                                       \
+      printf("Element %llu (" VALUE_FMT_##SLOT ") is not >= "               \
+             VALUE_FMT_##SLOT "\n", (unsigned long long) bad,               \
+             VALUE_ARG_##SLOT(first[bad]), VALUE_ARG_##SLOT(lo));           \
+    });                                                                     \
+  }                                                                         \
+                                                                            \
+  INSTRUMENT_range_typed(all_within, SUFFIX, CTYPE, int from, int to) {     \
+    const VALUE_TYPE_##SLOT lo = GE_BOUND_##SLOT(from);                     \
+    const VALUE_TYPE_##SLOT hi = to;                                        \
+    uint64_t bad = RANGE_EMPTY_##SLOT(to) ? 0 :                             \
+      range_first_outside_##SUFFIX(first, count, lo, hi);                   \
+    EXPECT("all_within", bad == count,                                      \
+    {                                                                       \
+      printf("Element %llu (" VALUE_FMT_##SLOT ") is outside of [%d, %d]\n",\
+             (unsigned long long) bad, VALUE_ARG_##SLOT(first[bad]),        \
+             from, to);                                                     \
+    });                                                                     \
+  }
+
+#ifdef RANGE_LANES
+#define RANGE_SIMD(SLOT) RANGE_SIMD_##SLOT
+#define RANGE_SIMD_OUTSIDE(SLOT, V, N, LO, HI)                              \
+  range_simd_outside((const int32_t *) (V), N, (int32_t) (LO),              \
+                     (int32_t) (HI), RANGE_FLIP_##SLOT)
+#define RANGE_SIMD_DESCENT(SLOT, V, N)                                      \
+  range_simd_descent((const int32_t *) (V), N, RANGE_FLIP_##SLOT)
+#else
+#define RANGE_SIMD(SLOT) 0
+#define RANGE_SIMD_OUTSIDE(SLOT, V, N, LO, HI) 0
+#define RANGE_SIMD_DESCENT(SLOT, V, N) 0
+#endif
+
+// The largest value of each type, as an upper bound that always holds.
+#define RANGE_MAX_i8  INT8_MAX
+#define RANGE_MAX_u8  UINT8_MAX
+#define RANGE_MAX_i16 INT16_MAX
+#define RANGE_MAX_u16 UINT16_MAX
+#define RANGE_MAX_i32 INT32_MAX
+#define RANGE_MAX_u32 UINT32_MAX
+#define RANGE_MAX_i64 INT64_MAX
+#define RANGE_MAX_u64 UINT64_MAX
+#define RANGE_MAX_f32 __builtin_inff()
+#define RANGE_MAX_f64 __builtin_inf()
+
+FOR_EACH_VALUE_TYPE(RANGE)
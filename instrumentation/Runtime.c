@@ -0,0 +1,1209 @@
+// The build compiles this as strict C11, which hides the POSIX and GNU
+// declarations used here (sigaction, mmap flags, pthread_sigmask, ...).
+#define _GNU_SOURCE
+
+#include "AssertionBase.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+// Support functions for the assertions in Assertions.c. Everything here
+// is linked into each instrumented module along with them, so any state is
+// RUNTIME_SHARED.
+
+// Site registry
+// ==============================================
+
+#define MAX_SITE_TABLES 4096
+
+// Reporting state of a site, shared by all threads.
+typedef struct {
+  uint32_t logged;       // for FAILURE_LOG_ONCE
+  uint32_t last_logged;  // for FAILURE_RATE_LIMIT, in seconds
+} site_log;
+
+typedef struct {
+  const __assertion_site *sites;
+  site_log *log;
+  uint32_t base;
+  uint32_t count;
+} site_table;
+
+static void install_failure_dump(void);
+
+// Tables are only ever appended, and lookups only happen when an assertion
+// fails, so lookups don't lock: they only read the tables published before
+// __assertions_site_tables_count.
+RUNTIME_SHARED site_table __assertions_site_tables[MAX_SITE_TABLES];
+RUNTIME_SHARED uint32_t __assertions_site_tables_count;
+RUNTIME_SHARED uint32_t __assertions_sites_count;
+RUNTIME_SHARED uint8_t __assertions_checked = 1;
+RUNTIME_SHARED int __assertions_site_tables_lock;
+
+void __assertions_register_sites(const __assertion_site *sites,
+                                 uint32_t count) {
+  // Registration happens from constructors, and dlopen() at worst, so a
+  // spin lock is plenty.
+  while (__atomic_exchange_n(&__assertions_site_tables_lock, 1,
+                             __ATOMIC_ACQUIRE))
+    ;
+  uint32_t base = __assertions_sites_count;
+  uint32_t n = __assertions_site_tables_count;
+  if (n == 0) {
+    install_failure_dump();
+    const char *checked = getenv("ASSERTIONS_CHECKED");
+    if (checked && !strcmp(checked, "0"))
+      __assertions_set_checked(0);
+  }
+  if (n == MAX_SITE_TABLES) {
+    fprintf(stderr, "assertions: too many instrumented modules, "
+                    "failures will not show where they happened\n");
+  } else {
+    __assertions_site_tables[n].sites = sites;
+    __assertions_site_tables[n].log = calloc(count, sizeof(site_log));
+    __assertions_site_tables[n].base = base;
+    __assertions_site_tables[n].count = count;
+    __atomic_store_n(&__assertions_site_tables_count, n + 1, __ATOMIC_RELEASE);
+  }
+  // Counting is done by id, so sites only get one once their table can be
+  // found from it.
+  for (uint32_t i = 0; i < count; ++i)
+    __atomic_store_n(&sites[i].data->id,
+                     n == MAX_SITE_TABLES ? UINT32_MAX : base + i,
+                     __ATOMIC_RELAXED);
+  __assertions_sites_count = base + count;
+  __atomic_store_n(&__assertions_site_tables_lock, 0, __ATOMIC_RELEASE);
+}
+
+static const site_table *find_table(uint32_t id) {
+  uint32_t n = __atomic_load_n(&__assertions_site_tables_count,
+                               __ATOMIC_ACQUIRE);
+  // Bases are increasing, so this could be a binary search. But this is only
+  // needed to report failures.
+  for (uint32_t i = 0; i < n; ++i) {
+    const site_table *t = &__assertions_site_tables[i];
+    if (id >= t->base && id - t->base < t->count)
+      return t;
+  }
+  return NULL;
+}
+
+const __assertion_site *__assertions_site(uint32_t id) {
+  const site_table *t = find_table(id);
+  return t ? &t->sites[id - t->base] : NULL;
+}
+
+// Unchecked clones
+// ==============================================
+
+void __assertions_set_checked(int on) {
+  __atomic_store_n(&__assertions_checked, on != 0, __ATOMIC_RELAXED);
+}
+
+// Site switches
+// ==============================================
+
+// Each module's keys, or sites with flags, and the rules switching them: the
+// environment's first (ASSERTIONS_DISABLE, then ASSERTIONS_ENABLE,
+// comma-separated patterns), then __assertions_set_enabled()'s. The last
+// rule matching a site wins. Sites no rule matches are on.
+
+#define MAX_SWITCH_RULES 256
+
+typedef struct {
+  __assertion_key *begin, *end;
+} key_module;
+
+typedef struct {
+  const __assertion_site *sites;
+  uint32_t count;
+} flag_module;
+
+typedef struct {
+  char *pattern;
+  int on;
+} switch_rule;
+
+RUNTIME_SHARED key_module __assertions_key_modules[MAX_SITE_TABLES];
+RUNTIME_SHARED uint32_t __assertions_key_modules_count;
+RUNTIME_SHARED flag_module __assertions_flag_modules[MAX_SITE_TABLES];
+RUNTIME_SHARED uint32_t __assertions_flag_modules_count;
+RUNTIME_SHARED int __assertions_switch_env_read;
+RUNTIME_SHARED switch_rule __assertions_switch_rules[MAX_SWITCH_RULES];
+RUNTIME_SHARED uint32_t __assertions_switch_rules_count;
+RUNTIME_SHARED int __assertions_switch_lock;
+RUNTIME_SHARED uint8_t __assertions_switch_by_flag;
+
+static void add_switch_rule(const char *pattern, size_t len, int on) {
+  if (__assertions_switch_rules_count == MAX_SWITCH_RULES) {
+    fprintf(stderr, "assertions: too many switch rules, ignoring '%.*s'\n",
+            (int) len, pattern);
+    return;
+  }
+  switch_rule *r = &__assertions_switch_rules[__assertions_switch_rules_count];
+  r->pattern = malloc(len + 1);
+  memcpy(r->pattern, pattern, len);
+  r->pattern[len] = '\0';
+  r->on = on;
+  ++__assertions_switch_rules_count;
+}
+
+static void add_switch_rules_from_env(const char *name, int on) {
+  const char *env = getenv(name);
+  while (env && *env) {
+    const char *comma = strchr(env, ',');
+    size_t len = comma ? (size_t) (comma - env) : strlen(env);
+    if (len)
+      add_switch_rule(env, len, on);
+    env = comma ? comma + 1 : NULL;
+  }
+}
+
+static int switch_matches(const char *pattern, const __assertion_site *s) {
+  if (!strcmp(pattern, "all"))
+    return 1;
+  if (!s)
+    return 0;
+  const char *colon = strrchr(pattern, ':');
+  if (!colon)
+    return !strcmp(pattern, s->kind);
+  if (atoi(colon + 1) != s->line)
+    return 0;
+  // The file as the site has it, or any path ending in /<file>.
+  size_t n = (size_t) (colon - pattern), len = strlen(s->file);
+  return len >= n && !strncmp(s->file + len - n, pattern, n) &&
+    (len == n || s->file[len - n - 1] == '/');
+}
+
+static int site_wanted(const __assertion_site *s) {
+  int on = 1;
+  for (uint32_t i = 0; i < __assertions_switch_rules_count; ++i) {
+    if (switch_matches(__assertions_switch_rules[i].pattern, s))
+      on = __assertions_switch_rules[i].on;
+  }
+  return on;
+}
+
+// A single byte, so threads running the code see either value. The site's
+// on flag is kept the same, for when code can't be made writable (W^X,
+// SELinux): keyed sites then test their flag too, once their key says on.
+static void key_patch(const __assertion_key *k, int on) {
+  __atomic_store_n(&k->site->data->on, (uint8_t) on, __ATOMIC_RELAXED);
+  uint8_t *imm = k->end - 1;
+  if (*imm == (uint8_t) on)
+    return;
+  uintptr_t page = (uintptr_t) sysconf(_SC_PAGESIZE);
+  void *start = (void *) ((uintptr_t) imm & ~(page - 1));
+  if (mprotect(start, page, PROT_READ | PROT_WRITE | PROT_EXEC)) {
+    if (!__atomic_exchange_n(&__assertions_switch_by_flag, 1,
+                             __ATOMIC_RELAXED))
+      fprintf(stderr, "assertions: can't make code writable to switch "
+                      "checks, switching them by their flags instead\n");
+    return;
+  }
+  __atomic_store_n(imm, (uint8_t) on, __ATOMIC_RELAXED);
+  mprotect(start, page, PROT_READ | PROT_EXEC);
+}
+
+static void switch_lock(void) {
+  while (__atomic_exchange_n(&__assertions_switch_lock, 1, __ATOMIC_ACQUIRE))
+    ;
+}
+
+static void switch_unlock(void) {
+  __atomic_store_n(&__assertions_switch_lock, 0, __ATOMIC_RELEASE);
+}
+
+// With the switch lock held, before switching the first module.
+static void read_switch_env(void) {
+  if (__assertions_switch_env_read)
+    return;
+  __assertions_switch_env_read = 1;
+  add_switch_rules_from_env("ASSERTIONS_DISABLE", 0);
+  add_switch_rules_from_env("ASSERTIONS_ENABLE", 1);
+}
+
+void __assertions_register_keys(__assertion_key *begin, __assertion_key *end) {
+  switch_lock();
+  read_switch_env();
+  uint32_t n = __assertions_key_modules_count;
+  for (uint32_t i = 0; i < n; ++i) {
+    if (__assertions_key_modules[i].begin == begin) {
+      switch_unlock();
+      return;
+    }
+  }
+  if (n == MAX_SITE_TABLES) {
+    fprintf(stderr, "assertions: too many instrumented modules, "
+                    "some checks can't be switched\n");
+  } else {
+    __assertions_key_modules[n].begin = begin;
+    __assertions_key_modules[n].end = end;
+    __assertions_key_modules_count = n + 1;
+  }
+  // Nothing to patch unless a rule turns something off.
+  if (__assertions_switch_rules_count) {
+    for (__assertion_key *k = begin; k < end; ++k)
+      key_patch(k, site_wanted(k->site));
+  }
+  switch_unlock();
+}
+
+void __assertions_register_flags(const __assertion_site *sites,
+                                 uint32_t count) {
+  switch_lock();
+  read_switch_env();
+  uint32_t n = __assertions_flag_modules_count;
+  if (n == MAX_SITE_TABLES) {
+    fprintf(stderr, "assertions: too many instrumented modules, "
+                    "some checks can't be switched\n");
+  } else {
+    __assertions_flag_modules[n].sites = sites;
+    __assertions_flag_modules[n].count = count;
+    __assertions_flag_modules_count = n + 1;
+  }
+  if (__assertions_switch_rules_count) {
+    for (uint32_t i = 0; i < count; ++i)
+      __atomic_store_n(&sites[i].data->on, (uint8_t) site_wanted(&sites[i]),
+                       __ATOMIC_RELAXED);
+  }
+  switch_unlock();
+}
+
+int __assertions_set_enabled(const char *pattern, int on) {
+  int switched = 0;
+  switch_lock();
+  read_switch_env();
+  add_switch_rule(pattern, strlen(pattern), on);
+  for (uint32_t i = 0; i < __assertions_key_modules_count; ++i) {
+    key_module *m = &__assertions_key_modules[i];
+    for (__assertion_key *k = m->begin; k < m->end; ++k) {
+      if (switch_matches(pattern, k->site)) {
+        key_patch(k, on);
+        ++switched;
+      }
+    }
+  }
+  for (uint32_t i = 0; i < __assertions_flag_modules_count; ++i) {
+    flag_module *m = &__assertions_flag_modules[i];
+    for (uint32_t j = 0; j < m->count; ++j) {
+      if (switch_matches(pattern, &m->sites[j])) {
+        __atomic_store_n(&m->sites[j].data->on, (uint8_t) on,
+                         __ATOMIC_RELAXED);
+        ++switched;
+      }
+    }
+  }
+  switch_unlock();
+  return switched;
+}
+
+// Failure counters
+// ==============================================
+
+// Each thread counts the failures of every site in its own block, which
+// is only ever written by that thread, so counting never takes a lock or
+// even an atomic read-modify-write. The blocks are chained in a list that is
+// only ever pushed to, and summed up to report.
+typedef struct thread_failures {
+  struct thread_failures *next;
+  uint32_t count;
+  uint64_t failures[];
+} thread_failures;
+
+RUNTIME_SHARED thread_failures *__assertions_all_failures;
+RUNTIME_SHARED __thread thread_failures *__assertions_my_failures;
+
+static void count_failure(uint32_t id) {
+  thread_failures *mine = __assertions_my_failures;
+  if (__builtin_expect(!mine || id >= mine->count, 0)) {
+    // First failure in this thread, or a module was registered since. The
+    // old block, if any, stays in the list with its counts.
+    uint32_t count = __atomic_load_n(&__assertions_sites_count,
+                                     __ATOMIC_RELAXED);
+    if (id >= count)
+      return;
+    mine = calloc(1, sizeof(thread_failures) + count * sizeof(uint64_t));
+    if (!mine)
+      return;
+    mine->count = count;
+    mine->next = __atomic_load_n(&__assertions_all_failures, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&__assertions_all_failures,
+                                        &mine->next, mine, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      ;
+    __assertions_my_failures = mine;
+  }
+  // Single writer: readers may see a slightly old count, never a torn one.
+  __atomic_store_n(&mine->failures[id],
+    __atomic_load_n(&mine->failures[id], __ATOMIC_RELAXED) + 1,
+    __ATOMIC_RELAXED);
+}
+
+static uint64_t total_failures(uint32_t id) {
+  uint64_t total = 0;
+  for (thread_failures *t = __atomic_load_n(&__assertions_all_failures,
+                                            __ATOMIC_ACQUIRE);
+       t; t = t->next) {
+    if (id < t->count)
+      total += __atomic_load_n(&t->failures[id], __ATOMIC_RELAXED);
+  }
+  return total;
+}
+
+// Profile counters
+// ==============================================
+
+// As for failures, each thread counts in its own block, chained in a list
+// that is only pushed to. Blocks are aligned to cache lines and hold whole
+// lines, so threads counting the same sites never write to the same line.
+
+#define PROFILE_LINE 64
+
+typedef struct {
+  uint64_t hits;
+  uint64_t cycles;
+} site_profile;
+
+typedef struct thread_profile {
+  struct thread_profile *next;
+  uint32_t count;
+  char pad[PROFILE_LINE - sizeof(void *) - sizeof(uint32_t)];
+  site_profile sites[];
+} thread_profile;
+
+RUNTIME_SHARED thread_profile *__assertions_all_profiles;
+RUNTIME_SHARED __thread thread_profile *__assertions_my_profile;
+
+static void install_profile_dump(void);
+
+static thread_profile *new_profile(uint32_t id) {
+  uint32_t count = __atomic_load_n(&__assertions_sites_count,
+                                   __ATOMIC_RELAXED);
+  if (id >= count)
+    return NULL;
+  size_t size = sizeof(thread_profile) + count * sizeof(site_profile);
+  size = (size + PROFILE_LINE - 1) & ~(size_t) (PROFILE_LINE - 1);
+  thread_profile *mine = aligned_alloc(PROFILE_LINE, size);
+  if (!mine)
+    return NULL;
+  memset(mine, 0, size);
+  mine->count = count;
+  mine->next = __atomic_load_n(&__assertions_all_profiles, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&__assertions_all_profiles,
+                                      &mine->next, mine, 1,
+                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    ;
+  if (!mine->next)
+    install_profile_dump();
+  __assertions_my_profile = mine;
+  return mine;
+}
+
+void __assertions_profile(const __assertion_site *site, uint64_t cycles) {
+  uint32_t id = __atomic_load_n(&site->data->id, __ATOMIC_RELAXED);
+  thread_profile *mine = __assertions_my_profile;
+  // First check in this thread, or a module was registered since.
+  if (__builtin_expect(!mine || id >= mine->count, 0) &&
+      !(mine = new_profile(id)))
+    return;
+  site_profile *p = &mine->sites[id];
+  __atomic_store_n(&p->hits,
+    __atomic_load_n(&p->hits, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&p->cycles,
+    __atomic_load_n(&p->cycles, __ATOMIC_RELAXED) + cycles,
+    __ATOMIC_RELAXED);
+}
+
+typedef struct {
+  uint32_t id;
+  site_profile total;
+} profile_entry;
+
+static int by_cost(const void *a, const void *b) {
+  const site_profile *x = &((const profile_entry *) a)->total;
+  const site_profile *y = &((const profile_entry *) b)->total;
+  if (x->cycles != y->cycles)
+    return x->cycles < y->cycles ? 1 : -1;
+  if (x->hits != y->hits)
+    return x->hits < y->hits ? 1 : -1;
+  return 0;
+}
+
+void __assertions_dump_profile(void) {
+  uint32_t count = __atomic_load_n(&__assertions_sites_count,
+                                   __ATOMIC_RELAXED);
+  profile_entry *entries = calloc(count ? count : 1, sizeof(profile_entry));
+  if (!entries)
+    return;
+  uint32_t n = 0;
+  for (uint32_t id = 0; id < count; ++id) {
+    site_profile total = { 0, 0 };
+    for (thread_profile *t = __atomic_load_n(&__assertions_all_profiles,
+                                             __ATOMIC_ACQUIRE);
+         t; t = t->next) {
+      if (id < t->count) {
+        total.hits += __atomic_load_n(&t->sites[id].hits, __ATOMIC_RELAXED);
+        total.cycles += __atomic_load_n(&t->sites[id].cycles,
+                                        __ATOMIC_RELAXED);
+      }
+    }
+    if (total.hits) {
+      entries[n].id = id;
+      entries[n++].total = total;
+    }
+  }
+  qsort(entries, n, sizeof(profile_entry), by_cost);
+
+  const char *path = getenv("ASSERTIONS_PROFILE");
+  FILE *out = path && *path ? fopen(path, "w") : NULL;
+  if (path && *path && !out)
+    fprintf(stderr, "assertions: can't write the profile to %s\n", path);
+  if (!out)
+    out = stderr;
+  fprintf(out, "assertions: profile of %u sites, by total cycles\n", n);
+  fprintf(out, "%16s %14s %10s  %s\n", "cycles", "hits", "cycles/hit",
+          "site");
+  for (uint32_t i = 0; i < n; ++i) {
+    const __assertion_site *s = __assertions_site(entries[i].id);
+    site_profile *p = &entries[i].total;
+    fprintf(out, "%16llu %14llu %10.1f  %s:%d: %s\n",
+            (unsigned long long) p->cycles, (unsigned long long) p->hits,
+            (double) p->cycles / p->hits, s ? s->file : "<unknown>",
+            s ? s->line : 0, s ? s->kind : "?");
+  }
+  if (out != stderr)
+    fclose(out);
+  free(entries);
+}
+
+static void dump_profile_at_exit(void) {
+  __assertions_dump_profile();
+}
+
+static void install_profile_dump(void) {
+  atexit(dump_profile_at_exit);
+}
+
+// Failure policies
+// ==============================================
+
+RUNTIME_SHARED int __assertions_failure_policy = -1;
+RUNTIME_SHARED uint32_t __assertions_log_interval = 1;
+
+void __assertions_set_failure_policy(failure_policy policy) {
+  __atomic_store_n(&__assertions_failure_policy, policy, __ATOMIC_RELAXED);
+}
+
+static failure_policy get_failure_policy(void) {
+  int policy = __atomic_load_n(&__assertions_failure_policy, __ATOMIC_RELAXED);
+  if (policy >= 0)
+    return (failure_policy) policy;
+  // First failure: see what the environment says. Racing threads all come
+  // up with the same answer.
+  policy = FAILURE_ABORT;
+  const char *env = getenv("ASSERTIONS_ON_FAILURE");
+  if (env) {
+    if (!strcmp(env, "log-once"))
+      policy = FAILURE_LOG_ONCE;
+    else if (!strcmp(env, "count"))
+      policy = FAILURE_COUNT;
+    else if (!strcmp(env, "rate-limit"))
+      policy = FAILURE_RATE_LIMIT;
+    else if (strcmp(env, "abort"))
+      fprintf(stderr, "assertions: unknown ASSERTIONS_ON_FAILURE '%s', "
+                      "aborting on failures\n", env);
+  }
+  const char *interval = getenv("ASSERTIONS_LOG_INTERVAL");
+  if (interval && atoi(interval) > 0)
+    __assertions_log_interval = atoi(interval);
+  __atomic_store_n(&__assertions_failure_policy, policy, __ATOMIC_RELAXED);
+  return (failure_policy) policy;
+}
+
+static int should_log(failure_policy policy, uint32_t id) {
+  const site_table *t;
+  switch (policy) {
+    case FAILURE_ABORT:
+      return 1;
+    case FAILURE_COUNT:
+      return 0;
+    case FAILURE_LOG_ONCE:
+      t = find_table(id);
+      return !t || !t->log ||
+        !__atomic_exchange_n(&t->log[id - t->base].logged, 1,
+                             __ATOMIC_RELAXED);
+    case FAILURE_RATE_LIMIT: {
+      t = find_table(id);
+      if (!t || !t->log)
+        return 1;
+      uint32_t *last = &t->log[id - t->base].last_logged;
+      uint32_t now = (uint32_t) time(NULL);
+      uint32_t prev = __atomic_load_n(last, __ATOMIC_RELAXED);
+      // Whoever moves the time forward gets to log.
+      return (prev == 0 || now - prev >= __assertions_log_interval) &&
+        __atomic_compare_exchange_n(last, &prev, now, 0,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+  }
+  return 1;
+}
+
+int __assertions_fail(const __assertion_site *site, const char *assertion,
+                      const char *cond, const char *src_file, int src_line) {
+  uint32_t id = __atomic_load_n(&site->data->id, __ATOMIC_RELAXED);
+  count_failure(id);
+  failure_policy policy = get_failure_policy();
+  if (!should_log(policy, id))
+    return 0;
+  fprintf(stderr, "%s:%d: failed %s assertion `%s' (%s:%d).\n",
+          site->file, site->line, assertion, cond, src_file, src_line);
+  return 1;
+}
+
+void __assertions_fail_done(void) {
+  // The details are usually printf()ed.
+  fflush(stdout);
+  if (get_failure_policy() == FAILURE_ABORT)
+    abort();
+  if (get_failure_policy() == FAILURE_LOG_ONCE)
+    fprintf(stderr, "(not reporting further failures of this assertion)\n");
+}
+
+// Failure dump
+// ==============================================
+
+// Also runs from a signal handler, so only uses write(): no stdio, which
+// may hold a lock or be in the middle of formatting in the interrupted code.
+static void dump_str(const char *str) {
+  (void) !write(STDERR_FILENO, str, strlen(str));
+}
+
+static void dump_uint(uint64_t n) {
+  char digits[20];
+  int i = sizeof(digits);
+  do {
+    digits[--i] = (char) ('0' + n % 10);
+    n /= 10;
+  } while (n);
+  (void) !write(STDERR_FILENO, digits + i, sizeof(digits) - i);
+}
+
+void __assertions_dump_failures(void) {
+  int header = 0;
+  uint32_t count = __atomic_load_n(&__assertions_sites_count,
+                                   __ATOMIC_RELAXED);
+  for (uint32_t id = 0; id < count; ++id) {
+    uint64_t n = total_failures(id);
+    if (!n)
+      continue;
+    if (!header) {
+      dump_str("assertions: failures per site\n");
+      header = 1;
+    }
+    const __assertion_site *s = __assertions_site(id);
+    dump_str(s ? s->file : "<unknown>");
+    dump_str(":");
+    dump_uint(s && s->line > 0 ? (uint64_t) s->line : 0);
+    dump_str(": ");
+    dump_str(s ? s->kind : "?");
+    dump_str(": ");
+    dump_uint(n);
+    dump_str("\n");
+  }
+}
+
+static void dump_failures_at_exit(void) {
+  // Aborting already reported everything.
+  if (get_failure_policy() != FAILURE_ABORT)
+    __assertions_dump_failures();
+}
+
+static void dump_failures_on_signal(int sig) {
+  (void) sig;
+  __assertions_dump_failures();
+}
+
+static void install_failure_dump(void) {
+  atexit(dump_failures_at_exit);
+  const char *env = getenv("ASSERTIONS_DUMP_SIGNAL");
+  if (env && atoi(env) > 0) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = dump_failures_on_signal;
+    sa.sa_flags = SA_RESTART;
+    sigaction(atoi(env), &sa, NULL);
+  }
+}
+
+// State pool
+// ==============================================
+
+// Each thread carves blocks of a few size classes (powers of two) out of
+// chunks of its own, and keeps the blocks it gets back in a free list per
+// class, so allocating and releasing never lock, nor call malloc(). The live
+// blocks are chained from the last allocated, which makes releasing back to
+// a mark a walk down that chain. States larger than the largest class are
+// mapped on their own. A thread's chunks are unmapped when it exits.
+
+#define POOL_MIN_SHIFT 6  // 64 bytes
+#define POOL_CLASSES 11   // up to 64 KiB
+#define POOL_CHUNK_SIZE ((size_t) 1 << 20)
+
+typedef struct pool_block {
+  // The block allocated before this one, while live. The next free block of
+  // the same size, while free.
+  struct pool_block *link;
+  // Including this header.
+  size_t size;
+} __attribute__((aligned(16))) pool_block;
+
+typedef struct pool_chunk {
+  struct pool_chunk *next;
+  size_t used;
+} __attribute__((aligned(16))) pool_chunk;
+
+typedef struct {
+  pool_block *live;
+  pool_block *free[POOL_CLASSES];
+  pool_chunk *chunks;
+} thread_pool;
+
+RUNTIME_SHARED __thread thread_pool __assertions_my_pool;
+RUNTIME_SHARED pthread_key_t __assertions_pool_key;
+RUNTIME_SHARED pthread_once_t __assertions_pool_once = PTHREAD_ONCE_INIT;
+
+static void *pool_map(size_t size) {
+  void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    fprintf(stderr, "assertions: out of memory for states (%zu bytes)\n",
+            size);
+    abort();
+  }
+  return p;
+}
+
+static void pool_free_block(thread_pool *pool, pool_block *b) {
+  if (b->size > ((size_t) 1 << (POOL_MIN_SHIFT + POOL_CLASSES - 1))) {
+    munmap(b, b->size);
+    return;
+  }
+  unsigned c = __builtin_ctzll(b->size) - POOL_MIN_SHIFT;
+  b->link = pool->free[c];
+  pool->free[c] = b;
+}
+
+static void pool_thread_exit(void *arg) {
+  thread_pool *pool = arg;
+  // Only the large blocks are outside of the chunks.
+  __assertions_pool_release(NULL);
+  for (pool_chunk *chunk = pool->chunks, *next; chunk; chunk = next) {
+    next = chunk->next;
+    munmap(chunk, POOL_CHUNK_SIZE);
+  }
+  memset(pool, 0, sizeof(*pool));
+}
+
+static void pool_create_key(void) {
+  pthread_key_create(&__assertions_pool_key, pool_thread_exit);
+}
+
+static pool_block *pool_carve(thread_pool *pool, size_t size) {
+  pool_chunk *chunk = pool->chunks;
+  if (!chunk || chunk->used + size > POOL_CHUNK_SIZE) {
+    if (!chunk) {
+      // The thread's first chunk: free them all when it exits.
+      pthread_once(&__assertions_pool_once, pool_create_key);
+      pthread_setspecific(__assertions_pool_key, pool);
+    }
+    chunk = pool_map(POOL_CHUNK_SIZE);
+    chunk->next = pool->chunks;
+    chunk->used = sizeof(pool_chunk);
+    pool->chunks = chunk;
+  }
+  pool_block *b = (pool_block *) ((char *) chunk + chunk->used);
+  chunk->used += size;
+  return b;
+}
+
+void *__assertions_pool_alloc(uint32_t size) {
+  thread_pool *pool = &__assertions_my_pool;
+  size_t need = sizeof(pool_block) + size;
+  unsigned c = 0;
+  while (c < POOL_CLASSES && ((size_t) 1 << (POOL_MIN_SHIFT + c)) < need)
+    ++c;
+  pool_block *b;
+  if (c == POOL_CLASSES) {
+    b = pool_map(need);
+  } else if (pool->free[c]) {
+    b = pool->free[c];
+    pool->free[c] = b->link;
+  } else {
+    b = pool_carve(pool, (size_t) 1 << (POOL_MIN_SHIFT + c));
+  }
+  b->size = c == POOL_CLASSES ? need : (size_t) 1 << (POOL_MIN_SHIFT + c);
+  b->link = pool->live;
+  pool->live = b;
+  return b + 1;
+}
+
+void *__assertions_pool_mark(void) {
+  return __assertions_my_pool.live;
+}
+
+void __assertions_pool_release(void *mark) {
+  thread_pool *pool = &__assertions_my_pool;
+  pool_block *b = pool->live;
+  while (b && b != mark) {
+    pool_block *prev = b->link;
+    pool_free_block(pool, b);
+    b = prev;
+  }
+  pool->live = b;
+}
+
+// Asynchronous checks
+// ==============================================
+
+// A ring of entries per thread, which only that thread appends to. The
+// calls in a ring run in order, by whoever holds its lock: the checker
+// thread, or the thread itself when it exits or the ring is full. So the
+// calls of a thread on a state never run concurrently, nor out of order.
+// Rings of threads that exited are reused.
+//
+// A signal handler may interrupt its thread while that thread appends to
+// its ring or runs it. Calls made from it then run right away: it can't
+// take a lock its thread already holds, nor append to the entry its thread
+// is writing.
+
+#define ASYNC_RING_SIZE 4096
+#define ASYNC_LINE 64
+
+typedef struct {
+  __assertions_drain drain;
+  void *state;
+  uint64_t value;
+  const __assertion_site *site;
+} async_entry;
+
+typedef struct async_ring {
+  struct async_ring *next;
+  int owned;  // by a thread that hasn't exited
+  int lock;
+  // The appending thread's line: the entries appended so far, and the
+  // entries run as it last saw it.
+  uint64_t head __attribute__((aligned(ASYNC_LINE)));
+  uint64_t tail_seen;
+  // The lock holder's line: the entries run so far.
+  uint64_t tail __attribute__((aligned(ASYNC_LINE)));
+  async_entry entries[ASYNC_RING_SIZE] __attribute__((aligned(ASYNC_LINE)));
+} async_ring;
+
+RUNTIME_SHARED async_ring *__assertions_all_rings;
+RUNTIME_SHARED __thread async_ring *__assertions_my_ring;
+RUNTIME_SHARED pthread_key_t __assertions_async_key;
+RUNTIME_SHARED pthread_once_t __assertions_async_once = PTHREAD_ONCE_INIT;
+// Whether a full ring waits for the checker (ASSERTIONS_ASYNC_FULL=block),
+// and whether there is a checker to wait for.
+RUNTIME_SHARED int __assertions_async_block;
+RUNTIME_SHARED int __assertions_async_checker;
+// Whether this thread is appending to or running its ring.
+RUNTIME_SHARED __thread int __assertions_in_async;
+
+static void async_enter(void) {
+  __assertions_in_async = 1;
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+}
+
+static void async_leave(void) {
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  __assertions_in_async = 0;
+}
+
+static int ring_trylock(async_ring *r) {
+  return !__atomic_exchange_n(&r->lock, 1, __ATOMIC_ACQUIRE);
+}
+
+static void ring_lock(async_ring *r) {
+  while (!ring_trylock(r))
+    sched_yield();
+}
+
+static void ring_unlock(async_ring *r) {
+  __atomic_store_n(&r->lock, 0, __ATOMIC_RELEASE);
+}
+
+// With the lock held.
+static void ring_run(async_ring *r) {
+  uint64_t tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+  uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+  for (; tail != head; ++tail) {
+    async_entry *e = &r->entries[tail & (ASYNC_RING_SIZE - 1)];
+    e->drain(e->value, e->state, e->site);
+    // Only now may the entry be reused.
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+  }
+}
+
+static int ring_pending(async_ring *r) {
+  return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) !=
+    __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+}
+
+static void *async_checker(void *arg) {
+  (void) arg;
+  unsigned idle = 0;
+  for (;;) {
+    int ran = 0;
+    for (async_ring *r = __atomic_load_n(&__assertions_all_rings,
+                                         __ATOMIC_ACQUIRE);
+         r; r = r->next) {
+      if (ring_pending(r) && ring_trylock(r)) {
+        ring_run(r);
+        ring_unlock(r);
+        ran = 1;
+      }
+    }
+    // Spin a little while, then poll every 100us.
+    if (ran) {
+      idle = 0;
+    } else if (++idle < 64) {
+      sched_yield();
+    } else {
+      struct timespec pause = { 0, 100000 };
+      nanosleep(&pause, NULL);
+    }
+  }
+  return NULL;
+}
+
+// What is left when the program exits.
+static void async_run_all(void) {
+  for (async_ring *r = __atomic_load_n(&__assertions_all_rings,
+                                       __ATOMIC_ACQUIRE);
+       r; r = r->next) {
+    ring_lock(r);
+    ring_run(r);
+    ring_unlock(r);
+  }
+}
+
+static void async_thread_exit(void *arg) {
+  async_ring *r = arg;
+  ring_lock(r);
+  ring_run(r);
+  ring_unlock(r);
+  __atomic_store_n(&r->owned, 0, __ATOMIC_RELEASE);
+}
+
+static void async_start_checker(void) {
+  // The program's signals are for its own threads.
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  pthread_t checker;
+  if (!pthread_create(&checker, NULL, async_checker, NULL)) {
+    pthread_detach(checker);
+    __assertions_async_checker = 1;
+  } else {
+    __assertions_async_checker = 0;
+    fprintf(stderr, "assertions: can't start the checker thread, checking "
+                    "when queues fill up\n");
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+// No ring may be locked across fork(), or the child, which only has the
+// forking thread, could never take its lock again.
+static void async_before_fork(void) {
+  for (async_ring *r = __atomic_load_n(&__assertions_all_rings,
+                                       __ATOMIC_ACQUIRE);
+       r; r = r->next)
+    ring_lock(r);
+}
+
+static void async_after_fork(void) {
+  for (async_ring *r = __atomic_load_n(&__assertions_all_rings,
+                                       __ATOMIC_ACQUIRE);
+       r; r = r->next)
+    ring_unlock(r);
+}
+
+// The checker thread isn't copied into the child.
+static void async_after_fork_child(void) {
+  async_after_fork();
+  __assertions_async_checker = 0;
+  async_start_checker();
+}
+
+static void async_start(void) {
+  pthread_key_create(&__assertions_async_key, async_thread_exit);
+  const char *full = getenv("ASSERTIONS_ASYNC_FULL");
+  if (full && !strcmp(full, "block"))
+    __assertions_async_block = 1;
+  else if (full && strcmp(full, "sync"))
+    fprintf(stderr, "assertions: unknown ASSERTIONS_ASYNC_FULL '%s', "
+                    "checking synchronously when full\n", full);
+  // Before the failures are printed, which was registered earlier.
+  atexit(async_run_all);
+  pthread_atfork(async_before_fork, async_after_fork, async_after_fork_child);
+  async_start_checker();
+}
+
+static async_ring *async_my_ring(void) {
+  pthread_once(&__assertions_async_once, async_start);
+  async_ring *r;
+  for (r = __atomic_load_n(&__assertions_all_rings, __ATOMIC_ACQUIRE);
+       r; r = r->next) {
+    int unowned = 0;
+    if (__atomic_compare_exchange_n(&r->owned, &unowned, 1, 0,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      break;
+  }
+  if (!r) {
+    r = aligned_alloc(ASYNC_LINE, sizeof(async_ring));
+    if (!r) {
+      fprintf(stderr, "assertions: out of memory for a queue of checks\n");
+      abort();
+    }
+    memset(r, 0, sizeof(*r));
+    r->owned = 1;
+    r->next = __atomic_load_n(&__assertions_all_rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&__assertions_all_rings, &r->next, r,
+                                        1, __ATOMIC_RELEASE,
+                                        __ATOMIC_RELAXED))
+      ;
+  }
+  r->tail_seen = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+  pthread_setspecific(__assertions_async_key, r);
+  __assertions_my_ring = r;
+  return r;
+}
+
+__attribute__((noinline))
+static void async_full(async_ring *r, __assertions_drain drain, void *state,
+                       uint64_t value, const __assertion_site *site) {
+  if (__assertions_async_block && __assertions_async_checker) {
+    while (r->head - (r->tail_seen =
+             __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)) >= ASYNC_RING_SIZE)
+      sched_yield();
+    async_leave();
+    __assertions_async(drain, state, value, site);
+    return;
+  }
+  // Everything queued before this call runs before it.
+  ring_lock(r);
+  ring_run(r);
+  drain(value, state, site);
+  ring_unlock(r);
+  r->tail_seen = r->head;
+  async_leave();
+}
+
+void __assertions_async(__assertions_drain drain, void *state,
+                        uint64_t value, const __assertion_site *site) {
+  if (__builtin_expect(__assertions_in_async, 0)) {
+    drain(value, state, site);
+    return;
+  }
+  async_enter();
+  async_ring *r = __assertions_my_ring;
+  if (__builtin_expect(!r, 0))
+    r = async_my_ring();
+  uint64_t head = r->head;
+  if (__builtin_expect(head - r->tail_seen >= ASYNC_RING_SIZE, 0)) {
+    r->tail_seen = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    if (head - r->tail_seen >= ASYNC_RING_SIZE) {
+      // Which leaves.
+      async_full(r, drain, state, value, site);
+      return;
+    }
+  }
+  async_entry *e = &r->entries[head & (ASYNC_RING_SIZE - 1)];
+  e->drain = drain;
+  e->state = state;
+  e->value = value;
+  e->site = site;
+  __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+  async_leave();
+}
+
+// Shadow map
+// ==============================================
+
+// A two-level table from addresses to states, with a slot per
+// SHADOW_GRAIN bytes. The top level has an entry per MiB of address space,
+// pointing to the page of slots for that MiB. Both are reserved without
+// backing memory, so only the parts covering objects with states ever take
+// any. Looking up a state is two loads, and the first one already rejects
+// most addresses that have none.
+//
+// Fields narrower than the grain that share one would share a slot, so the
+// instrumenter only checks fields at least SHADOW_GRAIN bytes wide.
+
+#define SHADOW_ADDRESS_BITS 47
+#define SHADOW_PAGE_SHIFT 20
+#define SHADOW_GRAIN_SHIFT 2
+#define SHADOW_TOP_SIZE \
+  (((size_t) 1 << (SHADOW_ADDRESS_BITS - SHADOW_PAGE_SHIFT)) * sizeof(void *))
+#define SHADOW_PAGE_SIZE \
+  (((size_t) 1 << (SHADOW_PAGE_SHIFT - SHADOW_GRAIN_SHIFT)) * sizeof(void *))
+
+RUNTIME_SHARED void ***__assertions_shadow_top;
+RUNTIME_SHARED pthread_once_t __assertions_shadow_once = PTHREAD_ONCE_INIT;
+
+static void *shadow_reserve(size_t size) {
+  void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (p == MAP_FAILED) {
+    fprintf(stderr, "assertions: can't map the shadow of the states\n");
+    abort();
+  }
+  return p;
+}
+
+static void shadow_create_top(void) {
+  __atomic_store_n(&__assertions_shadow_top, shadow_reserve(SHADOW_TOP_SIZE),
+                   __ATOMIC_RELEASE);
+}
+
+// The slot of addr, or NULL if its page doesn't exist and create isn't set.
+static void **shadow_slot(uintptr_t addr, int create) {
+  void ***top = __atomic_load_n(&__assertions_shadow_top,
+                                         __ATOMIC_ACQUIRE);
+  if (!top)
+    return NULL;
+  if (addr >> SHADOW_ADDRESS_BITS) {
+    fprintf(stderr, "assertions: no shadow for address %p\n", (void *) addr);
+    abort();
+  }
+  void ***entry = &top[addr >> SHADOW_PAGE_SHIFT];
+  void **page = __atomic_load_n(entry, __ATOMIC_ACQUIRE);
+  if (!page) {
+    if (!create)
+      return NULL;
+    void **fresh = shadow_reserve(SHADOW_PAGE_SIZE);
+    if (__atomic_compare_exchange_n(entry, &page, fresh, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      page = fresh;
+    } else {
+      munmap(fresh, SHADOW_PAGE_SIZE);
+    }
+  }
+  uintptr_t offset = addr & (((uintptr_t) 1 << SHADOW_PAGE_SHIFT) - 1);
+  return (void **) &page[offset >> SHADOW_GRAIN_SHIFT];
+}
+
+void *__assertions_shadow_lookup(const void *addr) {
+  void **slot = shadow_slot((uintptr_t) addr, 0);
+  return slot ? __atomic_load_n(slot, __ATOMIC_ACQUIRE) : NULL;
+}
+
+// The states themselves come from free lists shared by all threads, one per
+// power-of-two size, refilled from chunks that are never unmapped. Taking
+// and dropping a state only happens on the first store to a field and when
+// its object is freed, so a spin lock is plenty.
+
+#define SHADOW_STATE_CLASSES 12  // 16 bytes to 32 KiB
+#define SHADOW_CHUNK_SIZE ((size_t) 1 << 20)
+
+typedef struct shadow_state {
+  union {
+    struct shadow_state *next;  // while free
+    uint32_t size_class;        // while used
+  };
+} __attribute__((aligned(16))) shadow_state;
+
+RUNTIME_SHARED shadow_state *__assertions_shadow_free_states
+  [SHADOW_STATE_CLASSES];
+RUNTIME_SHARED char *__assertions_shadow_chunk;
+RUNTIME_SHARED size_t __assertions_shadow_chunk_used;
+RUNTIME_SHARED int __assertions_shadow_lock;
+
+static void shadow_lock(void) {
+  while (__atomic_exchange_n(&__assertions_shadow_lock, 1, __ATOMIC_ACQUIRE))
+    ;
+}
+
+static void shadow_unlock(void) {
+  __atomic_store_n(&__assertions_shadow_lock, 0, __ATOMIC_RELEASE);
+}
+
+static shadow_state *shadow_alloc_state(uint32_t size) {
+  size_t need = sizeof(shadow_state) + size;
+  unsigned c = 0;
+  while (c < SHADOW_STATE_CLASSES && ((size_t) 16 << c) < need)
+    ++c;
+  if (c == SHADOW_STATE_CLASSES) {
+    fprintf(stderr, "assertions: state of %u bytes too large for a field\n",
+            size);
+    abort();
+  }
+  size_t block = (size_t) 16 << c;
+  shadow_lock();
+  shadow_state *s = __assertions_shadow_free_states[c];
+  if (s) {
+    __assertions_shadow_free_states[c] = s->next;
+  } else {
+    if (!__assertions_shadow_chunk ||
+        __assertions_shadow_chunk_used + block > SHADOW_CHUNK_SIZE) {
+      __assertions_shadow_chunk = pool_map(SHADOW_CHUNK_SIZE);
+      __assertions_shadow_chunk_used = 0;
+    }
+    s = (shadow_state *) (__assertions_shadow_chunk +
+                          __assertions_shadow_chunk_used);
+    __assertions_shadow_chunk_used += block;
+  }
+  shadow_unlock();
+  memset(s, 0, block);
+  s->size_class = c;
+  return s;
+}
+
+static void shadow_free_state(shadow_state *s) {
+  unsigned c = s->size_class;
+  shadow_lock();
+  s->next = __assertions_shadow_free_states[c];
+  __assertions_shadow_free_states[c] = s;
+  shadow_unlock();
+}
+
+void *__assertions_shadow_create(const void *addr, uint32_t size) {
+  pthread_once(&__assertions_shadow_once, shadow_create_top);
+  void **slot = shadow_slot((uintptr_t) addr, 1);
+  shadow_state *s = shadow_alloc_state(size);
+  void *found = NULL;
+  if (__atomic_compare_exchange_n(slot, &found, s + 1, 0,
+                                  __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    return s + 1;
+  // Another thread's first store to the field got there first, and may
+  // still be initialising its state: that one it is.
+  shadow_free_state(s);
+  return found;
+}
+
+void __assertions_shadow_forget(const void *obj, const uint32_t *offsets,
+                                uint32_t count) {
+  if (!obj || !__atomic_load_n(&__assertions_shadow_top, __ATOMIC_RELAXED))
+    return;
+  for (uint32_t i = 0; i < count; ++i) {
+    void **slot = shadow_slot((uintptr_t) obj + offsets[i], 0);
+    void *s = slot && *slot ? __atomic_exchange_n(slot, NULL, __ATOMIC_ACQ_REL)
+                            : NULL;
+    if (s)
+      shadow_free_state((shadow_state *) s - 1);
+  }
+}
+
+void __assertions_shadow_moved(const void *from, const void *to,
+                               const uint32_t *offsets, uint32_t count) {
+  // The states can't follow the fields: they start over at the new address.
+  if (to && to != from)
+    __assertions_shadow_forget(from, offsets, count);
+}
@@ -1,11 +1,13 @@
 #include "Callee.h"
 #include "Common.h"
 
+#include "llvm/ADT/SmallVector.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Support/CallSite.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/InstIterator.h"
 #include "llvm/Support/raw_ostream.h"
@@ -16,6 +18,25 @@ namespace assertions {
 
 char CalleeInstrumenter::ID = 0;
 
+namespace {
+enum StateMode { AutoState, ThreadLocalState, AtomicState };
+}
+
+static cl::opt<StateMode>
+CalleeStateMode("assertions-callee-state",
+  cl::desc("How return value assertions keep their state safe from "
+           "concurrent calls"),
+  cl::values(
+    clEnumValN(AutoState, "auto",
+               "Thread-local, unless the update doesn't write the state"),
+    clEnumValN(ThreadLocalState, "thread-local",
+               "One state per thread"),
+    clEnumValN(AtomicState, "atomic",
+               "One state, updated with __update_atomic_<kind> where the "
+               "kind has one, thread-local otherwise"),
+    clEnumValEnd),
+  cl::init(AutoState));
+
 CalleeInstrumenter::~CalleeInstrumenter() {}
 
 class ValueOpRange {
@@ -81,6 +102,7 @@ Function *CalleeInstrumenter::ReplaceFunction(Function *F, ArrayRef<Type*> Param
   NF->setAttributes(F->getAttributes());
   F->getParent()->getFunctionList().insert(F, NF);
   NF->takeName(F);
+  ++Co.Stat.FunctionsRewritten;
 
   // Loop over all of the callers of the function, transforming the call sites
   // to pass in a smaller number of arguments into the new function.
@@ -218,6 +240,7 @@ Function *CalleeInstrumenter::ReplaceFunction(Function *F, ArrayRef<Type*> Param
 }
 
 bool CalleeInstrumenter::runOnModule(Module &M) {
+  Stats::Timer T(Co.Stat, "callee");
   // Collect debug info descriptors for functions.
   CollectFunctionDIs(M);
   // Can't do foreach because we sometimes remove current function as we go
@@ -231,8 +254,13 @@ bool CalleeInstrumenter::runOnModule(Module &M) {
 bool CalleeInstrumenter::runOnFunction(Function &F) {
   if (F.getName().startswith("__update_") ||
       F.getName().startswith("__init_")   ||
-      F.getName().startswith("__alloc_")) {
-    F.setLinkage(GlobalValue::LinkageTypes::LinkOnceODRLinkage);
+      F.getName().startswith("__alloc_")  ||
+      F.getName().startswith("__refresh_") ||
+      F.getName().startswith("__check_") ||
+      F.getName().startswith("__assertions_")) {
+    // Specialized checks are the module's own.
+    if (!F.hasLocalLinkage())
+      F.setLinkage(GlobalValue::LinkageTypes::LinkOnceODRLinkage);
   return true;
   }
   if (F.isIntrinsic()) {
@@ -301,33 +329,76 @@ bool CalleeInstrumenter::runOnFunction(Function &F) {
         Module *M = F.getParent();
         // Initialise it to the "default" state.
         Constant *Init = Co.getStructValueFor(As.Kind);
-        GlobalVariable *StateVar = 
-          new GlobalVariable(*M, ST, false,
-            GlobalValue::LinkageTypes::InternalLinkage, Init,
-            GlobalStateName);
+        // 2) Make sure concurrent calls don't race on the state: updates
+        //    that only read it can share it, others need their own copy
+        //    per thread, or an update function made of atomic operations.
+        Type *RetTy = F.getReturnType();
+        if (RetTy->isVoidTy()) {
+          F.getContext().emitError("Asserted return type can't be void");
+          break;
+        }
+        // The state starts out as the default one, as there is no
+        // initial value to call the init function with, but a dist state
+        // is made from the props only that function reads.
+        if (As.Kind == "dist") {
+          F.getContext().emitError("dist assertions can't be put on return "
+                                   "values");
+          break;
+        }
+        bool IsSigned = isReturnSigned(F);
+        // With a check specialized for the props there is no state to
+        // share, nor to initialise from them.
+        Function *InstrFn = Co.GetSpecializedCheck(As, RetTy, IsSigned);
+        GlobalVariable *StateVar = nullptr;
+        if (!InstrFn) {
+          InstrFn = Co.GetFuncFor(As.Kind, Common::FuncType::Update, RetTy,
+                                  IsSigned);
+          bool ThreadLocal = false;
+          if (CalleeStateMode == ThreadLocalState ||
+              Co.UpdateWritesState(As.Kind)) {
+            Function *AtomicFn = nullptr;
+            if (CalleeStateMode == AtomicState)
+              AtomicFn = Co.GetFuncFor(As.Kind,
+                                       Common::FuncType::AtomicUpdate,
+                                       RetTy, IsSigned, /*strict=*/false);
+            if (AtomicFn)
+              InstrFn = AtomicFn;
+            else
+              ThreadLocal = true;
+          }
+          StateVar =
+            new GlobalVariable(*M, ST, false,
+              GlobalValue::LinkageTypes::InternalLinkage, Init,
+              GlobalStateName, nullptr,
+              ThreadLocal ? GlobalVariable::InitialExecTLSModel
+                          : GlobalVariable::NotThreadLocal);
+          DEBUG(status("Callee", (ThreadLocal ? "Thread-local state for " :
+                                  "Shared state for ") + As.Kind, 2));
+        }
+        unsigned Site = Co.GetSiteFor(As, annoInfo.FName, annoInfo.LineNo);
         // 4) Instrument the function's return points so that it can
-        //    always runs the Update function for the assertion As.
+        //    always runs the Update function for the assertion As. They
+        //    are found first, as switches split blocks.
+        SmallVector<ReturnInst *, 4> Returns;
         for (auto I = inst_begin(F), E = inst_end(F); I != E; I++) {
           // Is this an actual return instruction?
-          if (auto *Return = dyn_cast<ReturnInst>(&*I)) {
-            DEBUG(dbgs() << "Return value: " << *Return << "\n");
-            IRBuilder<> Builder(Return->getParent());
-            Builder.SetInsertPoint(Return);
-            if (F.getReturnType()->isVoidTy()) {
-              getGlobalContext().emitError("Asserted return type can't be void");
-            }
-            auto *InstrFn = Co.GetFuncFor(As.Kind, Common::FuncType::Update);
-            // Store Return->getReturnValue() to an alloca, so that we can
-            // pass the address.
-            auto *RV = Return->getReturnValue();
-            Value *Args[] = {
-              RV,
-              StateVar, // state
-              annoInfo.FName,
-              annoInfo.LineNo
-            };
-            Builder.CreateCall(InstrFn, Args);
-          }
+          if (auto *Return = dyn_cast<ReturnInst>(&*I))
+            Returns.push_back(Return);
+        }
+        for (ReturnInst *Return : Returns) {
+          DEBUG(dbgs() << "Return value: " << *Return << "\n");
+          IRBuilder<> Builder(Return->getParent());
+          Builder.SetInsertPoint(Return);
+          Co.CreateSwitch(Builder, Site);
+          // Store Return->getReturnValue() to an alloca, so that we can
+          // pass the address.
+          auto *RV = Return->getReturnValue();
+          SmallVector<Value *, 3> Args;
+          Args.push_back(RV);
+          if (StateVar)
+            Args.push_back(StateVar);
+          Args.push_back(Co.GetSiteRef(Site));
+          Co.CreateCheckCall(Builder, InstrFn, Args);
         }
         break;
       }
@@ -337,6 +408,20 @@ bool CalleeInstrumenter::runOnFunction(Function &F) {
 }
 
 
+bool CalleeInstrumenter::isReturnSigned(Function &F) {
+  // The subroutine type lists the return type first.
+  auto DI = FunctionDIs.find(&F);
+  if (DI != FunctionDIs.end()) {
+    DIArray Types = DI->second.getType().getTypeArray();
+    if (Types.getNumElements() > 0)
+      return IsSignedType(DIType(Types.getElement(0)));
+  }
+  // Without debug info, small return values at least say how to extend
+  // them.
+  return !F.getAttributes().hasAttribute(AttributeSet::ReturnIndex,
+                                         Attribute::ZExt);
+}
+
 /// CollectFunctionDIs - Map each function in the module to its debug info
 /// descriptor.
 void CalleeInstrumenter::CollectFunctionDIs(Module &M) {
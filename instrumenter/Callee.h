@@ -99,6 +99,9 @@ private:
                                   llvm::ArrayRef<llvm::Type*> Params);
   void ExtractGlobalAnnotations(llvm::Module &M);
 
+  // Whether F returns a signed value, from its debug info if it has any.
+  bool isReturnSigned(llvm::Function &F);
+
   bool runOnFunction(llvm::Function &Fn);
 };
 
@@ -1,17 +1,31 @@
 #include "Caller.h"
 #include "Common.h"
 
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/DataLayout.h"
 #include "llvm/IR/Function.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Module.h"
+#include "llvm/IR/Operator.h"
 #include "llvm/IR/ValueSymbolTable.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/SmallVector.h"
 #include "llvm/Support/CallSite.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Support/Dwarf.h"
+#include "llvm/Support/MathExtras.h"
 #include "llvm/Support/raw_ostream.h"
 
 #include "StringJoin.h"
 
+#include <algorithm>
+
 using namespace llvm;
 
 namespace assertions {
@@ -21,31 +35,535 @@ char CallerInstrumenter::ID = 0;
 typedef Common::FnMapTy   FnMapTy;
 typedef Common::FuncType  FuncType;
 
+static cl::opt<unsigned>
+SampleRate("assertions-sample-rate",
+  cl::desc("Check only one in N updates at each assertion update site"),
+  cl::value_desc("N"), cl::init(1));
+
+static cl::list<std::string>
+SampleRateFor("assertions-sample",
+  cl::desc("Sample rate for an assertion kind or a single update site, "
+           "given as <kind>=N or <file>:<line>=N"),
+  cl::value_desc("key=N"), cl::CommaSeparated);
+
+static cl::opt<bool>
+ProveChecks("assertions-prove",
+  cl::desc("Leave out update checks that can be decided at compile time, "
+           "and report the ones that always fail"),
+  cl::init(true));
+
+static cl::opt<bool>
+AssumeAbort("assertions-assume-abort",
+  cl::desc("Let proofs assume that the program stops at the first failing "
+           "check, as under the default failure policy"),
+  cl::init(false));
+
+static cl::opt<bool>
+DeferLoopChecks("assertions-defer-loop-checks",
+  cl::desc("Check the updates made inside a loop once the loop exits, "
+           "keeping the loop free of calls"),
+  cl::init(false));
+
 CallerInstrumenter::~CallerInstrumenter() {}
 
+void CallerInstrumenter::getAnalysisUsage(AnalysisUsage &AU) const {
+  AU.addRequired<LoopInfo>();
+}
+
 bool CallerInstrumenter::doInitialization(Module &M) {
   Mod = &M;
   // TODO add global function decls
   // Prototype in all of the Assertions.c functions?
+  for (StringRef Opt : SampleRateFor) {
+    auto KV = Opt.rsplit('=');
+    unsigned Rate;
+    if (KV.first.empty() || KV.second.getAsInteger(10, Rate))
+      report_fatal_error("Invalid -assertions-sample value '" + Opt +
+                         "', expected <kind>=N or <file>:<line>=N");
+    SampleRates[KV.first] = Rate;
+  }
+  // A UID may have update sites in several functions, after inlining. And
+  // objects may be freed in other functions than the ones storing to their
+  // fields.
+  SampledUIDs.clear();
+  AssertedFields.clear();
+  FieldOffsets.clear();
+  StructDebugTypes.clear();
+  FoundStructDebugTypes = false;
+  for (Module::iterator F = M.begin(), FE = M.end(); F != FE; ++F) {
+    for (Function::iterator BB = F->begin(), BE = F->end(); BB != BE; ++BB) {
+      for (BasicBlock::iterator I = BB->begin(), IE = BB->end();
+           I != IE; ++I) {
+        CallSite CS(I);
+        Function *Callee = CS ? CS.getCalledFunction() : nullptr;
+        if (Callee && Callee->getIntrinsicID() == Intrinsic::ptr_annotation)
+          NoteAssertedField(CS);
+        if (!Callee || Callee->getIntrinsicID() != Intrinsic::assign_annotation)
+          continue;
+        StringRef anno = ParseAnnotationCall(CS);
+        if (!anno.startswith("assertion,"))
+          continue;
+        Assertion As = AM.getParsedAssertion(anno);
+        auto *Line = dyn_cast<ConstantInt>(CS.getArgument(3));
+        if (!Line || getSampleRate(As, GetGlobalString(CS.getArgument(2)),
+                                   Line->getZExtValue()) > 1)
+          SampledUIDs.insert(As.UID);
+      }
+    }
+  }
   return true;
 }
 
-bool CallerInstrumenter::runOnFunction(Function &F) {
-  bool modifiedIR = false;
+bool CallerInstrumenter::doFinalization(Module &M) {
+  // All the sites are known by now, Callee runs before us.
+  Stats::Timer T(Co.Stat, "caller");
+  Co.EmitSiteTable();
+  return true;
+}
 
+bool CallerInstrumenter::runOnFunction(Function &F) {
+  Stats::Timer T(Co.Stat, "caller");
+  // The states of another function: after inlining, the same UID may well
+  // be in several.
+  States.clear();
+  SmallVector<Instruction *, 16> Annos, FieldAnnos;
   for (auto &Block : F) {
-    modifiedIR |= runOnBasicBlock(Block);
+    CollectAnnotations(Block, Annos, FieldAnnos);
   }
+  // Initialisations first: in an optimised function, the blocks aren't
+  // necessarily in the order of the source, and the updates need the states.
+  std::stable_partition(Annos.begin(), Annos.end(), [](Instruction *Inst) {
+    return CallSite(Inst).getCalledFunction()->getIntrinsicID() ==
+      Intrinsic::var_annotation;
+  });
+  // These look at the loops, so come before anything splits blocks.
+  if (DeferLoopChecks)
+    PlanLoopDeferral(F, Annos);
+  bool modifiedIR = CreateRangeChecks(F, Annos);
+  CreateStateFrame(F, Annos);
+
+  for (Instruction *Inst : Annos) {
+    CallSite CS(Inst);
+    switch (CS.getCalledFunction()->getIntrinsicID()) {
+      case Intrinsic::var_annotation:
+        modifiedIR |= InstrumentInit(*Inst, CS);
+        break;
+      case Intrinsic::assign_annotation:
+        modifiedIR |= InstrumentExpr(*Inst, CS);
+        break;
+      default:
+        llvm_unreachable("Collected a call that is not an annotation");
+    }
+  }
+  if (DeferLoopChecks)
+    Deferral.finish();
+  for (Instruction *Inst : FieldAnnos) {
+    CallSite CS(Inst);
+    modifiedIR |= InstrumentField(*Inst, CS);
+  }
+  if (!AssertedFields.empty() ||
+      Mod->getFunction("__assertions_forget_fields"))
+    modifiedIR |= CreateFieldReleases(F);
 
   return modifiedIR;
 }
 
-bool CallerInstrumenter::runOnBasicBlock(BasicBlock &Block) {
-  bool modifiedIR = false;
+// States are laid out so that none straddles two lines, where it fits in one.
+static const unsigned CacheLineSize = 64;
 
-  //for (auto &Inst : Block) {
-  for (auto I = Block.begin(), E = Block.end(); I != E; ) {
-    auto &Inst = *I++;
+void CallerInstrumenter::CreateStateFrame(Function &F,
+                                          ArrayRef<Instruction *> Annos) {
+  // One slot for each state initialised here, and a guess at how often it
+  // is used: the updates of the variable, 8 times more for each loop they
+  // are in. States of kinds with an alloc function come from the pool.
+  LoopInfo &LI = getAnalysis<LoopInfo>();
+  struct Slot {
+    int UID;
+    StructType *Type;
+    uint64_t Weight;
+    Function *Alloc;
+    Constant *Props;
+  };
+  SmallVector<Slot, 8> Slots;
+  DenseMap<int, unsigned> SlotOf;
+  for (Instruction *Inst : Annos) {
+    CallSite CS(Inst);
+    StringRef anno = ParseAnnotationCall(CS);
+    if (!anno.startswith("assertion,"))
+      continue;
+    Assertion As = AM.getParsedAssertion(anno);
+    if (CS.getCalledFunction()->getIntrinsicID() == Intrinsic::var_annotation) {
+      StructType *Type = Co.getStructTypeFor(As.Kind);
+      if (Type->isOpaque() || Type->getNumElements() == 0 ||
+          SlotOf.count(As.UID) ||
+          GetSpecializedCheck(As, CS.getArgument(0)->stripPointerCasts()))
+        continue;
+      SlotOf[As.UID] = Slots.size();
+      Slot S = { As.UID, Type, 0, nullptr, nullptr };
+      if ((S.Alloc = Co.GetFuncFor(As.Kind, FuncType::Alloc,
+                                   /*strict=*/false)))
+        S.Props = Co.GetPropsFor(As);
+      Slots.push_back(S);
+    } else {
+      // Inits come first, so a state passed in as a parameter has no slot.
+      auto It = SlotOf.find(As.UID);
+      if (It != SlotOf.end()) {
+        unsigned Depth = std::min(LI.getLoopDepth(Inst->getParent()), 20u);
+        Slots[It->second].Weight += uint64_t(1) << (3 * Depth);
+      }
+    }
+  }
+  if (Slots.empty())
+    return;
+  BasicBlock &Entry = F.getEntryBlock();
+  IRBuilder<> Builder(&Entry, Entry.begin());
+  // Pooled states are taken when the function is entered, and all go back
+  // to the pool, past the mark, whichever way it returns.
+  Value *Mark = nullptr;
+  for (Slot &S : Slots) {
+    if (!S.Alloc)
+      continue;
+    if (!Mark)
+      Mark = Builder.CreateCall(Co.GetRuntimeFunc("__assertions_pool_mark"),
+                                "assertions.pool.mark");
+    States[S.UID] = Builder.CreateCall(S.Alloc, S.Props,
+                                       getStateName(S.UID));
+    ++Co.Stat.PoolStates;
+  }
+  if (Mark) {
+    Function *Release = Co.GetRuntimeFunc("__assertions_pool_release");
+    SmallVector<Instruction *, 4> Exits;
+    for (BasicBlock &BB : F) {
+      if (isa<ReturnInst>(BB.getTerminator()) ||
+          isa<ResumeInst>(BB.getTerminator()))
+        Exits.push_back(BB.getTerminator());
+    }
+    for (Instruction *Exit : Exits)
+      CallInst::Create(Release, Mark, "", Exit);
+  }
+  Slots.erase(std::remove_if(Slots.begin(), Slots.end(), [](const Slot &S) {
+    return S.Alloc != nullptr;
+  }), Slots.end());
+  if (Slots.empty())
+    return;
+
+  // The most used first, so that the checks in hot loops share a line.
+  std::stable_sort(Slots.begin(), Slots.end(),
+                   [](const Slot &A, const Slot &B) {
+    return A.Weight > B.Weight;
+  });
+  const DataLayout *DL = getAnalysisIfAvailable<DataLayout>();
+  Type *Int8Ty = Type::getInt8Ty(F.getContext());
+  SmallVector<Type *, 8> Fields;
+  SmallVector<unsigned, 8> FieldOf;
+  uint64_t End = 0;
+  // Lines are only counted from the start of the frame once it is aligned
+  // to one, which realigns the stack: only done if some state needs it.
+  unsigned Align = 0;
+  bool Padded = false;
+  for (Slot &S : Slots) {
+    if (DL) {
+      uint64_t Size = DL->getTypeAllocSize(S.Type);
+      unsigned StateAlign = DL->getABITypeAlignment(S.Type);
+      uint64_t Start = RoundUpToAlignment(End, StateAlign);
+      if (Size <= CacheLineSize &&
+          Start / CacheLineSize != (Start + Size - 1) / CacheLineSize) {
+        Start = RoundUpToAlignment(Start, CacheLineSize);
+        Fields.push_back(ArrayType::get(Int8Ty, Start - End));
+        Padded = true;
+      }
+      End = Start + Size;
+      Align = std::max(Align, StateAlign);
+    }
+    FieldOf.push_back(Fields.size());
+    Fields.push_back(S.Type);
+  }
+
+  // A single static alloca, whatever the number of states and wherever
+  // they are initialised, so the stack never grows at run time.
+  auto *FrameTy = StructType::create(F.getContext(), Fields,
+                                     "assertions.frame");
+  Builder.SetInsertPoint(&Entry, Entry.begin());
+  AllocaInst *Frame = Builder.CreateAlloca(FrameTy, nullptr,
+                                           "assertions.frame");
+  Frame->setAlignment(Padded ? CacheLineSize : Align);
+  ++Co.Stat.Allocas;
+  for (unsigned I = 0, E = Slots.size(); I != E; ++I) {
+    States[Slots[I].UID] =
+      Builder.CreateStructGEP(Frame, FieldOf[I], getStateName(Slots[I].UID));
+  }
+  DEBUG(info("State frame") << *FrameTy << "\n");
+}
+
+void CallerInstrumenter::PlanLoopDeferral(Function &F,
+                                          ArrayRef<Instruction *> Annos) {
+  Deferral.reset(F, getAnalysis<LoopInfo>());
+  DeferredTo.clear();
+  // A loop can't hold on to a variable's checks if it also initialises the
+  // variable, or hands its state to a function that checks it.
+  for (Instruction *Inst : Annos) {
+    CallSite CS(Inst);
+    StringRef anno = ParseAnnotationCall(CS);
+    SmallVector<StringRef, 2> UIDs;
+    if (ParseAssertionFuncall(anno, UIDs)) {
+      for (StringRef UID_str : UIDs) {
+        int UID;
+        if (!UID_str.getAsInteger(10, UID))
+          Deferral.block(Inst->getParent(), UID);
+      }
+    } else if (CS.getCalledFunction()->getIntrinsicID() ==
+               Intrinsic::var_annotation) {
+      Assertion As = AM.getParsedAssertion(anno);
+      Deferral.block(Inst->getParent(), As.UID);
+    }
+  }
+  for (Instruction *Inst : Annos) {
+    CallSite CS(Inst);
+    StringRef anno = ParseAnnotationCall(CS);
+    if (CS.getCalledFunction()->getIntrinsicID() !=
+          Intrinsic::assign_annotation || !anno.startswith("assertion,"))
+      continue;
+    Assertion As = AM.getParsedAssertion(anno);
+    if (Loop *L = Deferral.getLoopFor(Inst->getParent(), As))
+      DeferredTo[Inst] = L;
+  }
+}
+
+Loop *CallerInstrumenter::GetRangeLoop(LoopInfo &LI, BasicBlock *BB,
+                                       BasicBlock *Decl) {
+  // Past the loops around the declaration, the array may be dead, or its
+  // elements from the last iteration, when the loop exits. The outer loops
+  // would check elements written by another inner loop, or none at all.
+  Loop *L = LI.getLoopFor(BB);
+  if (!L || L->contains(Decl) || !L->getLoopPreheader() ||
+      !L->hasDedicatedExits())
+    return nullptr;
+  SmallVector<BasicBlock *, 4> Exits;
+  L->getExitBlocks(Exits);
+  return Exits.empty() ? nullptr : L;
+}
+
+void CallerInstrumenter::CreateRangeCalls(IRBuilder<> &Builder,
+                                          AllocaInst *Array, Value *Begin,
+                                          Value *End) {
+  auto *Ty = cast<ArrayType>(Array->getAllocatedType());
+  Type *Int64Ty = Builder.getInt64Ty();
+  Constant *Size = ConstantExpr::getSizeOf(Ty->getElementType());
+  Constant *One = ConstantInt::get(Int64Ty, 1);
+  Constant *Num = ConstantInt::get(Int64Ty, Ty->getNumElements());
+  // Every element written even partly, within the array.
+  Value *First = Builder.CreateUDiv(Begin, Size);
+  Value *Last = Builder.CreateUDiv(
+    Builder.CreateAdd(End, ConstantExpr::getSub(Size, One)), Size);
+  Last = Builder.CreateSelect(Builder.CreateICmpULT(Last, Num), Last, Num);
+  RangeVar *Written = nullptr;
+  for (RangeVar &RV : RangeVars) {
+    if (RV.Array == Array) {
+      Written = &RV;
+      break;
+    }
+  }
+  Value *Any = Builder.CreateICmpULT(First, Last);
+  Value *Lo = Builder.CreateLoad(Written->WrittenBegin);
+  Value *Hi = Builder.CreateLoad(Written->WrittenEnd);
+  Lo = Builder.CreateSelect(
+    Builder.CreateAnd(Any, Builder.CreateICmpULT(First, Lo)), First, Lo);
+  Hi = Builder.CreateSelect(
+    Builder.CreateAnd(Any, Builder.CreateICmpUGT(Last, Hi)), Last, Hi);
+  Builder.CreateStore(Lo, Written->WrittenBegin);
+  Builder.CreateStore(Hi, Written->WrittenEnd);
+  for (RangeVar &RV : RangeVars) {
+    if (RV.Array != Array)
+      continue;
+    // And the elements just before and after, to compare the ones written
+    // against, if they were written too.
+    Value *From = First, *To = Last;
+    if (RV.Sorted) {
+      From = Builder.CreateSelect(Builder.CreateICmpUGT(First, Lo),
+                                  Builder.CreateSub(First, One), First);
+      To = Builder.CreateSelect(Builder.CreateICmpULT(Last, Hi),
+                                Builder.CreateAdd(Last, One), Last);
+    }
+    Value *Count = Builder.CreateSelect(Builder.CreateICmpUGT(To, From),
+      Builder.CreateSub(To, From), ConstantInt::get(Int64Ty, 0));
+    Value *Idx[] = { ConstantInt::get(Int64Ty, 0), From };
+    Instruction *Cont = Co.CreateSwitch(Builder, RV.Site);
+    Value *Args[] = {
+      Builder.CreateInBoundsGEP(Array, Idx), Count,
+      Co.GetSiteRef(RV.Site)
+    };
+    Co.CreateCheckCall(Builder, RV.Check, Args);
+    ++Co.Stat.RangeChecks;
+    if (Cont)
+      Builder.SetInsertPoint(Cont);
+  }
+}
+
+bool CallerInstrumenter::CreateRangeChecks(Function &F,
+                              SmallVectorImpl<Instruction *> &Annos) {
+  // The arrays with an assertion that has a range function.
+  RangeVars.clear();
+  DenseSet<int> UIDs;
+  DenseMap<AllocaInst *, std::pair<AllocaInst *, AllocaInst *>> Written;
+  BasicBlock &Entry = F.getEntryBlock();
+  for (Instruction *Inst : Annos) {
+    CallSite CS(Inst);
+    StringRef anno = ParseAnnotationCall(CS);
+    if (CS.getCalledFunction()->getIntrinsicID() !=
+          Intrinsic::var_annotation || !anno.startswith("assertion,"))
+      continue;
+    auto *Array = dyn_cast<AllocaInst>(CS.getArgument(0)->stripPointerCasts());
+    auto *Ty = Array ? dyn_cast<ArrayType>(Array->getAllocatedType())
+                     : nullptr;
+    if (!Ty)
+      continue;
+    Assertion As = AM.getParsedAssertion(anno);
+    Function *Check = Co.GetSpecializedCheck(As, Ty->getElementType(),
+                                             IsSignedVariable(Array),
+                                             FuncType::Range);
+    if (!Check)
+      continue;
+    RangeVar RV = { As.UID, Array, Check, Inst->getParent(),
+                    Co.GetSiteFor(As, cast<Constant>(CS.getArgument(2)),
+                                  cast<Constant>(CS.getArgument(3))),
+                    As.Kind == "sorted", nullptr, nullptr };
+    auto &W = Written[Array];
+    if (!W.first) {
+      // In the entry block, to be promoted to registers, and emptied where
+      // the array is declared.
+      IRBuilder<> EntryB(&Entry, Entry.begin());
+      W.first = EntryB.CreateAlloca(EntryB.getInt64Ty(), nullptr,
+                                    "assertions.written.begin");
+      W.second = EntryB.CreateAlloca(EntryB.getInt64Ty(), nullptr,
+                                     "assertions.written.end");
+      Co.Stat.Allocas += 2;
+      IRBuilder<> DeclB(Inst);
+      DeclB.CreateStore(DeclB.getInt64(Ty->getNumElements()), W.first);
+      DeclB.CreateStore(DeclB.getInt64(0), W.second);
+    }
+    RV.WrittenBegin = W.first;
+    RV.WrittenEnd = W.second;
+    RangeVars.push_back(RV);
+    UIDs.insert(As.UID);
+  }
+  if (RangeVars.empty())
+    return false;
+  // Their annotations, including the ones clang puts on element updates,
+  // are all taken care of here.
+  Annos.erase(std::remove_if(Annos.begin(), Annos.end(),
+                             [&](Instruction *Inst) {
+    CallSite CS(Inst);
+    StringRef anno = ParseAnnotationCall(CS);
+    if (!anno.startswith("assertion,") ||
+        !UIDs.count(AM.getParsedAssertion(anno).UID))
+      return false;
+    Inst->eraseFromParent();
+    return true;
+  }), Annos.end());
+
+  // The writes to them, before adding any.
+  struct Write {
+    Instruction *Inst;
+    RangeVar *RV;
+    Value *Ptr, *Size;
+    // Checked on the exits of this loop, if any.
+    Loop *L;
+  };
+  SmallVector<Write, 8> Writes;
+  const DataLayout *DL = getAnalysisIfAvailable<DataLayout>();
+  for (BasicBlock &BB : F) {
+    for (Instruction &I : BB) {
+      Write W = { &I, nullptr, nullptr, nullptr, nullptr };
+      if (auto *Store = dyn_cast<StoreInst>(&I)) {
+        W.Ptr = Store->getPointerOperand();
+        W.Size = ConstantExpr::getSizeOf(Store->getValueOperand()->getType());
+      } else if (auto *MI = dyn_cast<MemIntrinsic>(&I)) {
+        W.Ptr = MI->getRawDest();
+        W.Size = MI->getLength();
+      } else {
+        continue;
+      }
+      Value *Obj = GetUnderlyingObject(W.Ptr, DL);
+      // Once per array, whatever the number of assertions on it.
+      for (RangeVar &RV : RangeVars) {
+        if (RV.Array == Obj) {
+          W.RV = &RV;
+          Writes.push_back(W);
+          break;
+        }
+      }
+    }
+  }
+
+  // A write in a loop widens the range of bytes the loop wrote, kept in
+  // the entry block so that it can be promoted to registers, and reset
+  // right before entering the loop. Which is checked on every exit. The
+  // loops and their exits are taken before the checks split blocks.
+  LoopInfo &LI = getAnalysis<LoopInfo>();
+  struct LoopRange {
+    AllocaInst *Begin, *End;
+    SmallVector<BasicBlock *, 4> Exits;
+  };
+  DenseMap<std::pair<Loop *, AllocaInst *>, LoopRange> LoopRanges;
+  SmallVector<std::pair<Loop *, AllocaInst *>, 4> LoopOrder;
+  for (Write &W : Writes) {
+    W.L = GetRangeLoop(LI, W.Inst->getParent(), W.RV->Decl);
+    AllocaInst *Array = W.RV->Array;
+    auto Key = std::make_pair(W.L, Array);
+    if (!W.L || LoopRanges.count(Key))
+      continue;
+    DEBUG(status("Caller", "Checking the range written by a loop on exit", 1));
+    IRBuilder<> EntryB(&Entry, Entry.begin());
+    IRBuilder<> Pre(W.L->getLoopPreheader()->getTerminator());
+    LoopRange &R = LoopRanges[Key];
+    R.Begin = EntryB.CreateAlloca(EntryB.getInt64Ty(), nullptr,
+                                  "assertions.range.begin");
+    R.End = EntryB.CreateAlloca(EntryB.getInt64Ty(), nullptr,
+                                "assertions.range.end");
+    Co.Stat.Allocas += 2;
+    // Nothing written yet: an empty range.
+    Pre.CreateStore(ConstantExpr::getSizeOf(Array->getAllocatedType()),
+                    R.Begin);
+    Pre.CreateStore(Pre.getInt64(0), R.End);
+    W.L->getExitBlocks(R.Exits);
+    LoopOrder.push_back(Key);
+  }
+  for (Write &W : Writes) {
+    AllocaInst *Array = W.RV->Array;
+    IRBuilder<> Builder(std::next(BasicBlock::iterator(W.Inst)));
+    Type *Int8PtrTy = Builder.getInt8PtrTy();
+    Value *Begin = Builder.CreatePtrDiff(
+      Builder.CreatePointerCast(W.Ptr, Int8PtrTy),
+      Builder.CreatePointerCast(Array, Int8PtrTy));
+    Value *End = Builder.CreateAdd(Begin,
+      Builder.CreateZExtOrTrunc(W.Size, Builder.getInt64Ty()));
+    if (!W.L) {
+      CreateRangeCalls(Builder, Array, Begin, End);
+      continue;
+    }
+    LoopRange &R = LoopRanges[std::make_pair(W.L, Array)];
+    Value *OldBegin = Builder.CreateLoad(R.Begin);
+    Value *OldEnd = Builder.CreateLoad(R.End);
+    Builder.CreateStore(Builder.CreateSelect(
+      Builder.CreateICmpULT(Begin, OldBegin), Begin, OldBegin), R.Begin);
+    Builder.CreateStore(Builder.CreateSelect(
+      Builder.CreateICmpUGT(End, OldEnd), End, OldEnd), R.End);
+  }
+  for (auto &Key : LoopOrder) {
+    LoopRange &R = LoopRanges[Key];
+    for (BasicBlock *Exit : R.Exits) {
+      IRBuilder<> Builder(Exit, Exit->getFirstInsertionPt());
+      CreateRangeCalls(Builder, Key.second, Builder.CreateLoad(R.Begin),
+                       Builder.CreateLoad(R.End));
+    }
+  }
+  return true;
+}
+
+void CallerInstrumenter::CollectAnnotations(BasicBlock &Block,
+                              SmallVectorImpl<Instruction *> &Annos,
+                              SmallVectorImpl<Instruction *> &FieldAnnos) {
+  for (auto &Inst : Block) {
     // Use CallSite to support invokes as well.
     CallSite CS(&Inst);
     if (!CS)
@@ -58,30 +576,193 @@ bool CallerInstrumenter::runOnBasicBlock(BasicBlock &Block) {
     switch (__builtin_expect(Callee->getIntrinsicID(),
                              Intrinsic::not_intrinsic)) {
       case Intrinsic::var_annotation:
-        modifiedIR |= InstrumentInit(Inst, CS);
-        break;
       case Intrinsic::assign_annotation:
-        modifiedIR |= InstrumentExpr(Inst, CS);
+        Annos.push_back(&Inst);
+        break;
+      case Intrinsic::ptr_annotation:
+        FieldAnnos.push_back(&Inst);
         break;
       case Intrinsic::not_intrinsic:
       default:
         continue;
     }
   }
-
-  return modifiedIR;
 }
 
 StringRef CallerInstrumenter::ParseAnnotationCall(CallSite &CS) {
-  auto I = CS.arg_begin() + 1;
   // Second one is getelementptr to the string annotation.
-  GlobalVariable *StrGV =
-    cast<GlobalVariable>(cast<ConstantExpr>(*I)->getOperand(0));
-  // Also drop the trailing '\0'.
-  auto Str = cast<ConstantDataSequential>(
-                StrGV->getInitializer())->getAsString().drop_back();
   // TODO is StrGV->getInitializer() a MDString? ->getString()
-  return Str;
+  return GetGlobalString(*(CS.arg_begin() + 1));
+}
+
+unsigned CallerInstrumenter::getSampleRate(Assertion &As, StringRef File,
+                                           uint64_t Line) {
+  // Most specific first: the site, then the kind, then the global rate.
+  auto It = SampleRates.find((File + ":" + Twine(Line)).str());
+  if (It == SampleRates.end())
+    It = SampleRates.find(As.Kind);
+  unsigned Rate = It != SampleRates.end() ? It->getValue() : SampleRate;
+  // 0 would mean never checking, which is what not annotating is for.
+  return Rate > 1 ? Rate : 1;
+}
+
+void CallerInstrumenter::CreateSampledUpdate(Instruction &Inst, Assertion &As,
+                                             unsigned Rate, bool IsSigned,
+                                             Function *Check, unsigned Site,
+                                             ArrayRef<Value *> Args) {
+  // A specialized check only takes the new value and the site.
+  Function *Update = Check;
+  SmallVector<Value *, 3> UpdateArgs(Args.begin(), Args.end());
+  if (Check)
+    UpdateArgs.erase(UpdateArgs.begin() + 1);
+  else
+    Update = Co.GetFuncFor(As.Kind, FuncType::Update, Args[0]->getType(),
+                           IsSigned);
+  // A site that is switched off doesn't even count down.
+  IRBuilder<> Builder(&Inst);
+  Co.CreateSwitch(Builder, Site);
+  if (Rate == 1) {
+    CreateUpdateCall(Builder, Update, UpdateArgs);
+    return;
+  }
+  DEBUG(status("Caller", "Sampling 1 in " + Twine(Rate) + " updates", 1));
+  LLVMContext &Context = Inst.getContext();
+  Function *ThisF = Inst.getParent()->getParent();
+  IntegerType *Int32Ty = Type::getInt32Ty(Context);
+
+  // Each site counts down its own updates, separately for each thread so
+  // that the counter stays a plain load and store.
+  // Initial exec is the cheapest model that still works in shared objects,
+  // as long as they are not dlopen()ed.
+  auto *Countdown = new GlobalVariable(*Mod, Int32Ty, false,
+    GlobalValue::InternalLinkage, ConstantInt::get(Int32Ty, 0),
+    "assertions.countdown", nullptr, GlobalVariable::InitialExecTLSModel);
+
+  Value *Count = Builder.CreateLoad(Countdown);
+  Value *Next = Builder.CreateSub(Count, Builder.getInt32(1));
+  // The first update is checked, then every Rate-th one.
+  Value *Sampled = Builder.CreateICmpSLT(Next, Builder.getInt32(0));
+  Builder.CreateStore(
+    Builder.CreateSelect(Sampled, Builder.getInt32(Rate - 1), Next),
+    Countdown);
+
+  Instruction *At = Builder.GetInsertPoint();
+  BasicBlock *Head = At->getParent();
+  BasicBlock *Cont = Head->splitBasicBlock(At, "assertions.cont");
+  BasicBlock *CheckBB =
+    BasicBlock::Create(Context, "assertions.check", ThisF, Cont);
+  BasicBlock *Skip =
+    BasicBlock::Create(Context, "assertions.skip", ThisF, Cont);
+  Head->getTerminator()->eraseFromParent();
+  Builder.SetInsertPoint(Head);
+  Builder.CreateCondBr(Sampled, CheckBB, Skip,
+    MDBuilder(Context).createBranchWeights(1, Rate - 1));
+
+  Builder.SetInsertPoint(CheckBB);
+  CreateUpdateCall(Builder, Update, UpdateArgs);
+  Builder.CreateBr(Cont);
+
+  Builder.SetInsertPoint(Skip);
+  if (!Check)
+    CreateRefresh(Builder, As, Args[0], Args[1], IsSigned);
+  Builder.CreateBr(Cont);
+}
+
+// Whether I can't read or change the variable at Addr (an alloca or a
+// global): it doesn't touch memory, is another annotation, or only loads
+// from or stores to some other variable.
+static bool LeavesVariableAlone(Instruction *I, Value *Addr) {
+  if (!I->mayReadOrWriteMemory())
+    return true;
+  if (auto *II = dyn_cast<IntrinsicInst>(I)) {
+    return II->getIntrinsicID() == Intrinsic::var_annotation ||
+      II->getIntrinsicID() == Intrinsic::assign_annotation;
+  }
+  Value *Ptr;
+  if (auto *Store = dyn_cast<StoreInst>(I)) {
+    if (Store->isVolatile())
+      return false;
+    Ptr = Store->getPointerOperand();
+  } else if (auto *Load = dyn_cast<LoadInst>(I)) {
+    if (Load->isVolatile())
+      return false;
+    Ptr = Load->getPointerOperand();
+  } else {
+    return false;
+  }
+  Value *Obj = GetUnderlyingObject(Ptr);
+  return Obj != Addr && isIdentifiedObject(Obj);
+}
+
+static bool IsStoreTo(Instruction *I, Value *Addr) {
+  auto *Store = dyn_cast<StoreInst>(I);
+  return Store && Store->getPointerOperand()->stripPointerCasts() == Addr;
+}
+
+Instruction *CallerInstrumenter::FindInitPoint(Instruction &Inst,
+                                               Value *Addr) {
+  // Clang stores the initial value right after the annotation, except for
+  // function parameters, which are stored right before it. Optimisations
+  // may have moved the computation of the initial value in between.
+  if (FindUpdateStore(Inst, Addr))
+    return Inst.getNextNode();
+  for (Instruction *I = Inst.getNextNode(); I && !isa<TerminatorInst>(I);
+       I = I->getNextNode()) {
+    if (IsStoreTo(I, Addr))
+      return I->getNextNode();
+    if (!LeavesVariableAlone(I, Addr))
+      break;
+  }
+  return Inst.getNextNode();
+}
+
+StoreInst *CallerInstrumenter::FindUpdateStore(Instruction &Inst,
+                                               Value *Addr) {
+  // The annotation follows the store of the new value, with at most the
+  // bitcast of the address in between at -O0. Once optimised, other
+  // instructions may have moved in between.
+  BasicBlock::iterator I = &Inst, Begin = Inst.getParent()->begin();
+  while (I != Begin) {
+    --I;
+    if (IsStoreTo(I, Addr))
+      return cast<StoreInst>(I);
+    if (!LeavesVariableAlone(I, Addr))
+      return nullptr;
+  }
+  return nullptr;
+}
+
+Function *CallerInstrumenter::GetSpecializedCheck(Assertion &As,
+                                                  Value *Addr) {
+  Type *ValTy = cast<PointerType>(Addr->getType())->getElementType();
+  return Co.GetSpecializedCheck(As, ValTy, IsSignedVariable(Addr));
+}
+
+void CallerInstrumenter::CreateRefresh(IRBuilder<> &Builder, Assertion &As,
+                                       Value *NewVal, Value *State,
+                                       bool IsSigned) {
+  // Assertions that carry state from one update to the next must still see
+  // every update, otherwise the next checked one compares against a stale
+  // value. Stateless ones don't define a refresh function.
+  if (Function *Refresh = Co.GetFuncFor(As.Kind, FuncType::Refresh,
+                                       NewVal->getType(), IsSigned,
+                                       /*strict=*/false)) {
+    if (Co.CanQueue(NewVal->getType(), State))
+      Co.CreateQueuedCall(Builder, Refresh, NewVal, State, nullptr);
+    else
+      Builder.CreateCall2(Refresh, NewVal, State);
+  }
+}
+
+void CallerInstrumenter::CreateUpdateCall(IRBuilder<> &Builder, Function *F,
+                                          ArrayRef<Value *> Args) {
+  // The new value first and the site last, with the state in between
+  // unless F is a specialized check.
+  Value *State = Args.size() > 2 ? Args[1] : nullptr;
+  if (Co.CanQueue(Args[0]->getType(), State))
+    Co.CreateQueuedCall(Builder, F, Args[0], State, Args.back());
+  else
+    Co.CreateCheckCall(Builder, F, Args);
 }
 
 bool CallerInstrumenter::InstrumentInit(Instruction &Inst, CallSite &CS) {
@@ -91,75 +772,40 @@ bool CallerInstrumenter::InstrumentInit(Instruction &Inst, CallSite &CS) {
   // *I is the i8* bitcast of the new variable, save that.
   Value *Addr = (*I++);
   Assertion As = AM.getParsedAssertion(ParseAnnotationCall(CS));
+  // The variable itself. There is no bitcast if it is an i8 already.
+  Value *DirectAddr = Addr->stripPointerCasts();
+  Type *ValTy = cast<PointerType>(DirectAddr->getType())->getElementType();
+
+  // No state to initialise: just check the initial value.
+  if (Function *Check = GetSpecializedCheck(As, DirectAddr)) {
+    IRBuilder<> Builder(FindInitPoint(Inst, DirectAddr));
+    unsigned Site = Co.GetSiteFor(As, cast<Constant>(CS.getArgument(2)),
+                                  cast<Constant>(CS.getArgument(3)));
+    Co.CreateSwitch(Builder, Site);
+    Value *Args[] = {
+      Builder.CreateLoad(DirectAddr), Co.GetSiteRef(Site)
+    };
+    CreateUpdateCall(Builder, Check, Args);
+    Inst.eraseFromParent();
+    return true;
+  }
 
-  Function *F = Co.GetFuncFor(As.Kind, FuncType::Init);
+  Function *F = Co.GetFuncFor(As.Kind, FuncType::Init, ValTy,
+                              IsSignedVariable(DirectAddr));
   IRBuilder<> Builder(Inst.getParent());
 
   // === Converting Props =================================================
 
   // Pass props as NULL-terminated array of strings.
   auto *PropsTy = cast<PointerType>(F->getFunctionType()->getParamType(2));
-  // Or could get it out of ParamTy.
-  auto *ElemTy  = Builder.getInt8PtrTy();
-  // The array type should be compatible with ParamTy(now i8**).
-  //auto Props = ConstantPointerNull::get(Builder.getInt8PtrTy()->getPointerTo());
-  static_assert(sizeof(int) <= sizeof(char *),
-    "sizeof(int) must fit into char*");
-  // Make As.Params nicer: parse ints directly to int (fits in i8*)
-  SmallVector<Constant*, 3> ParamsArr;
-  for (StringRef str : As.Params) {
-    DEBUG(info("Param") << str << "\n");
-    int Int; // TODO Could make it size_t? always the size of a pointer,
-    // and modify Assertions.c accordingly to cast to size_t
-    // TODO If converted to int, will have to bitcast it to ElemTy.
-    if (!str.getAsInteger(0, Int)) {
-      // TODO assuming sizeof(int) == 4
-      Constant *IntC = ConstantInt::get(Builder.getInt32Ty(), Int);
-      ParamsArr.push_back(
-        ConstantExpr::getIntToPtr(IntC, ElemTy));
-      continue;
-    }
-
-    // Default case: create a constant string.
-    auto *StrPtr = Co.GetPtrToGlobalString(str, "assertions.prop");
-    ParamsArr.push_back(StrPtr);
-    DEBUG(info("Which GEPped") << *ParamsArr.back() << "\n");
-  }
-  // End the list with a NULL ptr.
-  ParamsArr.push_back(ConstantPointerNull::get(ElemTy));
-  // TODO move all these in a CreateGlobalArray method
-  auto *ArrayTy = ArrayType::get(ElemTy, ParamsArr.size());
-
-  auto *Array = ConstantArray::get(ArrayTy, ParamsArr);
-  auto *ArrayGV = 
-          new GlobalVariable(*Mod, Array->getType(), true,
-            GlobalValue::PrivateLinkage, Array,
-            "assertions.props");
-
-  DEBUG(info("Params array") << *ArrayGV << "\n");
-  // We can't just do a bitcast to ParamTy, we need a GEP.
-  // TODO ocnsider ConstantExpr::getGetElementPtr(ArrayGV, )
-  auto *Props = Builder.CreateConstInBoundsGEP2_32(ArrayGV, 0, 0);
+  Constant *Props = Co.GetPropsFor(As);
   assert(Props->getType() == PropsTy && "Props argument type mismatch");
   DEBUG(info("Props arg") << *Props << "\n");
 
 
-  // Name of the state variable.
-  auto StateName = getStateName(As.UID);
   // Make sure to insert after the initialisation (store), because in most
-  // cases it follows the annotation, and we want to run _after_ that. The
-  // exception is function parameters, the "store" happens right before. So
-  // just decide based on whether next instruction is a store.
-  Instruction *Here = Inst.getNextNode();
-  // BitCast
-  Value *DirectAddr = cast<CastInst>(Addr)->getOperand(0);
-  if (isa<StoreInst>(Here) &&
-      // Store location == address specified in annotation?
-      cast<StoreInst>(Here)->getPointerOperand() == DirectAddr) {
-    // It is, save it after that then.
-    Here = Here->getNextNode();
-  }
-  Builder.SetInsertPoint(Here);
+  // cases it follows the annotation, and we want to run _after_ that.
+  Builder.SetInsertPoint(FindInitPoint(Inst, DirectAddr));
 
   // If the struct type is not declared even, this creates an empty StructType
   // and returns that instead.
@@ -170,29 +816,26 @@ bool CallerInstrumenter::InstrumentInit(Instruction &Inst, CallSite &CS) {
   if (Type->isOpaque() || Type->getNumElements() == 0) {
     StateVar = ConstantPointerNull::get(Type->getPointerTo());
   } else {
-  // TODO add a special assertion flag (not parameter?) that says "i'm going
-  // to allocate memory myself", this probably can be tested by checking for
-  // the existence of a different function that allocates and returns a
-  // pointer, and it would be retrieved by , then that pointer would get passed to the init
-  // function.
-    // USE THIS:
-       //  GetFuncFor(As.Kind, FuncType::Alloc)
-    auto *Alloca = Builder.CreateAlloca(Type, nullptr, StateName);
-    // And save it for re-use.
-    States[As.UID] = Alloca;
-    DEBUG(info("Alloca state") << Alloca->getName() << "  isStatic=" 
-      << Alloca->isStaticAlloca() << "\n");
-    StateVar = Alloca;
-  }
-  //The last 2 parameters pass as in the annotation call (file name & line).
-  Value *FNameExpr = *++I;
-  auto *FName =
-    cast<GlobalValue>(cast<ConstantExpr>(FNameExpr)->getOperand(0));
-  // Notice:
-  // We're using a string that's sitting in "llvm.metadata", which will
-  // magically vanish upon CodeGen, so let's go ahead and remove that.
-  FName->setSection("");
-  Builder.CreateCall5(F, StateVar, Addr, Props, FNameExpr, *++I);
+    // A slot in the function's frame of states, or a state from the pool if
+    // the kind has an alloc function. If the optimiser duplicated the
+    // initialisation, e.g. by unswitching a loop, both copies initialise the
+    // same state.
+    StateVar = States.lookup(As.UID);
+    assert(StateVar && "Initialised state has no slot in the frame");
+  }
+  // The last 2 parameters of the annotation call (file name & line) describe
+  // the site.
+  Constant *FNameExpr = cast<Constant>(*++I);
+  Constant *LineNo = cast<Constant>(*++I);
+  unsigned Site = Co.GetSiteFor(As, FNameExpr, LineNo);
+  // Queued updates of the state may still be waiting, e.g. from the
+  // previous iteration of a loop declaring the variable, so its
+  // initialisation waits its turn too.
+  if (Co.CanQueue(ValTy, StateVar))
+    Co.CreateQueuedCall(Builder, F, Builder.CreateLoad(DirectAddr), StateVar,
+                        Co.GetSiteRef(Site), Props);
+  else
+    Builder.CreateCall4(F, StateVar, Addr, Props, Co.GetSiteRef(Site));
   // Builder.CreateStore(Call, Alloca);
 
   // auto FTy = FunctionType::get(
@@ -202,14 +845,272 @@ bool CallerInstrumenter::InstrumentInit(Instruction &Inst, CallSite &CS) {
   return true;
 }
 
+bool CallerInstrumenter::InstrumentField(Instruction &Inst, CallSite &CS) {
+  StringRef anno = ParseAnnotationCall(CS);
+  if (!anno.startswith("assertion,"))
+    return false;
+  DEBUG(status("Caller", "Instrumenting assertion on a field"));
+  Assertion As = AM.getParsedAssertion(anno);
+  unsigned Site = Co.GetSiteFor(As, cast<Constant>(CS.getArgument(2)),
+                                cast<Constant>(CS.getArgument(3)));
+  // Clang accesses the field through what the annotation returns, cast to
+  // the field's type.
+  SmallVector<StoreInst *, 4> Stores;
+  SmallVector<Value *, 4> Worklist(1, &Inst);
+  while (!Worklist.empty()) {
+    Value *V = Worklist.pop_back_val();
+    for (auto UI = V->use_begin(), UE = V->use_end(); UI != UE; ++UI) {
+      if (isa<BitCastInst>(*UI)) {
+        Worklist.push_back(*UI);
+      } else if (auto *Store = dyn_cast<StoreInst>(*UI)) {
+        if (Store->getPointerOperand() == V)
+          Stores.push_back(Store);
+      }
+    }
+  }
+  bool IsSigned = IsSignedField(CS.getArgument(0));
+  for (StoreInst *Store : Stores)
+    InstrumentFieldStore(*Store, As, Site, IsSigned);
+  Inst.replaceAllUsesWith(CS.getArgument(0));
+  Inst.eraseFromParent();
+  return true;
+}
+
+void CallerInstrumenter::NoteAssertedField(CallSite &CS) {
+  StringRef anno = ParseAnnotationCall(CS);
+  if (!anno.startswith("assertion,"))
+    return;
+  // &obj->field, with the struct type of obj in the GEP.
+  auto *GEP = dyn_cast<GEPOperator>(CS.getArgument(0)->stripPointerCasts());
+  if (!GEP || !GEP->hasAllConstantIndices() || GEP->getNumIndices() < 2 ||
+      !cast<Constant>(GEP->getOperand(1))->isNullValue())
+    return;
+  auto *STy = dyn_cast<StructType>(
+    cast<PointerType>(GEP->getPointerOperandType())->getElementType());
+  if (!STy)
+    return;
+  // Kinds without a state have nothing in the shadow map.
+  Assertion As = AM.getParsedAssertion(anno);
+  StructType *StateTy = Co.getStructTypeFor(As.Kind);
+  if (StateTy->isOpaque() || StateTy->getNumElements() == 0)
+    return;
+  SmallVector<Constant *, 4> Indices;
+  for (auto I = GEP->idx_begin(), E = GEP->idx_end(); I != E; ++I)
+    Indices.push_back(cast<Constant>(*I));
+  Constant *Offset = ConstantExpr::getPtrToInt(
+    ConstantExpr::getGetElementPtr(
+      ConstantPointerNull::get(STy->getPointerTo()), Indices),
+    Type::getInt32Ty(CS->getContext()));
+  SmallVectorImpl<Constant *> &Offsets = AssertedFields[STy];
+  if (std::find(Offsets.begin(), Offsets.end(), Offset) == Offsets.end())
+    Offsets.push_back(Offset);
+}
+
+bool CallerInstrumenter::CreateFieldReleases(Function &F) {
+  // How a call is done with the object it is given first.
+  enum ReleaseKind { Free, Moved, Forget };
+  struct Release {
+    CallSite CS;
+    ReleaseKind Kind;
+    StructType *Type;
+  };
+  SmallVector<Release, 4> Releases;
+  for (BasicBlock &BB : F) {
+    for (Instruction &I : BB) {
+      CallSite CS(&I);
+      Function *Callee = CS ? CS.getCalledFunction() : nullptr;
+      if (!Callee || CS.arg_size() < 1)
+        continue;
+      StringRef Name = Callee->getName();
+      ReleaseKind Kind;
+      // free(), and C++'s delete and delete[], sized or not.
+      if (Name == "free" || Name.startswith("_ZdlPv") ||
+          Name.startswith("_ZdaPv"))
+        Kind = Free;
+      else if (Name == "realloc")
+        Kind = Moved;
+      else if (Name == "__assertions_forget_fields")
+        Kind = Forget;
+      else
+        continue;
+      // Not for an invoke of realloc(), which never throws.
+      if (Kind == Moved && !isa<CallInst>(&I))
+        continue;
+      auto *PTy = dyn_cast<PointerType>(
+        CS.getArgument(0)->stripPointerCasts()->getType());
+      auto *STy = PTy ? dyn_cast<StructType>(PTy->getElementType()) : nullptr;
+      if (STy && !AssertedFields.count(STy))
+        STy = nullptr;
+      if (Kind != Forget && !STy)
+        continue;
+      Release R = { CS, Kind, STy };
+      Releases.push_back(R);
+    }
+  }
+
+  for (Release &R : Releases) {
+    Instruction *Call = R.CS.getInstruction();
+    if (R.Type) {
+      GlobalVariable *&Offsets = FieldOffsets[R.Type];
+      if (!Offsets) {
+        ArrayRef<Constant *> Fields = AssertedFields[R.Type];
+        auto *ArrTy = ArrayType::get(Type::getInt32Ty(F.getContext()),
+                                     Fields.size());
+        Offsets = new GlobalVariable(*Mod, ArrTy, true,
+                                     GlobalValue::PrivateLinkage,
+                                     ConstantArray::get(ArrTy, Fields),
+                                     "assertions.fields");
+        Offsets->setUnnamedAddr(true);
+      }
+      IRBuilder<> Builder(Call);
+      Value *Obj = Builder.CreateBitCast(R.CS.getArgument(0),
+                                         Builder.getInt8PtrTy());
+      Value *Begin = Builder.CreateConstInBoundsGEP2_32(Offsets, 0, 0);
+      Value *Count = Builder.getInt32(
+        cast<ArrayType>(Offsets->getType()->getElementType())
+          ->getNumElements());
+      if (R.Kind == Moved) {
+        // Once the new address is known.
+        Builder.SetInsertPoint(std::next(BasicBlock::iterator(Call)));
+        Value *To = Builder.CreateBitCast(Call, Builder.getInt8PtrTy());
+        Builder.CreateCall4(Co.GetRuntimeFunc("__assertions_shadow_moved"),
+                            Obj, To, Begin, Count);
+      } else {
+        Builder.CreateCall3(Co.GetRuntimeFunc("__assertions_shadow_forget"),
+                            Obj, Begin, Count);
+      }
+      ++Co.Stat.FieldReleases;
+    }
+    // ForgetAssertedFields() only marks the object for the instrumenter, on
+    // asserted fields or not.
+    if (R.Kind == Forget) {
+      if (auto *II = dyn_cast<InvokeInst>(Call))
+        BranchInst::Create(II->getNormalDest(), II);
+      Call->eraseFromParent();
+    }
+  }
+  return !Releases.empty();
+}
+
+bool CallerInstrumenter::IsSignedField(Value *Addr) {
+  const DataLayout *DL = getAnalysisIfAvailable<DataLayout>();
+  auto *GEP = dyn_cast<GEPOperator>(Addr->stripPointerCasts());
+  if (!DL || !GEP || !GEP->hasAllConstantIndices())
+    return true;
+  auto *STy = dyn_cast<StructType>(
+    cast<PointerType>(GEP->getPointerOperandType())->getElementType());
+  if (!STy || !STy->hasName() || STy->isOpaque())
+    return true;
+  if (!FoundStructDebugTypes) {
+    DebugInfoFinder Finder;
+    Finder.processModule(*Mod);
+    for (auto I = Finder.type_begin(), E = Finder.type_end(); I != E; ++I) {
+      DIType T(*I);
+      if (T.isCompositeType() && !T.isForwardDecl() &&
+          (T.getTag() == dwarf::DW_TAG_structure_type ||
+           T.getTag() == dwarf::DW_TAG_class_type ||
+           T.getTag() == dwarf::DW_TAG_union_type))
+        StructDebugTypes.GetOrCreateValue(T.getName(), *I);
+    }
+    FoundStructDebugTypes = true;
+  }
+  // struct.conn, struct.conn.12 or class.ns::conn for the type conn.
+  StringRef Name = STy->getName().split('.').second;
+  std::pair<StringRef, StringRef> Suffix = Name.rsplit('.');
+  unsigned N;
+  if (!Suffix.second.getAsInteger(10, N))
+    Name = Suffix.first;
+  Name = Name.substr(Name.rfind(':') + 1);
+  MDNode *Node = StructDebugTypes.lookup(Name);
+  if (!Node)
+    return true;
+  SmallVector<Value *, 4> Indices(GEP->idx_begin(), GEP->idx_end());
+  int64_t Offset = DL->getIndexedOffset(GEP->getPointerOperandType(), Indices);
+  if (Offset < 0)
+    return true;
+  Offset %= DL->getTypeAllocSize(STy);
+  return IsSignedMember(DIType(Node), Offset * 8);
+}
+
+void CallerInstrumenter::InstrumentFieldStore(StoreInst &Store, Assertion &As,
+                                              unsigned Site, bool IsSigned) {
+  LLVMContext &Context = Store.getContext();
+  Function *ThisF = Store.getParent()->getParent();
+  Value *NewVal = Store.getValueOperand();
+  Type *ValTy = NewVal->getType();
+  IRBuilder<> Builder(std::next(BasicBlock::iterator(&Store)));
+  Co.CreateSwitch(Builder, Site);
+  ++Co.Stat.FieldChecks;
+  if (Function *Check = Co.GetSpecializedCheck(As, ValTy, IsSigned)) {
+    Value *Args[] = { NewVal, Co.GetSiteRef(Site) };
+    Co.CreateCheckCall(Builder, Check, Args);
+    return;
+  }
+  Function *Update = Co.GetFuncFor(As.Kind, FuncType::Update, ValTy,
+                                   IsSigned);
+  StructType *Type = Co.getStructTypeFor(As.Kind);
+  if (Type->isOpaque() || Type->getNumElements() == 0) {
+    Value *Args[] = {
+      NewVal, ConstantPointerNull::get(Type->getPointerTo()),
+      Co.GetSiteRef(Site)
+    };
+    Co.CreateCheckCall(Builder, Update, Args);
+    return;
+  }
+  // Narrower fields could share a slot of the shadow map.
+  if (ValTy->getPrimitiveSizeInBits() < 32) {
+    Context.emitError(&Store, "Assertions on struct fields need fields of "
+                      "at least 32 bits");
+    return;
+  }
+
+  // state = lookup(&field)
+  // if (state) update(new, state) else init(create(&field), &field)
+  Function *Init = Co.GetFuncFor(As.Kind, FuncType::Init, ValTy, IsSigned);
+  Value *Addr = Builder.CreateBitCast(Store.getPointerOperand(),
+                                      Builder.getInt8PtrTy());
+  Value *Found = Builder.CreateCall(
+    Co.GetRuntimeFunc("__assertions_shadow_lookup"), Addr,
+    "assertions.shadow");
+  Value *SiteRef = Co.GetSiteRef(Site);
+  Instruction *Next = Builder.GetInsertPoint();
+  BasicBlock *Head = Next->getParent();
+  BasicBlock *Cont = Head->splitBasicBlock(Next, "assertions.cont");
+  BasicBlock *UpdateBB =
+    BasicBlock::Create(Context, "assertions.field.update", ThisF, Cont);
+  BasicBlock *CreateBB =
+    BasicBlock::Create(Context, "assertions.field.create", ThisF, Cont);
+  Head->getTerminator()->eraseFromParent();
+  Builder.SetInsertPoint(Head);
+  // Only the first store to each field creates its state.
+  Builder.CreateCondBr(Builder.CreateIsNotNull(Found), UpdateBB, CreateBB,
+    MDBuilder(Context).createBranchWeights(64, 4));
+
+  Builder.SetInsertPoint(UpdateBB);
+  Value *Args[] = {
+    NewVal, Builder.CreateBitCast(Found, Type->getPointerTo()), SiteRef
+  };
+  Co.CreateCheckCall(Builder, Update, Args);
+  Builder.CreateBr(Cont);
+
+  // The value of the first store is the field's initial value.
+  Builder.SetInsertPoint(CreateBB);
+  Constant *Size = ConstantExpr::getTruncOrBitCast(
+    ConstantExpr::getSizeOf(Type), Builder.getInt32Ty());
+  Value *State = Builder.CreateCall2(
+    Co.GetRuntimeFunc("__assertions_shadow_create"), Addr, Size);
+  Builder.CreateCall4(Init, Builder.CreateBitCast(State, Type->getPointerTo()),
+                      Addr, Co.GetPropsFor(As), SiteRef);
+  Builder.CreateBr(Cont);
+}
+
 bool CallerInstrumenter::InstrumentExpr(Instruction &Inst, CallSite &CS) {
   DEBUG(status("Caller", "Instrumenting assertion Expr"));
   // This should also be used for CallExpr (Clang).
   auto I = CS.arg_begin();
-  // Value *Addr = (*I++);
   // Addr should the i8* bitcast of the modified variable, but it can also be
   // *null, specifically when we're annotating a clang CallExpr.
-  I++;
+  Value *Addr = (*I++)->stripPointerCasts();
   StringRef anno = ParseAnnotationCall(CS);
   StringRef prefix1 = "assertion,";
   LLVMContext &Context = Inst.getParent()->getParent()->getContext();
@@ -220,10 +1121,13 @@ bool CallerInstrumenter::InstrumentExpr(Instruction &Inst, CallSite &CS) {
     // in order to supply the states for the UIDs in extra arguments.
     // Callee pass should have already added null values for those arguments.
 
-    // HACK: Taking a BIG risk here, but assume it's for the CallInst just
-    // before this one (or InvokeInst...)
+    // HACK: Taking a BIG risk here, but assume it's for the closest call
+    // before this one (or InvokeInst...), which isn't to an intrinsic.
     Instruction *Call = Inst.getPrevNode();
-    assert(Call && "No prev node before meta assertion");
+    while (Call && !(CallSite(Call) && CallSite(Call).getCalledFunction() &&
+                     !CallSite(Call).getCalledFunction()->isIntrinsic()))
+      Call = Call->getPrevNode();
+    assert(Call && "No call before meta assertion");
     auto PrevCS = CallSite(Call);
     // However, here asserting it's a CallInst. Technically, sould be fine if
     // it's an InvokeInst too, but I don't think the Clang transform can ever
@@ -250,7 +1154,14 @@ bool CallerInstrumenter::InstrumentExpr(Instruction &Inst, CallSite &CS) {
         report_fatal_error("Replaced arg should be undef, as set by Callee");
       }
       // Change it to pass in the state instead, as described by the UID.
-      Value *state = States[UID];
+      // Assertions checked by a specialized check have none, and the callee
+      // doesn't use it.
+      Value *state = States.lookup(UID);
+      if (!state)
+        state = Inst.getParent()->getParent()->getValueSymbolTable().lookup(
+          getStateName(UID));
+      if (!state)
+        state = Constant::getNullValue(Arg->getType());
       PrevCS.setArgument(lastArg, state);
     }
 
@@ -258,42 +1169,76 @@ bool CallerInstrumenter::InstrumentExpr(Instruction &Inst, CallSite &CS) {
 
   } else if (anno.startswith(prefix1)) {
     Assertion As = AM.getParsedAssertion(anno);
-    Function *F = Co.GetFuncFor(As.Kind, FuncType::Update);
-
-    IRBuilder<> Builder(Inst.getParent());
-    Builder.SetInsertPoint(&Inst);
-
-    Value *FNameExpr = *++I;
-    auto *FName =
-      cast<GlobalValue>(cast<ConstantExpr>(FNameExpr)->getOperand(0));
-    // Notice:
-    // We're using a string that's sitting in "llvm.metadata", which will
-    // magically vanish upon CodeGen, so let's go ahead and remove that.
-    FName->setSection("");
+    Constant *FNameExpr = cast<Constant>(*++I);
 
-    auto *State = States[As.UID];
+    Function *Check = GetSpecializedCheck(As, Addr);
+    Value *State = States.lookup(As.UID);
     Function *ThisF = Inst.getParent()->getParent();
     if (!State) {
       // Haven't generated the alloca here, must be function parameter.
       State = ThisF->getValueSymbolTable().lookup( getStateName(As.UID) );
     }
     DEBUG(info("Annotated Expr") << *CS.getInstruction() << "\n");
+    if (!State && Check)
+      State = Constant::getNullValue(
+        Co.getStructTypeFor(As.Kind)->getPointerTo());
     DEBUG(info("State") << *State << "\n");
     if (!State) {
       Concatenation Err;
       Err << "Couldn't find state for UID " << As.UID;
-      Err << " in function '" << ThisF->getName() << "'. ";
-      Err << "Only pass unoptimised modules to this program.";
+      Err << " in function '" << ThisF->getName() << "'.";
       Context.emitError(&Inst, Err.str());
       return true;
     }
-    // Instead of passing Addr (the updated variable's address), look 2
-    // instructions behind for the store (because one instruction behind is
-    // the addr bitcast), and pass the value.
-    auto *store = dyn_cast<StoreInst>(Inst.getPrevNode()->getPrevNode());
-    assert(store && "Variable update annotation, but no store beforehand");
-    auto *NewVal = store->getValueOperand();
-    Builder.CreateCall4(F, NewVal, State, FNameExpr, *++I);
+    // Instead of passing Addr (the updated variable's address), pass the
+    // value stored. If the store can't be found (it may be in another block
+    // once optimised, or store the value as another type), read the value
+    // back: the annotation may read memory, so the store happens before it.
+    Type *ValTy = cast<PointerType>(Addr->getType())->getElementType();
+    StoreInst *store = FindUpdateStore(Inst, Addr);
+    if (store && store->getValueOperand()->getType() != ValTy)
+      store = nullptr;
+    Value *NewVal = store ? store->getValueOperand()
+                          : IRBuilder<>(&Inst).CreateLoad(Addr);
+    bool IsSigned = IsSignedVariable(Addr);
+    Constant *LineNo = cast<Constant>(*++I);
+    // This comes first: checks already deferred in this loop rely on seeing
+    // all of the variable's updates in it.
+    if (Loop *L = DeferredTo.lookup(&Inst)) {
+      Deferral.defer(Inst, L, As, NewVal, IsSigned, State, Check,
+                     Co.GetSiteFor(As, FNameExpr, LineNo));
+      ++Co.Stat.DeferredChecks;
+      Inst.eraseFromParent();
+      return true;
+    }
+    unsigned Rate = getSampleRate(As, GetGlobalString(FNameExpr),
+                                  cast<ConstantInt>(LineNo)->getZExtValue());
+    if (ProveChecks && store) {
+      // The previous value may have been stored by any update site of the
+      // variable, so all of them must have checked it.
+      bool PrevChecked = AssumeAbort && Co.ChecksAlwaysRun() &&
+        !SampledUIDs.count(As.UID);
+      auto Result = Prover.Prove(As, store, IsSigned, PrevChecked);
+      DEBUG(info("Proved") << AssertionProver::ResultName(Result) << "\n");
+      if (Result == AssertionProver::AlwaysHolds) {
+        IRBuilder<> Builder(&Inst);
+        if (!Check)
+          CreateRefresh(Builder, As, NewVal, State, IsSigned);
+        ++Co.Stat.ProvenChecks;
+        Inst.eraseFromParent();
+        return true;
+      }
+      if (Result == AssertionProver::AlwaysFails) {
+        // Still instrument it, in case the error doesn't stop us.
+        Context.emitError(&Inst, GetGlobalString(FNameExpr) + ":" +
+          Twine(cast<ConstantInt>(LineNo)->getZExtValue()) + ": " +
+          As.Kind + " assertion always fails on this update");
+      }
+    }
+    unsigned Site = Co.GetSiteFor(As, FNameExpr, LineNo);
+    IRBuilder<> Builder(&Inst);
+    Value *Args[] = { NewVal, State, Co.GetSiteRef(Site) };
+    CreateSampledUpdate(Inst, As, Rate, IsSigned, Check, Site, Args);
   }
   Inst.eraseFromParent();
   return true;
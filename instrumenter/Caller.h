@@ -32,22 +32,36 @@
 #define	ANNOTATEVARIABLES_CALLER_INSTRUMENTATION_H
 
 #include "Common.h"
+#include "LoopChecks.h"
+#include "Prover.h"
 // From the clang tool.
 #include "Assertion.h"
 
 #include "llvm/ADT/StringMap.h"
 #include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/SmallVector.h"
 #include "llvm/ADT/StringRef.h"
+#include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Value.h"
 #include "llvm/Pass.h"
 
 
 namespace llvm {
+  class AllocaInst;
+  class BasicBlock;
   class Function;
   class Instruction;
   class LLVMContext;
+  class Loop;
+  class LoopInfo;
+  class MDNode;
+  class StoreInst;
+  class StructType;
+  class GlobalVariable;
   class Module;
   class CallSite;
+  template <typename T> class SmallVectorImpl;
 }
 
 namespace assertions {
@@ -60,27 +74,167 @@ class CallerInstrumenter : public llvm::FunctionPass {
 private:
   llvm::DenseMap<int, llvm::Value *> States;
 
+  // Sample rates given on the command line, keyed by either assertion kind
+  // or "<file>:<line>" of the update site.
+  llvm::StringMap<unsigned> SampleRates;
+  // The UIDs with an update site in the module that is sampled.
+  llvm::DenseSet<int> SampledUIDs;
+
   AssertionManager AM; // To parse assertion strings.
+  AssertionProver Prover; // To leave out checks decided at compile time.
+
+  // Update checks moved out of loops, and the loop each update site's check
+  // is moved out of.
+  LoopCheckDeferral Deferral;
+  llvm::DenseMap<llvm::Instruction *, llvm::Loop *> DeferredTo;
+
+  // An assertion on the elements of a local array, checked by its range
+  // function (e.g. __range_sorted_i32) over the elements written.
+  struct RangeVar {
+    int UID;
+    llvm::AllocaInst *Array;
+    llvm::Function *Check;
+    // Where the array is declared, and the site of its assertion.
+    llvm::BasicBlock *Decl;
+    unsigned Site;
+    bool Sorted;
+    // The elements [Begin, End) of the array written since its declaration
+    // (i64 indices), shared by the assertions on it.
+    llvm::AllocaInst *WrittenBegin, *WrittenEnd;
+  };
+  llvm::SmallVector<RangeVar, 4> RangeVars;
+
+  // The offsets (i32 constants) of the fields with stateful assertions in
+  // each struct type, and the array of them passed to the run-time, made
+  // when first needed.
+  llvm::DenseMap<llvm::StructType *, llvm::SmallVector<llvm::Constant *, 4>>
+    AssertedFields;
+  llvm::DenseMap<llvm::StructType *, llvm::GlobalVariable *> FieldOffsets;
+  // The debug info of the module's structs, classes and unions by name, to
+  // tell whether asserted fields are signed. Found when first needed.
+  llvm::StringMap<llvm::MDNode *> StructDebugTypes;
+  bool FoundStructDebugTypes;
 public:
 
   static char ID;
-  CallerInstrumenter(Common &C) : FunctionPass(ID), Co(C) {}
+  CallerInstrumenter(Common &C)
+    : FunctionPass(ID), Co(C), Deferral(C) {}
   ~CallerInstrumenter();
 
   const char* getPassName() const {
     return "Assertions function instrumenter (caller-side)";
   }
 
+  virtual void getAnalysisUsage(llvm::AnalysisUsage &AU) const;
   virtual bool doInitialization(llvm::Module &M);
   virtual bool runOnFunction(llvm::Function &Fn);
-  virtual bool runOnBasicBlock(llvm::BasicBlock &Block);
+  virtual bool doFinalization(llvm::Module &M);
 
 private:
+  // Collects the annotation intrinsic calls in Block, in order, and the
+  // annotations of field accesses in FieldAnnos. These are instrumented only
+  // after the whole function has been scanned, as instrumenting may split
+  // blocks.
+  void CollectAnnotations(
+    llvm::BasicBlock &Block,
+    llvm::SmallVectorImpl<llvm::Instruction *> &Annos,
+    llvm::SmallVectorImpl<llvm::Instruction *> &FieldAnnos);
+
+  // Allocates the states of the variables initialised in Fn, in a single
+  // struct in the entry block, the most used first, and fills in States.
+  void CreateStateFrame(llvm::Function &Fn,
+                        llvm::ArrayRef<llvm::Instruction *> Annos);
+
+  // Decides which update sites of Fn get their checks moved out of loops.
+  void PlanLoopDeferral(llvm::Function &Fn,
+                        llvm::ArrayRef<llvm::Instruction *> Annos);
+
+  // Checks the writes to arrays with range assertions in Fn: stores and
+  // memset/memcpy/memmove right after them, over the elements written, and
+  // writes in a loop once it exits, over all the elements it wrote. Takes
+  // the annotations of these assertions out of Annos.
+  bool CreateRangeChecks(llvm::Function &Fn,
+                         llvm::SmallVectorImpl<llvm::Instruction *> &Annos);
+
+  // Calls the range functions of Array on the elements overlapping the
+  // bytes [Begin, End) of it (i64 offsets), and adds these to the elements
+  // written.
+  void CreateRangeCalls(llvm::IRBuilder<> &Builder, llvm::AllocaInst *Array,
+                        llvm::Value *Begin, llvm::Value *End);
+
+  // The innermost loop around BB, if the writes to an array declared in
+  // Decl can wait for it to exit.
+  static llvm::Loop *GetRangeLoop(llvm::LoopInfo &LI, llvm::BasicBlock *BB,
+                                  llvm::BasicBlock *Decl);
+
   bool InstrumentInit(llvm::Instruction &Inst, llvm::CallSite &CS);
   bool InstrumentExpr(llvm::Instruction &Inst, llvm::CallSite &CS);
 
+  // Checks the stores through an access to an asserted field (a
+  // llvm.ptr.annotation call), against the state of the field in the
+  // run-time's shadow map, created by the first store.
+  bool InstrumentField(llvm::Instruction &Inst, llvm::CallSite &CS);
+
+  // Adds the field the llvm.ptr.annotation call CS is about to
+  // AssertedFields, if its address is a constant GEP into a struct.
+  void NoteAssertedField(llvm::CallSite &CS);
+
+  // Drops the states of the asserted fields of the objects Fn frees, before
+  // it calls free() or delete on them, after a realloc() that moved them,
+  // and where it calls ForgetAssertedFields(). Only objects whose struct
+  // type is known from the pointer freed are.
+  bool CreateFieldReleases(llvm::Function &Fn);
+  void InstrumentFieldStore(llvm::StoreInst &Store, Assertion &As,
+                            unsigned Site, bool IsSigned);
+
+  // Whether the field at Addr (a constant GEP into the struct, maybe cast)
+  // is signed, according to the debug info of the struct. Signed if there
+  // is none.
+  bool IsSignedField(llvm::Value *Addr);
+
+  // Where the init function of the variable at Addr goes, given its
+  // annotation Inst: after the store of its initial value, if there is one.
+  static llvm::Instruction *FindInitPoint(llvm::Instruction &Inst,
+                                          llvm::Value *Addr);
+
+  // The store of the new value of the variable at Addr that the update
+  // annotation Inst is about, if it's still in the same block, and nothing
+  // in between can change the variable.
+  static llvm::StoreInst *FindUpdateStore(llvm::Instruction &Inst,
+                                          llvm::Value *Addr);
+
   // Gets the annotation string from call of the form void(i8*,i8*,i8*,i32).
   StringRef ParseAnnotationCall(llvm::CallSite &CS);
+
+  // How many updates of an asserted variable to go through for each one
+  // that actually gets checked. 1 means check every update.
+  unsigned getSampleRate(Assertion &As, StringRef File, uint64_t Line);
+
+  // Emits the update check right before Inst, with the arguments of the
+  // update function in Args (new value, state, site). If the site is
+  // sampled, only 1 in Rate calls reach the update function, and the rest
+  // call the assertion's refresh function (if any) to keep its state current.
+  // IsSigned tells which of the functions for the value's type to call.
+  // Check, if not null, is called instead of the update function, without
+  // the state. All of it is behind the switch of Site, if it has one.
+  void CreateSampledUpdate(llvm::Instruction &Inst, Assertion &As,
+                           unsigned Rate, bool IsSigned,
+                           llvm::Function *Check, unsigned Site,
+                           llvm::ArrayRef<llvm::Value *> Args);
+
+  // The check of As specialized for its props (see
+  // Common::GetSpecializedCheck), for the variable at Addr, if any.
+  llvm::Function *GetSpecializedCheck(Assertion &As, llvm::Value *Addr);
+
+  // Emits the call to the update function or specialized check F of a
+  // variable, or queues it if -assertions-async allows.
+  void CreateUpdateCall(llvm::IRBuilder<> &Builder, llvm::Function *F,
+                        llvm::ArrayRef<llvm::Value *> Args);
+
+  // Calls the assertion's refresh function, if it has one, to let it know
+  // about an update that isn't checked.
+  void CreateRefresh(llvm::IRBuilder<> &Builder, Assertion &As,
+                     llvm::Value *NewVal, llvm::Value *State, bool IsSigned);
 };
 
 }
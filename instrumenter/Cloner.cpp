@@ -0,0 +1,186 @@
+#include "Cloner.h"
+#include "Common.h"
+#include "Stats.h"
+
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CallSite.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+
+using namespace llvm;
+
+namespace assertions {
+
+static cl::opt<bool>
+CloneFunctions("assertions-clones",
+  cl::desc("Keep an unchecked copy of each function with assertions, and "
+           "run it instead while the run-time has checks off"),
+  cl::init(false));
+
+char FunctionCloner::ID = 0;
+
+bool FunctionCloner::doInitialization(Module &M) {
+  AssertedReturns.clear();
+  TakeStates.clear();
+  Clones.clear();
+  auto *Annos = M.getNamedGlobal("llvm.global.annotations");
+  if (!CloneFunctions || !Annos || !Annos->hasInitializer())
+    return false;
+  auto *Array = dyn_cast<ConstantArray>(Annos->getInitializer());
+  for (unsigned I = 0, E = Array ? Array->getNumOperands() : 0; I != E; ++I) {
+    // { i8* function, i8* annotation, i8* file, i32 line }
+    auto *Anno = cast<ConstantStruct>(Array->getOperand(I));
+    auto *F = dyn_cast<Function>(Anno->getOperand(0)->stripPointerCasts());
+    if (!F)
+      continue;
+    StringRef Str = GetGlobalString(Anno->getOperand(1));
+    SmallVector<std::pair<StringRef, StringRef>, 2> UID_Kinds;
+    if (ParseAssertionMeta(Str, UID_Kinds))
+      TakeStates.insert(F);
+    else if (Str.startswith("assertion,"))
+      AssertedReturns.insert(F);
+  }
+  return false;
+}
+
+// The assertion string of an annotation call, or "" if it isn't one.
+static StringRef getAssertion(Instruction &Inst) {
+  CallSite CS(&Inst);
+  Function *Callee = CS ? CS.getCalledFunction() : nullptr;
+  if (!Callee)
+    return StringRef();
+  switch (Callee->getIntrinsicID()) {
+    case Intrinsic::var_annotation:
+    case Intrinsic::assign_annotation:
+    case Intrinsic::ptr_annotation: {
+      StringRef Anno = GetGlobalString(CS.getArgument(1));
+      return Anno.startswith("assertion") ? Anno : StringRef();
+    }
+    default:
+      return StringRef();
+  }
+}
+
+bool FunctionCloner::shouldClone(Function &F) {
+  // Varargs can't be passed on to the clone.
+  if (F.isDeclaration() || F.isVarArg() || TakeStates.count(&F))
+    return false;
+  bool HasSites = AssertedReturns.count(&F);
+  for (Function::iterator BB = F.begin(), E = F.end(); BB != E; ++BB) {
+    for (BasicBlock::iterator I = BB->begin(), IE = BB->end(); I != IE; ++I) {
+      StringRef Anno = getAssertion(*I);
+      if (Anno.startswith("assertion.funcall,"))
+        return false;
+      HasSites |= !Anno.empty();
+    }
+  }
+  return HasSites;
+}
+
+void FunctionCloner::stripAnnotations(Function &F) {
+  SmallVector<Instruction *, 8> Annos;
+  for (Function::iterator BB = F.begin(), E = F.end(); BB != E; ++BB) {
+    for (BasicBlock::iterator I = BB->begin(), IE = BB->end(); I != IE; ++I) {
+      if (!getAssertion(*I).empty())
+        Annos.push_back(I);
+    }
+  }
+  for (Instruction *Inst : Annos) {
+    // llvm.ptr.annotation returns the pointer it is given.
+    if (!Inst->use_empty())
+      Inst->replaceAllUsesWith(CallSite(Inst).getArgument(0));
+    Inst->eraseFromParent();
+  }
+}
+
+bool FunctionCloner::runOnModule(Module &M) {
+  if (!CloneFunctions)
+    return false;
+  Stats::Timer T(Co.Stat, "clone");
+  SmallVector<Function *, 8> ToClone;
+  for (Module::iterator F = M.begin(), E = M.end(); F != E; ++F) {
+    if (shouldClone(*F))
+      ToClone.push_back(F);
+  }
+  for (Function *F : ToClone) {
+    ValueToValueMapTy VMap;
+    Function *Unchecked = CloneFunction(F, VMap, /*ModuleLevelChanges=*/false);
+    Unchecked->setName(F->getName() + ".unchecked");
+    Unchecked->setLinkage(GlobalValue::InternalLinkage);
+    Unchecked->setVisibility(GlobalValue::DefaultVisibility);
+    Unchecked->setUnnamedAddr(true);
+    M.getFunctionList().push_back(Unchecked);
+    stripAnnotations(*Unchecked);
+    Clones.push_back(std::make_pair(F, Unchecked));
+    ++Co.Stat.ClonedFunctions;
+    DEBUG(status("Cloner", "Cloned " + F->getName(), 1));
+  }
+  return !ToClone.empty();
+}
+
+void FunctionCloner::createDispatch(Function &F, Function *Unchecked) {
+  GlobalVariable *Flag = Co.M.getNamedGlobal("__assertions_checked");
+  if (!Flag)
+    report_fatal_error("Run-time variable '__assertions_checked' does not "
+                       "exist in the Assertions module");
+  LLVMContext &Context = F.getContext();
+  BasicBlock *Entry = &F.getEntryBlock();
+  BasicBlock *Dispatch =
+    BasicBlock::Create(Context, "assertions.dispatch", &F, Entry);
+  BasicBlock *Off =
+    BasicBlock::Create(Context, "assertions.unchecked", &F, Entry);
+
+  IRBuilder<> Builder(Dispatch);
+  LoadInst *On = Builder.CreateLoad(Flag, "assertions.checked");
+  On->setAlignment(1);
+  On->setAtomic(Monotonic);
+  Builder.CreateCondBr(Builder.CreateIsNotNull(On), Entry, Off);
+  // Static allocas (the states' among them) must stay in the entry block,
+  // or they become dynamic ones.
+  SmallVector<AllocaInst *, 8> Allocas;
+  for (BasicBlock::iterator I = Entry->begin(), E = Entry->end(); I != E; ++I) {
+    if (auto *AI = dyn_cast<AllocaInst>(I))
+      if (isa<Constant>(AI->getArraySize()))
+        Allocas.push_back(AI);
+  }
+  for (AllocaInst *AI : Allocas)
+    AI->moveBefore(On);
+
+  Builder.SetInsertPoint(Off);
+  SmallVector<Value *, 8> Args;
+  bool ByVal = false;
+  for (Function::arg_iterator A = F.arg_begin(), E = F.arg_end();
+       A != E; ++A) {
+    Args.push_back(A);
+    ByVal |= A->hasByValAttr();
+  }
+  CallInst *Call = Builder.CreateCall(Unchecked, Args);
+  Call->setCallingConv(Unchecked->getCallingConv());
+  Call->setAttributes(Unchecked->getAttributes());
+  // byval copies live in this frame.
+  Call->setTailCall(!ByVal);
+  if (F.getReturnType()->isVoidTy())
+    Builder.CreateRetVoid();
+  else
+    Builder.CreateRet(Call);
+}
+
+bool FunctionCloner::doFinalization(Module &M) {
+  // Module passes finish in reverse order, so the instrumenters are done.
+  for (auto &Clone : Clones)
+    createDispatch(*Clone.first, Clone.second);
+  bool Changed = !Clones.empty();
+  Clones.clear();
+  return Changed;
+}
+
+}
@@ -0,0 +1,71 @@
+#ifndef ASSERTIONS_INSTRUMENTER_CLONER_H
+#define ASSERTIONS_INSTRUMENTER_CLONER_H
+
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Pass.h"
+
+#include <utility>
+
+namespace llvm {
+  class Function;
+  class Module;
+}
+
+namespace assertions {
+
+class Common;
+
+/// Keeps an unchecked copy of every function with assertion sites, and
+/// picks one of the two copies on each call (-assertions-clones).
+///
+/// Before the instrumenters run, each such function is cloned into an
+/// internal "<name>.unchecked", with the annotations taken out, so that
+/// it compiles as if there were no assertions. Once they are done, the
+/// instrumented function gets a new entry block that loads the run-time's
+/// __assertions_checked flag and, if it is 0, tail calls the clone with its
+/// arguments. So with checks off, a call costs one load and one well
+/// predicted branch, however many checks the function would run.
+///
+/// Functions given states by their callers, or passing states to the
+/// functions they call, aren't cloned: an unchecked caller has no states to
+/// pass on. These always run their checks.
+///
+/// Must run before the instrumenters, and adds the dispatch once they are
+/// done.
+class FunctionCloner : public llvm::ModulePass {
+public:
+  static char ID;
+  FunctionCloner(Common &C) : ModulePass(ID), Co(C) {}
+
+  const char *getPassName() const {
+    return "Assertions unchecked function cloner";
+  }
+
+  virtual bool doInitialization(llvm::Module &M);
+  virtual bool runOnModule(llvm::Module &M);
+  virtual bool doFinalization(llvm::Module &M);
+
+private:
+  Common &Co;
+
+  // From llvm.global.annotations, which the callee instrumenter drops:
+  // functions with asserted return values, and those taking states.
+  llvm::SmallPtrSet<llvm::Function *, 8> AssertedReturns, TakeStates;
+
+  // Each function cloned, and its unchecked clone.
+  llvm::SmallVector<std::pair<llvm::Function *, llvm::Function *>, 8> Clones;
+
+  // Whether F has sites to clone it for, and can do without them.
+  bool shouldClone(llvm::Function &F);
+
+  // Takes the assertion annotations out of the clone F.
+  static void stripAnnotations(llvm::Function &F);
+
+  // Makes F call Unchecked instead of running, when checks are off.
+  void createDispatch(llvm::Function &F, llvm::Function *Unchecked);
+};
+
+}
+
+#endif
@@ -7,8 +7,25 @@
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Constant.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/DebugInfo.h"
+#include "llvm/Support/CallSite.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Dwarf.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/IR/InlineAsm.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/Local.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/Debug.h"
+#include <iterator>
 #include <utility>
 
 using namespace llvm;
@@ -44,6 +61,42 @@ raw_ostream &info(StringRef subject) {
 typedef Common::FnMapTy   FnMapTy;
 typedef Common::FuncType  FuncType;
 
+static cl::opt<bool>
+SpecializeChecks("assertions-specialize",
+  cl::desc("Check assertions with integer props against constants, and "
+           "without a state, when their kind allows it"),
+  cl::init(true));
+
+static cl::opt<bool>
+SiteSwitches("assertions-switches",
+  cl::desc("Let the run-time turn checks on and off, per kind or site, by "
+           "patching an immediate at each check site (x86 ELF), or else "
+           "through a flag in each site's descriptor"),
+  cl::init(false));
+
+namespace {
+enum ProfileMode {
+  NoProfile, ProfileHits, ProfileCycles
+};
+}
+
+static cl::opt<ProfileMode>
+Profile("assertions-profile",
+  cl::desc("Count the checks at each site, reported at exit:"),
+  cl::values(
+    clEnumValN(NoProfile, "none", "don't"),
+    clEnumValN(ProfileHits, "hits", "how many times each site ran"),
+    clEnumValN(ProfileCycles, "cycles",
+               "that, and the cycles its checks took (rdtsc)"),
+    clEnumValEnd),
+  cl::init(NoProfile));
+
+static cl::opt<bool>
+AsyncChecks("assertions-async",
+  cl::desc("Queue the checks of local variables for a checker thread, "
+           "instead of running them on the thread that updates them"),
+  cl::init(false));
+
 // Puts the UIDs parsed from anno in the specified SmallVector. If anno isn't
 // a valid function call annotation string, does nothing and returns false.
 bool ParseAssertionFuncall(StringRef anno, SmallVectorImpl<StringRef> &UIDs) {
@@ -74,6 +127,13 @@ bool ParseAssertionMeta(StringRef anno, UID_KindTy &UID_Kinds) {
   return false; 
 }
 
+StringRef GetGlobalString(Value *GEP) {
+  GlobalVariable *StrGV =
+    cast<GlobalVariable>(cast<ConstantExpr>(GEP)->getOperand(0));
+  return cast<ConstantDataSequential>(
+           StrGV->getInitializer())->getAsString().drop_back();
+}
+
 std::string getStateName(int UID) {
   Concatenation StateName(".");
   StateName.append("assertions");
@@ -109,11 +169,47 @@ Common::FnMapTy &Common::SwitchCache(FuncType type) {
     case FuncType::Init:  return InitFuncs;
     case FuncType::Update: return UpdateFuncs;
     case FuncType::Alloc: return AllocFuncs;
+    case FuncType::Refresh: return RefreshFuncs;
+    case FuncType::AtomicUpdate: return AtomicUpdateFuncs;
+    case FuncType::Check: return CheckFuncs;
+    case FuncType::Range: return RangeFuncs;
     default:
       llvm_unreachable("Unhandled FuncType in Caller.cpp");
   }
 }
 
+bool Common::UpdateWritesState(StringRef AssertionKind) {
+  auto It = WritesState.find(AssertionKind);
+  if (It != WritesState.end())
+    return It->second;
+  bool &Writes = WritesState[AssertionKind];
+  // All the typed variants come from the same definition.
+  Function *F = GetFuncFor(AssertionKind, FuncType::Update,
+                           Type::getInt32Ty(Context), /*IsSigned=*/true);
+  if (F->isDeclaration() || F->arg_size() < 2)
+    return Writes = true;
+  // Follow the state pointer (second argument) through address computations.
+  // Anything but loading from it counts as writing, including passing it on.
+  Argument *State = std::next(F->arg_begin());
+  SmallVector<Value *, 8> Worklist;
+  Worklist.push_back(State);
+  while (!Worklist.empty()) {
+    Value *V = Worklist.pop_back_val();
+    for (auto UI = V->use_begin(), UE = V->use_end(); UI != UE; ++UI) {
+      User *U = *UI;
+      if (isa<GetElementPtrInst>(U) || isa<BitCastInst>(U)) {
+        Worklist.push_back(U);
+      } else if (auto *Load = dyn_cast<LoadInst>(U)) {
+        if (Load->isVolatile())
+          return Writes = true;
+      } else {
+        return Writes = true;
+      }
+    }
+  }
+  return Writes = false;
+}
+
 Function *Common::GetFuncFor(StringRef assertionKind,
                              FuncType type, bool strict) {
   FnMapTy &Map = SwitchCache(type);
@@ -125,6 +221,10 @@ Function *Common::GetFuncFor(StringRef assertionKind,
       case FuncType::Init:   prefix = "__init_"; break;
       case FuncType::Update: prefix = "__update_"; break;
       case FuncType::Alloc:  prefix = "__alloc_"; break;
+      case FuncType::Refresh: prefix = "__refresh_"; break;
+      case FuncType::AtomicUpdate: prefix = "__update_atomic_"; break;
+      case FuncType::Check:  prefix = "__check_"; break;
+      case FuncType::Range:  prefix = "__range_"; break;
     }
     std::string FnName = (prefix + assertionKind).str();
     //auto Fn = Co.Assertions.getFunction(FnName);
@@ -147,17 +247,552 @@ Function *Common::GetFuncFor(StringRef assertionKind,
   return Cached;
 }
 
+std::string GetTypeSuffix(Type *ValTy, bool IsSigned) {
+  if (ValTy->isFloatTy())
+    return "f32";
+  if (ValTy->isDoubleTy())
+    return "f64";
+  if (auto *IntTy = dyn_cast<IntegerType>(ValTy)) {
+    unsigned Bits = IntTy->getBitWidth();
+    if (Bits == 8 || Bits == 16 || Bits == 32 || Bits == 64)
+      return (Twine(IsSigned ? "i" : "u") + Twine(Bits)).str();
+  }
+  return "";
+}
+
+Function *Common::GetFuncFor(StringRef assertionKind, FuncType type,
+                             Type *ValTy, bool IsSigned, bool strict) {
+  std::string Suffix = GetTypeSuffix(ValTy, IsSigned);
+  if (!Suffix.empty()) {
+    if (Function *Fn = GetFuncFor((assertionKind + "_" + Suffix).str(), type,
+                                  /*strict=*/false))
+      return Fn;
+  }
+  // Assertions on a single type define untyped functions. Init takes the
+  // address, so works for any type, the others must take ValTy.
+  Function *Fn = GetFuncFor(assertionKind, type, /*strict=*/false);
+  if (Fn && (type == FuncType::Init || type == FuncType::Alloc ||
+             Fn->getFunctionType()->getParamType(0) == ValTy))
+    return Fn;
+  if (strict) {
+    std::string TypeName;
+    raw_string_ostream OS(TypeName);
+    OS << *ValTy;
+    report_fatal_error("No instrumentation function for " + assertionKind +
+      " assertions on values of type " + OS.str() + " (" +
+      (Suffix.empty() ? "unsupported type" : Suffix) + ") in Assertions.c");
+  }
+  return nullptr;
+}
+
+Function *Common::GetSpecializedCheck(Assertion &As, Type *ValTy,
+                                      bool IsSigned, FuncType Type) {
+  assert((Type == FuncType::Check || Type == FuncType::Range) &&
+         "Only check and range functions are specialized");
+  // Range functions are only ever called specialized.
+  if (!SpecializeChecks && Type == FuncType::Check)
+    return nullptr;
+  Function *Check = GetFuncFor(As.Kind, Type, ValTy, IsSigned,
+                               /*strict=*/false);
+  // The new value (or first element and count), the props, the site.
+  unsigned Leading = Type == FuncType::Range ? 2 : 1;
+  if (!Check || Check->isDeclaration() ||
+      Check->arg_size() != As.Params.size() + Leading + 1)
+    return nullptr;
+  ValueToValueMapTy VMap;
+  std::string Name = Check->getName();
+  auto Arg = Check->arg_begin();
+  std::advance(Arg, Leading);
+  for (StringRef Param : As.Params) {
+    auto *ParamTy = dyn_cast<IntegerType>(Arg->getType());
+    int64_t Int;
+    if (!ParamTy || Param.getAsInteger(0, Int) ||
+        !isIntN(ParamTy->getBitWidth(), Int))
+      return nullptr;
+    VMap[Arg++] = ConstantInt::get(ParamTy, Int, /*isSigned=*/true);
+    Name += "." + Twine(Int).str();
+  }
+  Function *&Cached = SpecializedChecks[Name];
+  if (Cached)
+    return Cached;
+
+  // Mapped arguments are left out of the copy.
+  Cached = CloneFunction(Check, VMap, /*ModuleLevelChanges=*/false);
+  Cached->setName(Name);
+  Cached->setLinkage(GlobalValue::InternalLinkage);
+  M.getFunctionList().push_back(Cached);
+  // Fold the props in now, so the copy is small even if never inlined.
+  for (Function::iterator BB = Cached->begin(), E = Cached->end();
+       BB != E; ++BB) {
+    SimplifyInstructionsInBlock(BB);
+    ConstantFoldTerminator(BB, /*DeleteDeadConditions=*/true);
+  }
+  ++Stat.SpecializedChecks;
+  DEBUG(status("Common", "Specialized " + Name, 1));
+  return Cached;
+}
+
+bool IsSignedType(DIType T) {
+  // Look through typedefs and qualifiers.
+  while (T.isDerivedType() &&
+         (T.getTag() == dwarf::DW_TAG_typedef ||
+          T.getTag() == dwarf::DW_TAG_const_type ||
+          T.getTag() == dwarf::DW_TAG_volatile_type))
+    T = DIDerivedType(T).getTypeDerivedFrom();
+  // Arrays are signed like their elements.
+  if (T.isCompositeType() && T.getTag() == dwarf::DW_TAG_array_type)
+    return IsSignedType(DICompositeType(T).getTypeDerivedFrom());
+  if (!T.isBasicType())
+    return true;
+  switch (DIBasicType(T).getEncoding()) {
+    case dwarf::DW_ATE_unsigned:
+    case dwarf::DW_ATE_unsigned_char:
+    case dwarf::DW_ATE_boolean:
+      return false;
+    default:
+      return true;
+  }
+}
+
+bool IsSignedMember(DIType T, uint64_t OffsetInBits) {
+  while (T.isDerivedType() &&
+         (T.getTag() == dwarf::DW_TAG_typedef ||
+          T.getTag() == dwarf::DW_TAG_const_type ||
+          T.getTag() == dwarf::DW_TAG_volatile_type))
+    T = DIDerivedType(T).getTypeDerivedFrom();
+  if (!T.isCompositeType() || T.getTag() == dwarf::DW_TAG_array_type)
+    return IsSignedType(T);
+  DIArray Members = DICompositeType(T).getTypeArray();
+  for (unsigned I = 0, E = Members.getNumElements(); I != E; ++I) {
+    DIDescriptor D = Members.getElement(I);
+    if (!D.isDerivedType() || D.getTag() != dwarf::DW_TAG_member)
+      continue;
+    DIDerivedType Member(D);
+    uint64_t Start = Member.getOffsetInBits();
+    if (Member.isStaticMember() || OffsetInBits < Start ||
+        OffsetInBits >= Start + Member.getSizeInBits())
+      continue;
+    return IsSignedMember(Member.getTypeDerivedFrom(), OffsetInBits - Start);
+  }
+  return true;
+}
+
+bool IsSignedVariable(Value *Addr) {
+  if (DbgDeclareInst *DDI = FindAllocaDbgDeclare(Addr->stripPointerCasts()))
+    return IsSignedType(DIVariable(DDI->getVariable()).getType());
+  return true;
+}
+
+Function *Common::GetRuntimeFunc(StringRef Name) {
+  Function *Fn = M.getFunction(Name);
+  if (!Fn) {
+    report_fatal_error("Run-time function '" + Name + "' "
+      + "does not exist in the Assertions module");
+  }
+  return Fn;
+}
+
 Constant *Common::GetPtrToGlobalString(StringRef str, StringRef name) {
+  Constant *&Cached = Strings[str];
+  if (Cached)
+    return Cached;
   // This is a [x * i8] constant, do a const GEP on it
   auto *ConstStr = ConstantDataArray::getString(Context, str);
-  // TODO make it unnamed_addr
   auto *ConstStrGV = new GlobalVariable(M, ConstStr->getType(), true,
     GlobalValue::PrivateLinkage, ConstStr, name);
+  ++Stat.GlobalStrings;
+  // Only the contents matter, so it can be merged with equal strings.
+  ConstStrGV->setUnnamedAddr(true);
   DEBUG(info("ConstStrGV") << *ConstStrGV << "\n");
 
   Constant *Idx = ConstantInt::get(Type::getInt32Ty(Context), 0);
   Constant *Indices[] = { Idx, Idx };
-  return ConstantExpr::getGetElementPtr(ConstStrGV, Indices, true);
+  Cached = ConstantExpr::getGetElementPtr(ConstStrGV, Indices, true);
+  return Cached;
+}
+
+Constant *Common::GetPropsFor(Assertion &As) {
+  auto *ElemTy = Type::getInt8PtrTy(Context);
+  static_assert(sizeof(int) <= sizeof(char *),
+    "sizeof(int) must fit into char*");
+  // Make As.Params nicer: parse ints directly to int (fits in i8*)
+  SmallVector<Constant*, 4> ParamsArr;
+  // First the number of props (see PROPS_COUNT), as a 0 prop looks like the
+  // terminating NULL.
+  ParamsArr.push_back(ConstantExpr::getIntToPtr(
+    ConstantInt::get(Type::getInt32Ty(Context), As.Params.size()), ElemTy));
+  for (StringRef str : As.Params) {
+    DEBUG(info("Param") << str << "\n");
+    int Int; // TODO Could make it size_t? always the size of a pointer,
+    // and modify Assertions.c accordingly to cast to size_t
+    if (!str.getAsInteger(0, Int)) {
+      // TODO assuming sizeof(int) == 4
+      Constant *IntC = ConstantInt::get(Type::getInt32Ty(Context), Int);
+      ParamsArr.push_back(
+        ConstantExpr::getIntToPtr(IntC, ElemTy));
+      continue;
+    }
+
+    // Default case: create a constant string.
+    auto *StrPtr = GetPtrToGlobalString(str, "assertions.prop");
+    ParamsArr.push_back(StrPtr);
+    DEBUG(info("Which GEPped") << *ParamsArr.back() << "\n");
+  }
+  // End the list with a NULL ptr.
+  ParamsArr.push_back(ConstantPointerNull::get(ElemTy));
+  auto *ArrayTy = ArrayType::get(ElemTy, ParamsArr.size());
+  // Constants are uniqued, so equal props give the same array.
+  auto *Array = ConstantArray::get(ArrayTy, ParamsArr);
+
+  Constant *&Cached = PropsArrays[Array];
+  if (Cached)
+    return Cached;
+  auto *ArrayGV =
+          new GlobalVariable(M, Array->getType(), true,
+            GlobalValue::PrivateLinkage, Array,
+            "assertions.props");
+  ArrayGV->setUnnamedAddr(true);
+  ++Stat.PropsArrays;
+  DEBUG(info("Params array") << *ArrayGV << "\n");
+
+  // We can't just do a bitcast to i8**, we need a GEP, to the first prop.
+  Constant *Indices[] = {
+    ConstantInt::get(Type::getInt32Ty(Context), 0),
+    ConstantInt::get(Type::getInt32Ty(Context), 1)
+  };
+  Cached = ConstantExpr::getInBoundsGetElementPtr(ArrayGV, Indices);
+  return Cached;
 }
 
-}
\ No newline at end of file
+unsigned Common::GetSiteFor(Assertion &As, Constant *FileName,
+                            Constant *LineNo) {
+  // Notice:
+  // The file name is a string that's sitting in "llvm.metadata", which will
+  // magically vanish upon CodeGen, so let's go ahead and remove that.
+  cast<GlobalVariable>(cast<ConstantExpr>(FileName)->getOperand(0))
+    ->setSection("");
+
+  // The descriptor type is whatever the run-time's registration function
+  // takes, so it always matches __assertion_site.
+  Function *Register = GetRuntimeFunc("__assertions_register_sites");
+  auto *SiteTy = cast<StructType>(cast<PointerType>(
+    Register->getFunctionType()->getParamType(0))->getElementType());
+  // Without its data, which only EmitSiteTable() knows where to put.
+  Constant *Fields[] = {
+    FileName,
+    LineNo,
+    GetPtrToGlobalString(As.Kind, "assertions.kind"),
+    GetPropsFor(As),
+    Constant::getNullValue(SiteTy->getElementType(4))
+  };
+  Constant *Site = ConstantStruct::get(SiteTy, Fields);
+
+  auto It = SiteIndex.find(Site);
+  if (It != SiteIndex.end())
+    return It->second;
+  unsigned Index = Sites.size();
+  Sites.push_back(Site);
+  SiteIndex[Site] = Index;
+  Stat.addSite(As.Kind);
+  return Index;
+}
+
+GlobalVariable *Common::getSiteTable() {
+  if (!SiteTable) {
+    Function *Register = GetRuntimeFunc("__assertions_register_sites");
+    Type *SiteTy = cast<PointerType>(
+      Register->getFunctionType()->getParamType(0))->getElementType();
+    SiteTable = new GlobalVariable(M, SiteTy, false,
+      GlobalValue::ExternalLinkage, nullptr, "assertions.sites.pending");
+  }
+  return SiteTable;
+}
+
+GlobalVariable *Common::getSiteData() {
+  if (!SiteData) {
+    Type *SiteTy = getSiteTable()->getType()->getElementType();
+    Type *DataTy = cast<PointerType>(
+      cast<StructType>(SiteTy)->getElementType(4))->getElementType();
+    SiteData = new GlobalVariable(M, DataTy, false,
+      GlobalValue::ExternalLinkage, nullptr, "assertions.site_data.pending");
+  }
+  return SiteData;
+}
+
+Constant *Common::GetSiteRef(unsigned Site) {
+  return ConstantExpr::getGetElementPtr(getSiteTable(),
+    ConstantInt::get(Type::getInt32Ty(Context), Site));
+}
+
+Constant *Common::getSiteDataRef(unsigned Site) {
+  return ConstantExpr::getGetElementPtr(getSiteData(),
+    ConstantInt::get(Type::getInt32Ty(Context), Site));
+}
+
+void Common::EmitSiteTable() {
+  if (Sites.empty())
+    return;
+  auto *SiteTy = cast<StructType>(Sites[0]->getType());
+  auto *DataTy = cast<StructType>(cast<PointerType>(
+    SiteTy->getElementType(4))->getElementType());
+  // Unregistered, until the constructor registers the table, and on, unless
+  // the run-time switches it off.
+  Constant *DataFields[] = {
+    ConstantInt::get(DataTy->getElementType(0), ~0U),
+    ConstantInt::get(DataTy->getElementType(1), 1)
+  };
+  auto *DataArrayTy = ArrayType::get(DataTy, Sites.size());
+  auto *Data = new GlobalVariable(M, DataArrayTy, false,
+    GlobalValue::PrivateLinkage,
+    ConstantArray::get(DataArrayTy, std::vector<Constant *>(Sites.size(),
+      ConstantStruct::get(DataTy, DataFields))),
+    "assertions.site_data");
+  if (SiteData) {
+    SiteData->replaceAllUsesWith(
+      ConstantExpr::getBitCast(Data, SiteData->getType()));
+    SiteData->eraseFromParent();
+    SiteData = nullptr;
+  }
+
+  // The descriptors themselves are never written.
+  std::vector<Constant *> Descs;
+  for (unsigned I = 0, E = Sites.size(); I != E; ++I) {
+    Constant *Idx[] = {
+      ConstantInt::get(Type::getInt32Ty(Context), 0),
+      ConstantInt::get(Type::getInt32Ty(Context), I)
+    };
+    auto *Desc = cast<ConstantStruct>(Sites[I]);
+    Constant *Fields[] = {
+      Desc->getOperand(0), Desc->getOperand(1), Desc->getOperand(2),
+      Desc->getOperand(3), ConstantExpr::getInBoundsGetElementPtr(Data, Idx)
+    };
+    Descs.push_back(ConstantStruct::get(SiteTy, Fields));
+  }
+  auto *TableTy = ArrayType::get(SiteTy, Sites.size());
+  auto *Table = new GlobalVariable(M, TableTy, true,
+    GlobalValue::PrivateLinkage, ConstantArray::get(TableTy, Descs),
+    "assertions.sites");
+  if (SiteTable) {
+    SiteTable->replaceAllUsesWith(
+      ConstantExpr::getBitCast(Table, SiteTable->getType()));
+    SiteTable->eraseFromParent();
+    SiteTable = nullptr;
+  }
+
+  auto *CtorTy = FunctionType::get(Type::getVoidTy(Context), false);
+  Function *Ctor = Function::Create(CtorTy, GlobalValue::InternalLinkage,
+                                    "assertions.register_sites", &M);
+  IRBuilder<> Builder(BasicBlock::Create(Context, "entry", Ctor));
+  Builder.CreateCall2(GetRuntimeFunc("__assertions_register_sites"),
+    Builder.CreateConstInBoundsGEP2_32(Table, 0, 0),
+    Builder.getInt32(Sites.size()));
+  if (HasSwitches) {
+    // The keys of all the modules linked into the same executable or shared
+    // object end up in one section, which the linker gives these bounds.
+    Function *Register = GetRuntimeFunc("__assertions_register_keys");
+    Value *Args[2];
+    const char *Bounds[] = {
+      "__start_assertions_keys", "__stop_assertions_keys"
+    };
+    for (unsigned I = 0; I != 2; ++I) {
+      GlobalVariable *GV = M.getNamedGlobal(Bounds[I]);
+      if (!GV) {
+        GV = new GlobalVariable(M, Builder.getInt8Ty(), false,
+          GlobalValue::ExternalWeakLinkage, nullptr, Bounds[I]);
+        GV->setVisibility(GlobalValue::HiddenVisibility);
+      }
+      Args[I] = ConstantExpr::getBitCast(GV,
+        Register->getFunctionType()->getParamType(I));
+    }
+    Builder.CreateCall(Register, Args);
+  }
+  if (HasFlagSwitches)
+    Builder.CreateCall2(GetRuntimeFunc("__assertions_register_flags"),
+      Builder.CreateConstInBoundsGEP2_32(Table, 0, 0),
+      Builder.getInt32(Sites.size()));
+  Builder.CreateRetVoid();
+  // Before any of the program's own constructors, which may well update
+  // asserted variables.
+  appendToGlobalCtors(M, Ctor, 101);
+}
+
+Instruction *Common::CreateSwitch(IRBuilder<> &Builder, unsigned Site) {
+  if (!SiteSwitches)
+    return nullptr;
+  Triple T(M.getTargetTriple());
+  if (T.getTriple().empty())
+    T.setTriple(sys::getDefaultTargetTriple());
+  // The keys' section and its __start_/__stop_ bounds need ELF.
+  bool Keyed = (T.getArch() == Triple::x86 || T.getArch() == Triple::x86_64) &&
+               T.isOSBinFormatELF();
+  Value *On = Keyed ? CreateSwitchKey(Builder, Site, T)
+                    : CreateSwitchFlag(Builder, Site);
+  TerminatorInst *Then =
+    SplitBlockAndInsertIfThen(cast<Instruction>(On), /*Unreachable=*/false);
+  Then->getParent()->setName("assertions.switched");
+  BasicBlock *Cont = Then->getSuccessor(0);
+  if (Keyed) {
+    // Where the run-time couldn't make code writable to patch the key, the
+    // site's on flag says instead: one more load while the site is on.
+    GlobalVariable *ByFlag = M.getNamedGlobal("__assertions_switch_by_flag");
+    if (!ByFlag)
+      report_fatal_error("Run-time variable '__assertions_switch_by_flag' "
+                         "does not exist in the Assertions module");
+    Builder.SetInsertPoint(Then);
+    LoadInst *Fallback = Builder.CreateLoad(ByFlag, "assertions.by_flag");
+    Fallback->setAlignment(1);
+    Fallback->setAtomic(Monotonic);
+    TerminatorInst *ToFlag = SplitBlockAndInsertIfThen(
+      cast<Instruction>(Builder.CreateIsNotNull(Fallback)),
+      /*Unreachable=*/false,
+      MDBuilder(Context).createBranchWeights(1, 64));
+    BasicBlock *Checked = ToFlag->getSuccessor(0);
+    Builder.SetInsertPoint(ToFlag);
+    LoadInst *Flag = Builder.CreateLoad(
+      Builder.CreateStructGEP(getSiteDataRef(Site), 1), "assertions.flag");
+    Flag->setAlignment(1);
+    Flag->setAtomic(Monotonic);
+    Builder.CreateCondBr(Builder.CreateIsNotNull(Flag), Checked, Cont);
+    ToFlag->eraseFromParent();
+  }
+  Builder.SetInsertPoint(Then);
+  ++Stat.SiteSwitches;
+  return Cont->begin();
+}
+
+Value *Common::CreateSwitchKey(IRBuilder<> &Builder, unsigned Site,
+                               const Triple &T) {
+  // movb $1, %reg ends with its immediate. The key (an __assertion_key)
+  // points right past it, and to the site's descriptor.
+  const char *Ptr = T.getArch() == Triple::x86_64 ? ".quad" : ".long";
+  std::string Asm = (Twine("movb $$1, $0\n1:\n") +
+    ".pushsection assertions_keys,\"aw\",@progbits\n" +
+    ".balign " + Twine(T.getArch() == Triple::x86_64 ? 8 : 4) + "\n" +
+    Ptr + " 1b\n" + Ptr + " ${1:c}\n" +
+    ".popsection").str();
+  Constant *Ref = GetSiteRef(Site);
+  auto *AsmTy = FunctionType::get(Builder.getInt8Ty(), Ref->getType(), false);
+  // A side effect, so that LICM and GVN leave the move at the site: the
+  // patched byte is only read when it runs.
+  CallInst *Key = Builder.CreateCall(
+    InlineAsm::get(AsmTy, Asm, "=q,i", /*hasSideEffects=*/true),
+    Ref, "assertions.key");
+  Key->setDoesNotThrow();
+  HasSwitches = true;
+  return Builder.CreateIsNotNull(Key, "assertions.on");
+}
+
+Value *Common::CreateSwitchFlag(IRBuilder<> &Builder, unsigned Site) {
+  // The site's on flag, which the run-time may write at any time.
+  LoadInst *Flag = Builder.CreateLoad(
+    Builder.CreateStructGEP(getSiteDataRef(Site), 1), "assertions.flag");
+  Flag->setAlignment(1);
+  Flag->setAtomic(Monotonic);
+  HasFlagSwitches = true;
+  return Builder.CreateIsNotNull(Flag, "assertions.on");
+}
+
+CallInst *Common::CreateCheckCall(IRBuilder<> &Builder, Function *F,
+                                  ArrayRef<Value *> Args) {
+  if (Profile == NoProfile)
+    return Builder.CreateCall(F, Args);
+  Function *ReadCycles = Profile == ProfileCycles ?
+    Intrinsic::getDeclaration(&M, Intrinsic::readcyclecounter) : nullptr;
+  Value *Start = ReadCycles ? Builder.CreateCall(ReadCycles) : nullptr;
+  CallInst *Call = Builder.CreateCall(F, Args);
+  // Only the check is timed, not the counting.
+  Value *Cycles = ReadCycles ?
+    Builder.CreateSub(Builder.CreateCall(ReadCycles), Start) :
+    Builder.getInt64(0);
+  Builder.CreateCall2(GetRuntimeFunc("__assertions_profile"), Args.back(),
+                      Cycles);
+  ++Stat.ProfiledChecks;
+  return Call;
+}
+
+bool Common::ChecksAlwaysRun() const {
+  return !SiteSwitches && !AsyncChecks;
+}
+
+bool Common::CanQueue(Type *ValTy, Value *State) {
+  return AsyncChecks && (!State || isa<Constant>(State->stripPointerCasts())) &&
+    (ValTy->isFloatTy() || ValTy->isDoubleTy() ||
+    (ValTy->isIntegerTy() && ValTy->getIntegerBitWidth() <= 64));
+}
+
+// Queued values travel as i64.
+static Value *CreatePack(IRBuilder<> &Builder, Value *V) {
+  Type *Ty = V->getType();
+  if (Ty->isFloatingPointTy())
+    V = Builder.CreateBitCast(V,
+      Builder.getIntNTy(Ty->getPrimitiveSizeInBits()));
+  return Builder.CreateZExtOrBitCast(V, Builder.getInt64Ty());
+}
+
+static Value *CreateUnpack(IRBuilder<> &Builder, Value *V, Type *Ty) {
+  if (!Ty->isFloatingPointTy())
+    return Builder.CreateTruncOrBitCast(V, Ty);
+  V = Builder.CreateTruncOrBitCast(V,
+    Builder.getIntNTy(Ty->getPrimitiveSizeInBits()));
+  return Builder.CreateBitCast(V, Ty);
+}
+
+Function *Common::getDrainFor(Function *F, Type *ValTy, Constant *Props) {
+  Function *&Drain = Drains[std::make_pair(std::make_pair(F, ValTy), Props)];
+  if (Drain)
+    return Drain;
+  // Same type as __assertions_async's first parameter.
+  Function *Async = GetRuntimeFunc("__assertions_async");
+  auto *DrainTy = cast<FunctionType>(cast<PointerType>(
+    Async->getFunctionType()->getParamType(0))->getElementType());
+  Drain = Function::Create(DrainTy, GlobalValue::InternalLinkage,
+                           F->getName() + ".async", &M);
+  Function::arg_iterator A = Drain->arg_begin();
+  Value *Bits = A++, *State = A++, *Site = A;
+  IRBuilder<> Builder(BasicBlock::Create(Context, "entry", Drain));
+  Value *Val = CreateUnpack(Builder, Bits, ValTy);
+
+  // The first parameter that isn't a pointer is the value. An init function
+  // gets the address of a copy of the value.
+  SmallVector<Value *, 4> Args;
+  FunctionType *FTy = F->getFunctionType();
+  for (unsigned I = 0, E = FTy->getNumParams(); I != E; ++I) {
+    Type *Ty = FTy->getParamType(I);
+    if (Ty == Site->getType()) {
+      Args.push_back(Site);
+    } else if (!Ty->isPointerTy()) {
+      Args.push_back(Val);
+    } else if (Props && Ty == Props->getType()) {
+      Args.push_back(Props);
+    } else if (Props && !Args.empty()) {
+      Value *Copy = Builder.CreateAlloca(ValTy, nullptr, "assertions.value");
+      Builder.CreateStore(Val, Copy);
+      Args.push_back(Builder.CreateBitCast(Copy, Ty));
+    } else {
+      Args.push_back(Builder.CreateBitCast(State, Ty));
+    }
+  }
+  Builder.CreateCall(F, Args);
+  Builder.CreateRetVoid();
+  return Drain;
+}
+
+void Common::CreateQueuedCall(IRBuilder<> &Builder, Function *F, Value *Val,
+                              Value *State, Value *Site, Constant *Props) {
+  Function *Async = GetRuntimeFunc("__assertions_async");
+  FunctionType *AsyncTy = Async->getFunctionType();
+  Value *Args[] = {
+    getDrainFor(F, Val->getType(), Props),
+    State ? Builder.CreateBitCast(State, AsyncTy->getParamType(1)) :
+      Constant::getNullValue(AsyncTy->getParamType(1)),
+    CreatePack(Builder, Val),
+    Site ? Site : Constant::getNullValue(AsyncTy->getParamType(3))
+  };
+  if (Site)
+    CreateCheckCall(Builder, Async, Args);
+  else
+    Builder.CreateCall(Async, Args);
+  ++Stat.QueuedChecks;
+}
+
+}
@@ -1,11 +1,17 @@
 #ifndef ASSERTIONS_INSTRUMENTER_COMMON_H
 #define ASSERTIONS_INSTRUMENTER_COMMON_H
 
+#include "Stats.h"
+
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/StringMap.h"
+#include "llvm/DebugInfo.h"
+#include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/LLVMContext.h"
 
 #include <utility>
 #include <string>
+#include <vector>
 
 namespace llvm {
   class StringRef;
@@ -13,7 +19,11 @@ namespace llvm {
   class Module;
   class Constant;
   class Function;
+  class GlobalVariable;
+  class Triple;
+  class Type;
   class Twine;
+  class Value;
   class raw_ostream;
   template <typename T> class SmallVectorImpl;
 }
@@ -43,6 +53,29 @@ bool ParseAssertionFuncall(StringRef anno, SmallVectorImpl<StringRef> &UIDs);
 
 bool ParseAssertionMeta(StringRef anno, UID_KindTy &UID_Kinds);
 
+// Gets the contents of a constant string global, given a constant GEP to it,
+// as found in annotation calls. Drops the trailing '\0'.
+StringRef GetGlobalString(Value *GEP);
+
+// === Value types ============================================================
+
+// Suffix of the run-time functions specialized for values of type ValTy (see
+// FOR_EACH_VALUE_TYPE in AssertionBase.h), e.g. "u16" or "f64". Empty if
+// there are none for this type.
+std::string GetTypeSuffix(Type *ValTy, bool IsSigned);
+
+// Whether a variable of this C type is signed. LLVM types don't say.
+bool IsSignedType(DIType T);
+
+// Whether the variable at Addr (an alloca, maybe cast) is signed, according
+// to the debug info. Signed if there is none.
+bool IsSignedVariable(Value *Addr);
+
+// Whether the member of the struct, class or union T (or of the struct
+// members of it) starting at OffsetInBits is signed. Signed if there is no
+// such member.
+bool IsSignedMember(DIType T, uint64_t OffsetInBits);
+
 // === Instrumentation variables naming =======================================
 
 std::string getStateName(int UID);
@@ -55,21 +88,98 @@ class Common {
 public:
   typedef llvm::StringMap<llvm::Function *> FnMapTy;
   // Instrumentation function types.
-  enum class FuncType { Init, Update, Alloc };
+  enum class FuncType {
+    Init, Update, Alloc, Refresh, AtomicUpdate, Check, Range
+  };
 
   // This one crashes if the function is not found, but may return nullptr if
   // strict is set to false.
   Function *GetFuncFor(StringRef assertionKind,
                        FuncType type, bool strict = true);
+
+  // Same, for the function specialized for values of type ValTy, e.g.
+  // __update_ge_u32. Falls back to the unspecialized function for
+  // assertions that have no specialized ones, if it takes that type.
+  Function *GetFuncFor(StringRef assertionKind, FuncType type, Type *ValTy,
+                       bool IsSigned, bool strict = true);
+
+  // Whether every check emitted runs whenever its site does, before the
+  // program goes on: no site can be switched off at run time, and no check
+  // is queued.
+  bool ChecksAlwaysRun() const;
+
+  // Returns one of the run-time support functions (from Runtime.c), which
+  // must exist.
+  Function *GetRuntimeFunc(StringRef Name);
+
+  // Whether the update function of the kind may write to its state, i.e.
+  // whether concurrent updates of the same state race.
+  bool UpdateWritesState(StringRef AssertionKind);
+
+  // The check function of As' kind for values of ValTy (e.g.
+  // __check_ge_i32), specialized for As' props: a copy of it taking only the
+  // new value and the site, with the props folded in as constants. nullptr
+  // if the kind has no check function, or some prop isn't an integer that
+  // fits its parameter. Assertions that have one keep no state.
+  //
+  // With Type Range, the same for the range function (e.g.
+  // __range_all_ge_i32), which takes the first element and the number of
+  // elements instead of the new value.
+  Function *GetSpecializedCheck(Assertion &As, Type *ValTy, bool IsSigned,
+                                FuncType Type = FuncType::Check);
 private:
   // Returns a reference to the desired cache based on the FuncType.
   FnMapTy &SwitchCache(FuncType type);
 
-  // Caches for alloc, init and update functions declared in the module
+  // Caches for alloc, init, update and refresh functions declared in the module
   // we're processing.
   FnMapTy InitFuncs;
   FnMapTy UpdateFuncs;
   FnMapTy AllocFuncs;
+  FnMapTy RefreshFuncs;
+  FnMapTy AtomicUpdateFuncs;
+  FnMapTy CheckFuncs;
+  FnMapTy RangeFuncs;
+  // By name: the check function's, then the props.
+  FnMapTy SpecializedChecks;
+
+  StringMap<bool> WritesState;
+
+  // Interned strings and props arrays, by contents.
+  StringMap<Constant *> Strings;
+  DenseMap<Constant *, Constant *> PropsArrays;
+
+  // Descriptors of the sites in this module, and their index in the table.
+  std::vector<Constant *> Sites;
+  DenseMap<Constant *, unsigned> SiteIndex;
+  // Stand for the table of sites, and for the array of what the run-time
+  // writes about them (__assertion_site_data), until they are emitted.
+  GlobalVariable *SiteTable = nullptr;
+  GlobalVariable *SiteData = nullptr;
+
+  GlobalVariable *getSiteTable();
+  GlobalVariable *getSiteData();
+
+  // The address of the data of the site with the given index.
+  Constant *getSiteDataRef(unsigned Site);
+
+  // Whether some site has a switch, so its keys must be registered, and
+  // whether some site is switched by its flag instead.
+  bool HasSwitches = false;
+  bool HasFlagSwitches = false;
+
+  // The condition of a switch: the patched move, or the flag's load.
+  Value *CreateSwitchKey(IRBuilder<> &Builder, unsigned Site,
+                         const Triple &T);
+  Value *CreateSwitchFlag(IRBuilder<> &Builder, unsigned Site);
+
+  // The functions the checker thread calls to run a queued call, by the
+  // function they call and the type of the value, and its props if it's an
+  // init function.
+  DenseMap<std::pair<std::pair<Function *, Type *>, Constant *>, Function *>
+    Drains;
+
+  Function *getDrainFor(Function *F, Type *ValTy, Constant *Props);
 
 public:
   // The Composite module we're working on.
@@ -77,15 +187,80 @@ public:
   // LLVM Context.
   LLVMContext &Context;
 
-  Common(Module &Mod) : M(Mod), Context(getGlobalContext()) {}
+  // What we did to the module.
+  Stats &Stat;
+
+  Common(Module &Mod, Stats &S)
+    : M(Mod), Context(Mod.getContext()), Stat(S) {}
 
   StructType *getStructTypeFor(StringRef AssertionKind);
   Constant *getStructValueFor(StringRef AssertionKind);
 
   // === Functions that add instrumentation ===================================
 
+  // Returns a pointer to a constant string with these contents, shared with
+  // any other user of the same string.
   Constant *GetPtrToGlobalString(StringRef str, StringRef name = "");
 
+  // Returns the props of As as passed to the run-time: a NULL-terminated i8**
+  // array, with integer props cast to pointers, right after their number.
+  // Shared like strings.
+  Constant *GetPropsFor(Assertion &As);
+
+  // === Site descriptors =====================================================
+
+  // Returns the index of As' site in the module's table of sites, adding it
+  // if needed. FileName (i8*) and LineNo (i32) are as in the annotation.
+  unsigned GetSiteFor(Assertion &As, Constant *FileName, Constant *LineNo);
+
+  // Returns the address of the descriptor of the site with the given index,
+  // to pass to the run-time functions: a link-time constant.
+  Constant *GetSiteRef(unsigned Site);
+
+  // Emits the table of sites and registers it at startup. Call once all the
+  // sites are known.
+  void EmitSiteTable();
+
+  // === Run-time switches ====================================================
+
+  // Emits the switch of the site with the given index (see
+  // -assertions-switches) at Builder's insertion point: a move of an
+  // immediate that the run-time patches to turn the site on and off, and a
+  // branch on it. Moves Builder into the block that only runs while the
+  // site is on, and returns where the code that always runs continues.
+  // Only x86 ELF code is patched like this; elsewhere, the site loads the
+  // on flag of its data instead. Patched sites that are on load it too
+  // when the run-time couldn't patch code (__assertions_switch_by_flag).
+  // Does nothing and returns nullptr without -assertions-switches.
+  Instruction *CreateSwitch(IRBuilder<> &Builder, unsigned Site);
+
+  // === Profiling ============================================================
+
+  // Emits a call to the check or update function F, whose last argument is
+  // the site. With -assertions-profile, also counts the call for the site,
+  // and the cycles it took if asked.
+  CallInst *CreateCheckCall(IRBuilder<> &Builder, Function *F,
+                            ArrayRef<Value *> Args);
+
+  // === Asynchronous checks ==================================================
+
+  // Whether, with -assertions-async, a call on a value of type ValTy and on
+  // State (null if the call takes none) can be queued. The value must fit
+  // in 64 bits, and the state outlive the frame: only a constant one (none,
+  // or a global) is sure to. Calls on states in the frame or from the pool are
+  // made right away, so that no entry points to a state that is gone, and
+  // functions never wait for their queued calls.
+  bool CanQueue(Type *ValTy, Value *State);
+
+  // Emits, instead of a call to the check, update, refresh or init function
+  // F, an entry in the thread's queue of checks for the run-time's checker
+  // thread (see __assertions_async) to make that call later. Val is the new
+  // value, or the initial value for an init function, which gets its
+  // address. State and Site may be null if F doesn't take them, and Props
+  // are an init function's.
+  void CreateQueuedCall(IRBuilder<> &Builder, Function *F, Value *Val,
+                        Value *State, Value *Site, Constant *Props = nullptr);
+
 };
 
 }
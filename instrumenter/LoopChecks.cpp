@@ -0,0 +1,256 @@
+#include "Assertion.h" // from Clang
+
+#include "LoopChecks.h"
+
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+namespace assertions {
+
+typedef Common::FuncType  FuncType;
+
+bool LoopCheckDeferral::isDeferrable(StringRef Kind) {
+  // ge holds for all values iff it holds for the smallest one. monotonic
+  // holds iff each value is ordered after the one before, which can be
+  // tracked pairwise inside the loop.
+  return Kind == "ge" || Kind == "monotonic";
+}
+
+void LoopCheckDeferral::reset(Function &Fn, LoopInfo &LoopI) {
+  F = &Fn;
+  LI = &LoopI;
+  Shapes.clear();
+  Blocked.clear();
+  Accs.clear();
+}
+
+void LoopCheckDeferral::block(BasicBlock *BB, int UID) {
+  for (Loop *L = LI->getLoopFor(BB); L; L = L->getParentLoop())
+    Blocked.insert(std::make_pair(L, UID));
+}
+
+bool LoopCheckDeferral::hasGoodShape(Loop *L) {
+  auto It = Shapes.find(L);
+  if (It == Shapes.end()) {
+    LoopShape &Shape = Shapes[L];
+    Shape.Preheader = L->getLoopPreheader();
+    // The exit checks must not run on paths that never entered the loop.
+    if (L->hasDedicatedExits())
+      L->getExitBlocks(Shape.Exits);
+    It = Shapes.find(L);
+  }
+  return It->second.Preheader && !It->second.Exits.empty();
+}
+
+Loop *LoopCheckDeferral::getLoopFor(BasicBlock *BB, Assertion &As) {
+  if (!isDeferrable(As.Kind))
+    return nullptr;
+  // Deferring to the outermost loop keeps inner loops free of checks too.
+  SmallVector<Loop *, 4> Nest;
+  for (Loop *L = LI->getLoopFor(BB); L; L = L->getParentLoop())
+    Nest.push_back(L);
+  for (auto I = Nest.rbegin(), E = Nest.rend(); I != E; ++I) {
+    if (!Blocked.count(std::make_pair(*I, As.UID)) && hasGoodShape(*I))
+      return *I;
+  }
+  return nullptr;
+}
+
+static Constant *getMaxValue(Type *Ty, bool IsSigned) {
+  if (Ty->isFloatingPointTy())
+    return ConstantFP::getInfinity(Ty);
+  unsigned Bits = Ty->getIntegerBitWidth();
+  return ConstantInt::get(Ty->getContext(),
+    IsSigned ? APInt::getSignedMaxValue(Bits) : APInt::getMaxValue(Bits));
+}
+
+static Value *CreateLessThan(IRBuilder<> &Builder, Value *L, Value *R,
+                             bool IsSigned) {
+  if (L->getType()->isFloatingPointTy())
+    return Builder.CreateFCmpOLT(L, R);
+  return IsSigned ? Builder.CreateICmpSLT(L, R) : Builder.CreateICmpULT(L, R);
+}
+
+LoopCheckDeferral::Accumulator &
+LoopCheckDeferral::getAccumulator(Loop *L, Assertion &As, Type *ValTy,
+                                  bool IsSigned, Value *State,
+                                  Function *Check, unsigned Site) {
+  auto Key = std::make_pair(L, As.UID);
+  auto It = Accs.find(Key);
+  if (It != Accs.end())
+    return It->second;
+
+  DEBUG(status("Caller", "Deferring " + As.Kind + " checks to loop exit", 1));
+  Accumulator &Acc = Accs[Key];
+  Acc.Check = Check;
+  Acc.Update = Check ? nullptr :
+    Co.GetFuncFor(As.Kind, FuncType::Update, ValTy, IsSigned);
+  Acc.IsSigned = IsSigned;
+  Acc.State = State;
+  Acc.Min = Acc.First = Acc.Last = Acc.Ok = Acc.BadPrev = Acc.BadNew =
+    Acc.Seen = Acc.MinSite = Acc.FirstSite = Acc.BadSite = nullptr;
+
+  // The accumulators live in the entry block, so that they can be promoted
+  // to registers, and are reset right before entering the loop.
+  IRBuilder<> Entry(&F->getEntryBlock(), F->getEntryBlock().begin());
+  IRBuilder<> Pre(Shapes[L].Preheader->getTerminator());
+  Type *BoolTy = Entry.getInt1Ty();
+  Constant *FirstRef = Co.GetSiteRef(Site);
+  Type *SiteTy = FirstRef->getType();
+  if (As.Kind == "ge") {
+    Acc.Min = Entry.CreateAlloca(ValTy, nullptr, "assertions.loop.min");
+    Acc.MinSite = Entry.CreateAlloca(SiteTy, nullptr,
+                                     "assertions.loop.minsite");
+    Co.Stat.Allocas += 2;
+    Pre.CreateStore(getMaxValue(ValTy, IsSigned), Acc.Min);
+    Pre.CreateStore(FirstRef, Acc.MinSite);
+  } else if (As.Kind == "monotonic") {
+    Acc.First = Entry.CreateAlloca(ValTy, nullptr, "assertions.loop.first");
+    Acc.Last = Entry.CreateAlloca(ValTy, nullptr, "assertions.loop.last");
+    Acc.BadPrev = Entry.CreateAlloca(ValTy, nullptr, "assertions.loop.badprev");
+    Acc.BadNew = Entry.CreateAlloca(ValTy, nullptr, "assertions.loop.badnew");
+    Acc.Ok = Entry.CreateAlloca(BoolTy, nullptr, "assertions.loop.ok");
+    Acc.Seen = Entry.CreateAlloca(BoolTy, nullptr, "assertions.loop.seen");
+    Acc.FirstSite = Entry.CreateAlloca(SiteTy, nullptr,
+                                       "assertions.loop.firstsite");
+    Acc.BadSite = Entry.CreateAlloca(SiteTy, nullptr,
+                                     "assertions.loop.badsite");
+    Co.Stat.Allocas += 8;
+    Constant *Zero = Constant::getNullValue(ValTy);
+    for (AllocaInst *V : { Acc.First, Acc.Last, Acc.BadPrev, Acc.BadNew })
+      Pre.CreateStore(Zero, V);
+    Pre.CreateStore(Pre.getTrue(), Acc.Ok);
+    Pre.CreateStore(Pre.getFalse(), Acc.Seen);
+    Pre.CreateStore(FirstRef, Acc.FirstSite);
+    Pre.CreateStore(FirstRef, Acc.BadSite);
+  } else {
+    llvm_unreachable("Deferring checks of an assertion that can't be");
+  }
+  return Acc;
+}
+
+void LoopCheckDeferral::defer(Instruction &Inst, Loop *L, Assertion &As,
+                              Value *NewVal, bool IsSigned, Value *State,
+                              Function *Check, unsigned Site) {
+  Accumulator &Acc =
+    getAccumulator(L, As, NewVal->getType(), IsSigned, State, Check, Site);
+  IRBuilder<> Builder(&Inst);
+  // A site that is switched off leaves the accumulators alone, whatever the
+  // other sites in the loop do.
+  Co.CreateSwitch(Builder, Site);
+  Value *SiteRef = Co.GetSiteRef(Site);
+  if (Acc.Min) {
+    Value *Min = Builder.CreateLoad(Acc.Min);
+    Value *Less = CreateLessThan(Builder, NewVal, Min, Acc.IsSigned);
+    Builder.CreateStore(Builder.CreateSelect(Less, NewVal, Min), Acc.Min);
+    Builder.CreateStore(
+      Builder.CreateSelect(Less, SiteRef, Builder.CreateLoad(Acc.MinSite)),
+      Acc.MinSite);
+    return;
+  }
+  // monotonic, without branches:
+  //   first = seen ? first : new
+  //   bad   = seen && new < last
+  //   if (bad && ok) { badprev = last; badnew = new; }
+  //   ok    = ok && !bad
+  //   last  = new; seen = true
+  Value *Seen = Builder.CreateLoad(Acc.Seen);
+  Value *Last = Builder.CreateLoad(Acc.Last);
+  Value *Ok = Builder.CreateLoad(Acc.Ok);
+  Builder.CreateStore(
+    Builder.CreateSelect(Seen, Builder.CreateLoad(Acc.First), NewVal),
+    Acc.First);
+  Builder.CreateStore(
+    Builder.CreateSelect(Seen, Builder.CreateLoad(Acc.FirstSite), SiteRef),
+    Acc.FirstSite);
+  Value *Bad = Builder.CreateAnd(Seen,
+    CreateLessThan(Builder, NewVal, Last, Acc.IsSigned));
+  Value *FirstBad = Builder.CreateAnd(Bad, Ok);
+  Builder.CreateStore(
+    Builder.CreateSelect(FirstBad, Last, Builder.CreateLoad(Acc.BadPrev)),
+    Acc.BadPrev);
+  Builder.CreateStore(
+    Builder.CreateSelect(FirstBad, NewVal, Builder.CreateLoad(Acc.BadNew)),
+    Acc.BadNew);
+  Builder.CreateStore(
+    Builder.CreateSelect(FirstBad, SiteRef, Builder.CreateLoad(Acc.BadSite)),
+    Acc.BadSite);
+  Builder.CreateStore(Builder.CreateAnd(Ok, Builder.CreateNot(Bad)), Acc.Ok);
+  Builder.CreateStore(NewVal, Acc.Last);
+  Builder.CreateStore(Builder.getTrue(), Acc.Seen);
+}
+
+void LoopCheckDeferral::emitUpdate(IRBuilder<> &Builder, Accumulator &Acc,
+                                   Value *V, Value *Site) {
+  // The state's other updates may be queued.
+  if (Co.CanQueue(V->getType(), Acc.Check ? nullptr : Acc.State)) {
+    Co.CreateQueuedCall(Builder, Acc.Check ? Acc.Check : Acc.Update, V,
+                        Acc.Check ? nullptr : Acc.State, Site);
+  } else if (Acc.Check) {
+    Value *Args[] = { V, Site };
+    Co.CreateCheckCall(Builder, Acc.Check, Args);
+  } else {
+    Value *Args[] = { V, Acc.State, Site };
+    Co.CreateCheckCall(Builder, Acc.Update, Args);
+  }
+}
+
+void LoopCheckDeferral::emitExitCheck(Accumulator &Acc, BasicBlock *Exit) {
+  IRBuilder<> Builder(Exit, Exit->getFirstInsertionPt());
+  if (Acc.Min) {
+    // If the loop didn't update the variable, this checks the largest
+    // value, which passes.
+    emitUpdate(Builder, Acc, Builder.CreateLoad(Acc.Min),
+               Builder.CreateLoad(Acc.MinSite));
+    return;
+  }
+  // monotonic: check the first value against the value from before the
+  // loop, at the site that stored it, then walk the state up to the first
+  // unordered pair, if any, and check that, so the report shows the actual
+  // values:
+  //   update(first); update(ok ? last : badprev); update(ok ? last : badnew)
+  Value *Seen = Builder.CreateLoad(Acc.Seen);
+  BasicBlock *Head = Builder.GetInsertBlock();
+  BasicBlock *Cont = Head->splitBasicBlock(Builder.GetInsertPoint(),
+                                           "assertions.loop.cont");
+  BasicBlock *Check = BasicBlock::Create(Exit->getContext(),
+    "assertions.loop.check", F, Cont);
+  Head->getTerminator()->eraseFromParent();
+  Builder.SetInsertPoint(Head);
+  Builder.CreateCondBr(Seen, Check, Cont);
+
+  Builder.SetInsertPoint(Check);
+  Value *Ok = Builder.CreateLoad(Acc.Ok);
+  Value *Last = Builder.CreateLoad(Acc.Last);
+  // The pair that failed is reported at the site that stored its second
+  // value.
+  Value *BadSite = Builder.CreateLoad(Acc.BadSite);
+  Value *Vals[] = {
+    Builder.CreateLoad(Acc.First),
+    Builder.CreateSelect(Ok, Last, Builder.CreateLoad(Acc.BadPrev)),
+    Builder.CreateSelect(Ok, Last, Builder.CreateLoad(Acc.BadNew))
+  };
+  Value *Sites[] = {
+    Builder.CreateLoad(Acc.FirstSite), BadSite, BadSite
+  };
+  for (unsigned I = 0; I != 3; ++I)
+    emitUpdate(Builder, Acc, Vals[I], Sites[I]);
+  Builder.CreateBr(Cont);
+}
+
+void LoopCheckDeferral::finish() {
+  for (auto &KV : Accs) {
+    for (BasicBlock *Exit : Shapes[KV.first.first].Exits)
+      emitExitCheck(KV.second, Exit);
+  }
+  Accs.clear();
+}
+
+}
@@ -0,0 +1,115 @@
+#ifndef ASSERTIONS_INSTRUMENTER_LOOPCHECKS_H
+#define ASSERTIONS_INSTRUMENTER_LOOPCHECKS_H
+
+#include "Common.h"
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
+
+#include <utility>
+
+namespace llvm {
+  class AllocaInst;
+  class BasicBlock;
+  class Function;
+  class Instruction;
+  class Loop;
+  class LoopInfo;
+  class Value;
+}
+
+namespace assertions {
+
+struct Assertion;
+
+/// Moves the update checks of asserted variables out of the loops that
+/// update them.
+///
+/// Inside the loop, each update only folds the new value into a few
+/// accumulators using selects (e.g. the smallest value stored, for ge),
+/// which keeps the loop free of calls and branches (but for site switches)
+/// so that it can still be vectorized once the accumulators are promoted to
+/// registers. On every
+/// exit of the loop, the accumulated values are run through the usual
+/// update function, with the file and line of the first update site in the
+/// loop, so a failure is reported once the loop is done.
+///
+/// Only assertions whose check can be summarized this way are deferred: see
+/// isDeferrable().
+class LoopCheckDeferral {
+public:
+  LoopCheckDeferral(Common &C) : Co(C), LI(nullptr) {}
+
+  static bool isDeferrable(llvm::StringRef Kind);
+
+  // Starts working on a new function. Must be called before its IR changes.
+  void reset(llvm::Function &F, llvm::LoopInfo &LoopI);
+
+  // Checks on UID can't be deferred in any loop containing BB, e.g. because
+  // its state is (re)initialised or passed to a function there.
+  void block(llvm::BasicBlock *BB, int UID);
+
+  // Picks the outermost loop around BB in which the checks of As can be
+  // deferred, if any. Call after block()ing all blocks, and before
+  // changing the function.
+  llvm::Loop *getLoopFor(llvm::BasicBlock *BB, Assertion &As);
+
+  // Replaces the update check at Inst, the site with index Site, with
+  // folding NewVal into L's accumulators, behind the site's switch if it
+  // has one. IsSigned tells how to order integer values. Check, if not
+  // null, is the specialized check to call on the exits instead of the
+  // update function, without State.
+  void defer(llvm::Instruction &Inst, llvm::Loop *L, Assertion &As,
+             llvm::Value *NewVal, bool IsSigned, llvm::Value *State,
+             llvm::Function *Check, unsigned Site);
+
+  // Emits the checks on the loop exits for everything that was deferred.
+  void finish();
+
+private:
+  Common &Co;
+  llvm::LoopInfo *LI;
+  llvm::Function *F;
+
+  // What we need to know about a loop, taken before the function changes
+  // (LoopInfo doesn't know about blocks we add).
+  struct LoopShape {
+    llvm::BasicBlock *Preheader;
+    llvm::SmallVector<llvm::BasicBlock *, 4> Exits;
+  };
+  llvm::DenseMap<llvm::Loop *, LoopShape> Shapes;
+
+  typedef std::pair<llvm::Loop *, int> LoopUIDTy;
+  llvm::DenseSet<LoopUIDTy> Blocked;
+
+  // Accumulators for one asserted variable in one loop.
+  struct Accumulator {
+    // Either the update function, or a specialized check.
+    llvm::Function *Update, *Check;
+    bool IsSigned;
+    llvm::Value *State;
+    // ge: smallest value. monotonic: first value, last value, whether all
+    // pairs were ordered, the first pair that wasn't, and whether any
+    // value was seen at all.
+    llvm::AllocaInst *Min, *First, *Last, *Ok, *BadPrev, *BadNew, *Seen;
+    // The run-time ids of the sites that stored Min, First and BadNew, so
+    // that a failure names the update that caused it.
+    llvm::AllocaInst *MinSite, *FirstSite, *BadSite;
+  };
+  llvm::DenseMap<LoopUIDTy, Accumulator> Accs;
+
+  bool hasGoodShape(llvm::Loop *L);
+  Accumulator &getAccumulator(llvm::Loop *L, Assertion &As,
+                              llvm::Type *ValTy, bool IsSigned,
+                              llvm::Value *State, llvm::Function *Check,
+                              unsigned Site);
+  void emitExitCheck(Accumulator &Acc, llvm::BasicBlock *Exit);
+  void emitUpdate(llvm::IRBuilder<> &Builder, Accumulator &Acc,
+                  llvm::Value *V, llvm::Value *Site);
+};
+
+}
+
+#endif
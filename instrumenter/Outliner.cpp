@@ -0,0 +1,187 @@
+#include "Common.h"
+#include "Outliner.h"
+#include "Stats.h"
+
+#include "llvm/Analysis/Dominators.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Metadata.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CallSite.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/CodeExtractor.h"
+
+using namespace llvm;
+
+namespace assertions {
+
+static cl::opt<bool>
+OutlineKernels("assertions-outline",
+  cl::desc("Move the failure reporting out of the run-time kernels, and "
+           "always inline what is left"),
+  cl::init(true));
+
+static cl::opt<bool>
+SizeReport("assertions-size-report",
+  cl::desc("Print the size of each run-time kernel, and what its checks "
+           "cost once inlined"),
+  cl::init(false));
+
+char KernelOutliner::ID = 0;
+
+void KernelOutliner::getAnalysisUsage(AnalysisUsage &AU) const {
+  AU.addRequired<DominatorTree>();
+}
+
+bool KernelOutliner::isKernel(Function &F) {
+  // Cold parts are named after their kernel, but with a '.'.
+  StringRef Name = F.getName();
+  return !F.isDeclaration() && Name.find('.') == StringRef::npos &&
+    (Name.startswith("__update_") || Name.startswith("__init_") ||
+     Name.startswith("__refresh_") || Name.startswith("__check_"));
+}
+
+static unsigned countInstructions(Function &F) {
+  unsigned N = 0;
+  for (Function::iterator BB = F.begin(), E = F.end(); BB != E; ++BB) {
+    for (BasicBlock::iterator I = BB->begin(), IE = BB->end(); I != IE; ++I) {
+      if (!isa<DbgInfoIntrinsic>(I))
+        ++N;
+    }
+  }
+  return N;
+}
+
+BasicBlock *KernelOutliner::getUnlikelySuccessor(BasicBlock *BB) {
+  auto *Br = dyn_cast<BranchInst>(BB->getTerminator());
+  if (!Br || !Br->isConditional())
+    return nullptr;
+  MDNode *Weights = Br->getMetadata(LLVMContext::MD_prof);
+  if (!Weights || Weights->getNumOperands() != 3)
+    return nullptr;
+  auto *Name = dyn_cast<MDString>(Weights->getOperand(0));
+  auto *True = dyn_cast<ConstantInt>(Weights->getOperand(1));
+  auto *False = dyn_cast<ConstantInt>(Weights->getOperand(2));
+  if (!Name || Name->getString() != "branch_weights" || !True || !False)
+    return nullptr;
+  // __builtin_expect weighs the expected side 64:4.
+  uint64_t T = True->getZExtValue(), F = False->getZExtValue();
+  if (T * 8 <= F)
+    return Br->getSuccessor(0);
+  if (F * 8 <= T)
+    return Br->getSuccessor(1);
+  return nullptr;
+}
+
+bool KernelOutliner::outlineColdPaths(Function &F, DominatorTree &DT,
+                                      SmallVectorImpl<Function *> &Cold) {
+  SmallVector<BasicBlock *, 4> Heads;
+  for (Function::iterator BB = F.begin(), E = F.end(); BB != E; ++BB) {
+    if (BasicBlock *Head = getUnlikelySuccessor(BB))
+      Heads.push_back(Head);
+  }
+  bool AllOut = true;
+  for (BasicBlock *Head : Heads) {
+    // Already went out with an enclosing cold path.
+    if (Head->getParent() != &F)
+      continue;
+    // Everything the unlikely successor dominates only runs after it.
+    SmallVector<BasicBlock *, 8> Region;
+    SmallVector<DomTreeNode *, 8> Worklist(1, DT.getNode(Head));
+    while (!Worklist.empty()) {
+      DomTreeNode *N = Worklist.pop_back_val();
+      Region.push_back(N->getBlock());
+      Worklist.append(N->begin(), N->end());
+    }
+    CodeExtractor CE(Region, &DT);
+    Function *Part = CE.isEligible() ? CE.extractCodeRegion() : nullptr;
+    if (!Part) {
+      AllOut = false;
+      continue;
+    }
+    Part->setName(F.getName() + ".cold");
+    Part->addFnAttr(Attribute::NoInline);
+    Part->addFnAttr(Attribute::OptimizeForSize);
+    Part->setSection(".text.unlikely");
+    Cold.push_back(Part);
+    DEBUG(status("Outliner", "Outlined " + Part->getName(), 1));
+    // The extractor leaves the moved blocks in the tree.
+    DT.runOnFunction(F);
+  }
+  return AllOut;
+}
+
+bool KernelOutliner::runOnModule(Module &M) {
+  Stats::Timer T(Stat, "outline");
+  Kernels.clear();
+  for (Module::iterator F = M.begin(), E = M.end(); F != E; ++F) {
+    if (isKernel(*F)) {
+      KernelInfo KI;
+      KI.Kernel = F;
+      KI.SizeBefore = countInstructions(*F);
+      Kernels.push_back(KI);
+    }
+  }
+  if (!OutlineKernels)
+    return false;
+  // Only the kernels: the rest of the module isn't ours to change.
+  bool Changed = false;
+  for (KernelInfo &KI : Kernels) {
+    Function &F = *KI.Kernel;
+    DominatorTree &DT = getAnalysis<DominatorTree>(F);
+    if (outlineColdPaths(F, DT, KI.Cold)) {
+      // Small enough now, whatever the inliner thinks of the call sites.
+      F.addFnAttr(Attribute::AlwaysInline);
+    }
+    Changed |= !KI.Cold.empty();
+  }
+  return Changed;
+}
+
+bool KernelOutliner::doFinalization(Module &M) {
+  // Module passes finish in reverse order, so the instrumenters are done.
+  if (SizeReport)
+    printReport(M, errs());
+  Kernels.clear();
+  return false;
+}
+
+void KernelOutliner::printReport(Module &M, raw_ostream &OS) {
+  OS << "Assertion kernel sizes, in IR instructions:\n";
+  OS << format("%-32s %8s %8s %8s %8s %10s\n", "kernel", "before", "fast",
+               "cold", "calls", "inlined");
+  unsigned TotalCalls = 0, TotalInlined = 0;
+  for (KernelInfo &KI : Kernels) {
+    Function &F = *KI.Kernel;
+    unsigned Fast = countInstructions(F), ColdSize = 0;
+    for (Function *Part : KI.Cold)
+      ColdSize += countInstructions(*Part);
+    // Calls from instrumented code, each of which gets a copy of the fast
+    // path when inlined.
+    unsigned Calls = 0;
+    for (Value::use_iterator U = F.use_begin(), UE = F.use_end();
+         U != UE; ++U) {
+      CallSite CS(*U);
+      if (CS && CS.getCalledFunction() == &F &&
+          !isKernel(*CS.getInstruction()->getParent()->getParent()))
+        ++Calls;
+    }
+    bool Inlined = F.hasFnAttribute(Attribute::AlwaysInline);
+    unsigned Cost = Calls * (Inlined ? Fast : 1);
+    TotalCalls += Calls;
+    TotalInlined += Cost;
+    OS << format("%-32s %8u %8u %8u %8u %10u%s\n",
+                 F.getName().str().c_str(), KI.SizeBefore, Fast, ColdSize,
+                 Calls, Cost, Inlined ? "" : " (not inlined)");
+  }
+  OS << format("%-32s %8s %8s %8s %8u %10u\n", "total", "", "", "",
+               TotalCalls, TotalInlined);
+}
+
+}
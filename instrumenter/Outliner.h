@@ -0,0 +1,71 @@
+#ifndef ASSERTIONS_INSTRUMENTER_OUTLINER_H
+#define ASSERTIONS_INSTRUMENTER_OUTLINER_H
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Pass.h"
+
+namespace llvm {
+  class BasicBlock;
+  class DominatorTree;
+  class Function;
+  class Module;
+  class raw_ostream;
+}
+
+namespace assertions {
+
+class Stats;
+
+/// Splits the run-time kernels (__update_<kind>, __init_<kind>, ...) linked
+/// in from Assertions.c into a fast path and a cold part.
+///
+/// The failure reporting that EXPECT expands to (printing, aborting) is
+/// behind a branch marked unlikely, and makes up most of a kernel. It is
+/// moved into a separate function, named after the kernel with a ".cold"
+/// suffix, which is never inlined and goes into .text.unlikely. What is left
+/// is the comparison, the state update and a call on the unlikely path, which
+/// is marked always_inline so that the checks don't stay calls on hot paths.
+///
+/// Must run before the instrumenters, and reports the sizes of the kernels
+/// (-assertions-size-report) once they are done.
+class KernelOutliner : public llvm::ModulePass {
+public:
+  static char ID;
+  KernelOutliner(Stats &S) : ModulePass(ID), Stat(S) {}
+
+  const char *getPassName() const {
+    return "Assertion kernel outliner";
+  }
+
+  virtual void getAnalysisUsage(llvm::AnalysisUsage &AU) const;
+  virtual bool runOnModule(llvm::Module &M);
+  virtual bool doFinalization(llvm::Module &M);
+
+  // Whether F is one of the run-time kernels (and not a cold part of one).
+  static bool isKernel(llvm::Function &F);
+
+private:
+  Stats &Stat;
+
+  // A kernel, the cold parts taken out of it, and its size before.
+  struct KernelInfo {
+    llvm::Function *Kernel;
+    llvm::SmallVector<llvm::Function *, 1> Cold;
+    unsigned SizeBefore;
+  };
+  llvm::SmallVector<KernelInfo, 8> Kernels;
+
+  // Returns the successor of BB that its branch weights mark unlikely.
+  static llvm::BasicBlock *getUnlikelySuccessor(llvm::BasicBlock *BB);
+
+  // Moves the code dominated by each unlikely successor into its own
+  // function. Returns whether F has no unlikely code left.
+  bool outlineColdPaths(llvm::Function &F, llvm::DominatorTree &DT,
+                        llvm::SmallVectorImpl<llvm::Function *> &Cold);
+
+  void printReport(llvm::Module &M, llvm::raw_ostream &OS);
+};
+
+}
+
+#endif
@@ -0,0 +1,129 @@
+//===- Plugin.cpp - Assertions instrumentation as a plugin ----------------===//
+//
+// Runs the instrumentation inside clang (or opt), on the module it has just
+// generated, instead of in assertions-instrument on bitcode written to disk
+// and read back. Load it with
+//
+//   clang -Xclang -load -Xclang AssertionsPlugin.so ...
+//   opt -load AssertionsPlugin.so -assertions ...
+//
+// In clang, the pass runs first thing in the module pipeline, before the
+// inliner, or at the end of it at -O0. Above -O0, clang has already run its
+// per-function passes (SROA, early CSE) by then, so this needs the
+// instrumenters' support for optimized modules, and annotations that
+// survived those passes.
+//
+//===----------------------------------------------------------------------===//
+
+#include "Callee.h"
+#include "Caller.h"
+#include "Cloner.h"
+#include "Common.h"
+#include "Outliner.h"
+#include "RuntimeModule.h"
+#include "Stats.h"
+
+#include "llvm/ADT/OwningPtr.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/Module.h"
+#include "llvm/PassManager.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/system_error.h"
+#include "llvm/Target/TargetLibraryInfo.h"
+#include "llvm/Transforms/IPO/PassManagerBuilder.h"
+
+using namespace llvm;
+
+namespace assertions {
+
+// Filename of compiled bc Assertions module provided by CMake.
+#ifdef ASSERTIONS_MODULE_PATH
+#define STR2(X) #X
+#define STR(X) STR2(X)
+#define ASSERTIONS_FNAME STR(ASSERTIONS_MODULE_PATH)
+#else
+#error "Need to define ASSERTIONS_MODULE_PATH"
+#endif
+
+static cl::opt<std::string>
+RuntimeFilename("assertions-runtime",
+  cl::desc("Assertions module to link into instrumented modules"),
+  cl::value_desc("filename"), cl::init(ASSERTIONS_FNAME));
+
+/// Links in the run-time and runs the instrumentation passes, as
+/// assertions-instrument does, on the module being compiled.
+class AssertionsPass : public ModulePass {
+public:
+  static char ID;
+  AssertionsPass() : ModulePass(ID) {}
+
+  const char *getPassName() const {
+    return "Assertions instrumentation";
+  }
+
+  virtual bool runOnModule(Module &M);
+
+private:
+  // Read and verified once per context, on first use.
+  static const RuntimeModule &getRuntime(LLVMContext &Context);
+};
+
+char AssertionsPass::ID = 0;
+
+const RuntimeModule &AssertionsPass::getRuntime(LLVMContext &Context) {
+  static OwningPtr<MemoryBuffer> Bitcode;
+  static OwningPtr<RuntimeModule> Runtime;
+  if (!Bitcode.get()) {
+    if (error_code EC = MemoryBuffer::getFile(RuntimeFilename, Bitcode))
+      report_fatal_error(RuntimeFilename + ": " + EC.message());
+  }
+  if (!Runtime.get() || &Runtime->getContext() != &Context) {
+    std::string ErrorMessage;
+    Runtime.reset(RuntimeModule::load(*Bitcode, Context, ErrorMessage));
+    if (!Runtime.get())
+      report_fatal_error(RuntimeFilename + ": " + ErrorMessage);
+  }
+  return *Runtime;
+}
+
+bool AssertionsPass::runOnModule(Module &M) {
+  Stats Stat;
+  std::string ErrorMessage;
+  if (!LinkRuntime(M, getRuntime(M.getContext()), ErrorMessage,
+                   &Stat.RuntimeFunctions))
+    report_fatal_error(ErrorMessage);
+
+  // The instrumenters share a Common for the module, so they get their own
+  // pass manager rather than the compiler's.
+  PassManager Passes;
+  Passes.add(new TargetLibraryInfo(Triple(M.getTargetTriple())));
+  if (!M.getDataLayout().empty())
+    Passes.add(new DataLayout(M.getDataLayout()));
+  OwningPtr<Common> Co(new Common(M, Stat));
+  Passes.add(new KernelOutliner(Stat));
+  Passes.add(new FunctionCloner(*Co.get()));
+  Passes.add(new CalleeInstrumenter(*Co.get()));
+  Passes.add(new CallerInstrumenter(*Co.get()));
+  Passes.run(M);
+  return true;
+}
+
+static RegisterPass<AssertionsPass>
+X("assertions", "Link in the assertions run-time and instrument assertions");
+
+static void addAssertionsPass(const PassManagerBuilder &Builder,
+                              PassManagerBase &PM) {
+  PM.add(new AssertionsPass());
+}
+
+// Before the inliner copies annotated code around, and before anything
+// else in the module pipeline gets to the annotations.
+static RegisterStandardPasses
+AtOpt(PassManagerBuilder::EP_ModuleOptimizerEarly, addAssertionsPass);
+static RegisterStandardPasses
+AtO0(PassManagerBuilder::EP_EnabledOnOptLevel0, addAssertionsPass);
+
+}
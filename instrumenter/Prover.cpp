@@ -0,0 +1,160 @@
+#include "Assertion.h" // from Clang
+
+#include "Prover.h"
+
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/InstrTypes.h"
+#include "llvm/IR/IntrinsicInst.h"
+
+using namespace llvm;
+
+namespace assertions {
+
+StringRef AssertionProver::ResultName(Result R) {
+  switch (R) {
+    case Unknown:     return "unknown";
+    case AlwaysHolds: return "always holds";
+    case AlwaysFails: return "always fails";
+  }
+  llvm_unreachable("Unhandled AssertionProver::Result");
+}
+
+AssertionProver::Result AssertionProver::Prove(Assertion &As,
+                                               StoreInst *Store,
+                                               bool IsSigned,
+                                               bool PrevChecked) {
+  if (Store->isVolatile())
+    return Unknown;
+  if (As.Kind == "monotonic")
+    return ProveMonotonic(Store, IsSigned);
+  if (As.Kind == "ge")
+    return ProveGe(As, Store, IsSigned, PrevChecked);
+  return Unknown;
+}
+
+AssertionProver::Result AssertionProver::ProveMonotonic(StoreInst *Store,
+                                                       bool IsSigned) {
+  // The state holds the previous value of the variable, so only stores
+  // relative to that value can be decided.
+  int64_t Step;
+  if (!IsSigned || !MatchSelfIncrement(Store, Step))
+    return Unknown;
+  return Step >= 0 ? AlwaysHolds : AlwaysFails;
+}
+
+AssertionProver::Result AssertionProver::ProveGe(Assertion &As,
+                                                 StoreInst *Store,
+                                                 bool IsSigned,
+                                                 bool PrevChecked) {
+  int64_t Than;
+  if (As.Params.empty() || StringRef(As.Params[0]).getAsInteger(0, Than))
+    return Unknown;
+  if (auto *C = dyn_cast<ConstantInt>(Store->getValueOperand())) {
+    if (C->getBitWidth() > 64)
+      return Unknown;
+    if (!IsSigned)
+      return Than <= 0 || C->getZExtValue() >= (uint64_t) Than ? AlwaysHolds
+                                                                : AlwaysFails;
+    return C->getSExtValue() >= Than ? AlwaysHolds : AlwaysFails;
+  }
+  if (auto *C = dyn_cast<ConstantFP>(Store->getValueOperand())) {
+    // Same comparison as the run-time's, in double.
+    bool LosesInfo;
+    APFloat V = C->getValueAPF();
+    V.convert(APFloat::IEEEdouble, APFloat::rmNearestTiesToEven, &LosesInfo);
+    return V.convertToDouble() >= Than ? AlwaysHolds : AlwaysFails;
+  }
+  // The previous value passed its check, so it can only get larger. Not if
+  // that check was sampled out, or failed without stopping the program.
+  int64_t Step;
+  if (PrevChecked && IsSigned && MatchSelfIncrement(Store, Step) &&
+      Step >= 0)
+    return AlwaysHolds;
+  return Unknown;
+}
+
+bool AssertionProver::MatchSelfIncrement(StoreInst *Store, int64_t &Step) {
+  auto *BO = dyn_cast<BinaryOperator>(Store->getValueOperand());
+  if (!BO || !BO->hasNoSignedWrap())
+    return false;
+  LoadInst *Load;
+  ConstantInt *K;
+  switch (BO->getOpcode()) {
+    case Instruction::Add:
+      Load = dyn_cast<LoadInst>(BO->getOperand(0));
+      K = dyn_cast<ConstantInt>(BO->getOperand(1));
+      if (!Load) {
+        // Constant on the left hand side: k + x.
+        Load = dyn_cast<LoadInst>(BO->getOperand(1));
+        K = dyn_cast<ConstantInt>(BO->getOperand(0));
+      }
+      if (!Load || !K)
+        return false;
+      Step = K->getSExtValue();
+      break;
+    case Instruction::Sub:
+      Load = dyn_cast<LoadInst>(BO->getOperand(0));
+      K = dyn_cast<ConstantInt>(BO->getOperand(1));
+      if (!Load || !K)
+        return false;
+      Step = -K->getSExtValue();
+      break;
+    default:
+      return false;
+  }
+  if (Load->isVolatile() ||
+      Load->getPointerOperand() != Store->getPointerOperand() ||
+      Load->getParent() != Store->getParent() ||
+      !IsLocalOnly(Store->getPointerOperand()))
+    return false;
+  // Nothing may change the variable between reading and writing it back.
+  for (BasicBlock::iterator I = Load, E = Store; I != E; ++I) {
+    if (I->mayWriteToMemory())
+      return false;
+  }
+  return true;
+}
+
+bool AssertionProver::IsLocalOnly(Value *Addr) {
+  if (!isa<AllocaInst>(Addr->stripPointerCasts()))
+    return false;
+  SmallVector<Value *, 4> Worklist(1, Addr->stripPointerCasts());
+  SmallPtrSet<Value *, 8> Seen;
+  while (!Worklist.empty()) {
+    Value *V = Worklist.pop_back_val();
+    if (!Seen.insert(V))
+      continue;
+    for (Value::use_iterator U = V->use_begin(), E = V->use_end();
+         U != E; ++U) {
+      if (isa<LoadInst>(*U) || isa<DbgInfoIntrinsic>(*U))
+        continue;
+      if (auto *S = dyn_cast<StoreInst>(*U)) {
+        if (S->getValueOperand() == V)
+          return false;
+        continue;
+      }
+      if (isa<BitCastInst>(*U)) {
+        Worklist.push_back(*U);
+        continue;
+      }
+      if (auto *II = dyn_cast<IntrinsicInst>(*U)) {
+        switch (II->getIntrinsicID()) {
+          case Intrinsic::var_annotation:
+          case Intrinsic::assign_annotation:
+          case Intrinsic::lifetime_start:
+          case Intrinsic::lifetime_end:
+            continue;
+          default:
+            break;
+        }
+      }
+      return false;
+    }
+  }
+  return true;
+}
+
+}
@@ -0,0 +1,57 @@
+#ifndef ASSERTIONS_INSTRUMENTER_PROVER_H
+#define ASSERTIONS_INSTRUMENTER_PROVER_H
+
+#include "llvm/ADT/StringRef.h"
+
+#include <stdint.h>
+
+namespace llvm {
+  class StoreInst;
+  class Value;
+}
+
+namespace assertions {
+
+struct Assertion;
+
+/// Decides, where it can, the outcome of an assertion's update check at
+/// compile time, from the shape of the value being stored.
+///
+/// Only knows about the assertions defined in Assertions.c, and only about
+/// updates that go through instrumented stores. The annotations take the
+/// variable's address, so it lives in memory even in optimised modules, and
+/// rather than asking ScalarEvolution it matches "x = x + k" as a load of x,
+/// an add and a store back to x.
+class AssertionProver {
+public:
+  enum Result { Unknown, AlwaysHolds, AlwaysFails };
+
+  // IsSigned tells whether the variable stored to is signed. PrevChecked
+  // tells whether the variable's previous value is known to have passed
+  // its check: none of the variable's update sites is sampled, switched or
+  // queued, and a failure stops the program.
+  Result Prove(Assertion &As, llvm::StoreInst *Store, bool IsSigned,
+               bool PrevChecked);
+
+  static llvm::StringRef ResultName(Result R);
+
+private:
+  Result ProveMonotonic(llvm::StoreInst *Store, bool IsSigned);
+  Result ProveGe(Assertion &As, llvm::StoreInst *Store, bool IsSigned,
+                 bool PrevChecked);
+
+  // Matches Store storing "x + Step" into x, where x is read in the same
+  // block with nothing written to memory in between, and the addition can't
+  // overflow (nsw). Only means anything for signed variables. x must be a
+  // local variable whose address goes nowhere else, so that every store to
+  // it is one the instrumenter sees.
+  bool MatchSelfIncrement(llvm::StoreInst *Store, int64_t &Step);
+
+  // Whether the variable at Addr is an alloca only loaded, stored to and
+  // annotated.
+  static bool IsLocalOnly(llvm::Value *Addr);
+};
+
+}
+
+#endif
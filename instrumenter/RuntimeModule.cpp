@@ -0,0 +1,250 @@
+#include "Assertion.h" // from Clang
+
+#include "Common.h"
+#include "RuntimeModule.h"
+
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Analysis/Verifier.h"
+#include "llvm/Bitcode/ReaderWriter.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/GlobalAlias.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Linker.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+
+#include <cstring>
+
+using namespace llvm;
+
+namespace assertions {
+
+void CollectAssertionKinds(Module &M, StringSet<> &Kinds) {
+  // Clang puts the strings of all annotations, whether in
+  // llvm.global.annotations or passed to llvm.*.annotation, in
+  // llvm.metadata.
+  AssertionManager AM;
+  for (Module::global_iterator GV = M.global_begin(), E = M.global_end();
+       GV != E; ++GV) {
+    if (GV->getSection() != "llvm.metadata" || !GV->hasInitializer())
+      continue;
+    auto *Str = dyn_cast<ConstantDataSequential>(GV->getInitializer());
+    if (!Str || !Str->isCString())
+      continue;
+    StringRef anno = Str->getAsCString();
+    SmallVector<std::pair<StringRef, StringRef>, 4> UID_Kinds;
+    if (ParseAssertionMeta(anno, UID_Kinds)) {
+      for (auto &UID_Kind : UID_Kinds)
+        Kinds.insert(UID_Kind.second);
+    } else if (anno.startswith("assertion,")) {
+      Kinds.insert(AM.getParsedAssertion(anno).Kind);
+    }
+  }
+}
+
+// The run-time functions and globals that belong to one kind of assertion.
+static const char *const KindPrefixes[] = {
+  "__init_", "__update_atomic_", "__update_", "__alloc_", "__refresh_",
+  "__check_", "__range_"
+};
+
+// Whether GV is only needed by modules using some kind of assertion, and if
+// so, whether that's one of Kinds.
+static bool isForKind(GlobalValue &GV, const StringSet<> &Kinds,
+                      bool &Used) {
+  StringRef Name = GV.getName();
+  if (Name.endswith("_state_default")) {
+    Used = Kinds.count(Name.drop_back(strlen("_state_default")));
+    return true;
+  }
+  for (const char *Prefix : KindPrefixes) {
+    if (!Name.startswith(Prefix))
+      continue;
+    // __update_ge, __update_ge_u32, ...
+    StringRef Rest = Name.substr(strlen(Prefix));
+    Used = false;
+    for (auto I = Kinds.begin(), E = Kinds.end(); I != E && !Used; ++I) {
+      StringRef Kind = I->getKey();
+      Used = Rest.startswith(Kind) &&
+        (Rest.size() == Kind.size() || Rest[Kind.size()] == '_');
+    }
+    return true;
+  }
+  return false;
+}
+
+// What the passes call or read in the run-time that isn't a kind's. The
+// rest of it (failure reporting, the pools and rings these use) is only
+// linked if one of these, or a kind's functions, refer to it.
+static const char *const EntryPoints[] = {
+  "__assertions_register_sites", "__assertions_register_keys",
+  "__assertions_register_flags", "__assertions_switch_by_flag",
+  "__assertions_profile", "__assertions_checked",
+  "__assertions_pool_mark", "__assertions_pool_release",
+  "__assertions_shadow_lookup", "__assertions_shadow_create",
+  "__assertions_shadow_forget", "__assertions_shadow_moved",
+  "__assertions_async"
+};
+
+namespace {
+
+// Finds the globals that the kept ones refer to.
+class RuntimeWalker {
+public:
+  SmallPtrSet<GlobalValue *, 64> Needed;
+
+  void need(GlobalValue *GV) {
+    if (Needed.insert(GV))
+      Worklist.push_back(GV);
+  }
+
+  void walk() {
+    while (!Worklist.empty()) {
+      GlobalValue *GV = Worklist.pop_back_val();
+      if (auto *F = dyn_cast<Function>(GV)) {
+        for (Function::iterator BB = F->begin(), E = F->end(); BB != E; ++BB) {
+          for (BasicBlock::iterator I = BB->begin(), IE = BB->end();
+               I != IE; ++I) {
+            for (unsigned Op = 0, N = I->getNumOperands(); Op != N; ++Op) {
+              if (auto *C = dyn_cast<Constant>(I->getOperand(Op)))
+                visit(C);
+            }
+          }
+        }
+      } else if (auto *Var = dyn_cast<GlobalVariable>(GV)) {
+        if (Var->hasInitializer())
+          visit(Var->getInitializer());
+      } else if (auto *GA = dyn_cast<GlobalAlias>(GV)) {
+        visit(GA->getAliasee());
+      }
+    }
+  }
+
+private:
+  SmallVector<GlobalValue *, 64> Worklist;
+  SmallPtrSet<Constant *, 64> Seen;
+
+  void visit(Constant *C) {
+    if (auto *GV = dyn_cast<GlobalValue>(C)) {
+      need(GV);
+      return;
+    }
+    if (!Seen.insert(C))
+      return;
+    for (unsigned Op = 0, N = C->getNumOperands(); Op != N; ++Op)
+      visit(cast<Constant>(C->getOperand(Op)));
+  }
+};
+
+}
+
+RuntimeModule *RuntimeModule::load(const MemoryBuffer &Bitcode,
+                                   LLVMContext &Context,
+                                   std::string &ErrorMessage) {
+  // The reader takes the buffer, but this one doesn't own the bitcode.
+  OwningPtr<MemoryBuffer> Buffer(
+    MemoryBuffer::getMemBuffer(Bitcode.getBuffer(),
+                               Bitcode.getBufferIdentifier(), false));
+  OwningPtr<Module> RT(ParseBitcodeFile(Buffer.get(), Context,
+                                        &ErrorMessage));
+  if (!RT.get())
+    return nullptr;
+  if (verifyModule(*RT, ReturnStatusAction, &ErrorMessage))
+    return nullptr;
+  return new RuntimeModule(RT.take());
+}
+
+RuntimeModule::~RuntimeModule() {}
+
+LLVMContext &RuntimeModule::getContext() const {
+  return Full->getContext();
+}
+
+Module *RuntimeModule::getPartFor(const StringSet<> &Kinds,
+                                  const StringSet<> &Referenced) const {
+  // What to keep is found in the full module, then the rest dropped from
+  // the copy.
+  RuntimeWalker Walker;
+  for (const char *Name : EntryPoints) {
+    if (GlobalValue *GV = Full->getNamedValue(Name))
+      Walker.need(GV);
+  }
+  SmallVector<GlobalValue *, 64> All;
+  for (Module::iterator F = Full->begin(), E = Full->end(); F != E; ++F)
+    All.push_back(F);
+  for (Module::global_iterator GV = Full->global_begin(),
+       E = Full->global_end(); GV != E; ++GV)
+    All.push_back(GV);
+  for (Module::alias_iterator GA = Full->alias_begin(),
+       E = Full->alias_end(); GA != E; ++GA)
+    All.push_back(GA);
+  for (GlobalValue *GV : All) {
+    bool Used;
+    if (isForKind(*GV, Kinds, Used) ? Used : Referenced.count(GV->getName()))
+      Walker.need(GV);
+  }
+  Walker.walk();
+
+  ValueToValueMapTy VMap;
+  Module *Part = CloneModule(Full.get(), VMap);
+  // Drop what is left: first what it refers to, as it may refer to itself.
+  SmallVector<GlobalValue *, 64> Unneeded;
+  for (GlobalValue *Orig : All) {
+    if (Walker.Needed.count(Orig))
+      continue;
+    auto *GV = cast<GlobalValue>(VMap[Orig]);
+    if (auto *F = dyn_cast<Function>(GV))
+      F->deleteBody();
+    else if (auto *Var = dyn_cast<GlobalVariable>(GV))
+      Var->setInitializer(nullptr);
+    else
+      cast<GlobalAlias>(GV)->setAliasee(
+        UndefValue::get(GV->getType()));
+    Unneeded.push_back(GV);
+  }
+  for (GlobalValue *GV : Unneeded) {
+    GV->removeDeadConstantUsers();
+    GV->eraseFromParent();
+  }
+  DEBUG(status("Runtime", "Kept " + Twine(Walker.Needed.size()) + " of " +
+               Twine(All.size()) + " run-time globals"));
+  return Part;
+}
+
+bool LinkRuntime(Module &M, const RuntimeModule &Runtime,
+                 std::string &ErrorMessage, unsigned *NumFunctions) {
+  // Only the kernels of the kinds of assertions used here.
+  StringSet<> Kinds;
+  CollectAssertionKinds(M, Kinds);
+  // And what the program itself calls (__assertions_set_failure_policy,
+  // __assertions_dump_failures, ...).
+  StringSet<> Referenced;
+  for (Module::iterator F = M.begin(), E = M.end(); F != E; ++F) {
+    if (F->isDeclaration())
+      Referenced.insert(F->getName());
+  }
+  for (Module::global_iterator GV = M.global_begin(), E = M.global_end();
+       GV != E; ++GV) {
+    if (GV->isDeclaration())
+      Referenced.insert(GV->getName());
+  }
+  OwningPtr<Module> RT(Runtime.getPartFor(Kinds, Referenced));
+  if (NumFunctions)
+    *NumFunctions = RT->size();
+  // Link the module M into the Assertions module. Not the other way around,
+  // because we want to keep the linkonce_odr'd functions alive.
+  Linker L(&M);
+  if (L.linkInModule(RT.get(), &ErrorMessage)) {
+    ErrorMessage = "link error: " + ErrorMessage;
+    return false;
+  }
+  return true;
+}
+
+}
@@ -0,0 +1,61 @@
+#ifndef ASSERTIONS_INSTRUMENTER_RUNTIMEMODULE_H
+#define ASSERTIONS_INSTRUMENTER_RUNTIMEMODULE_H
+
+#include "llvm/ADT/OwningPtr.h"
+#include "llvm/ADT/StringSet.h"
+
+#include <string>
+
+namespace llvm {
+  class LLVMContext;
+  class MemoryBuffer;
+  class Module;
+}
+
+namespace assertions {
+
+/// Adds the kind of each assertion annotated in M, on globals, functions or
+/// variables, to Kinds (e.g. "monotonic" for "assertion,monotonic()").
+void CollectAssertionKinds(llvm::Module &M, llvm::StringSet<> &Kinds);
+
+/// The Assertions module, read into a context and verified once, however
+/// many modules of that context it is then linked into.
+class RuntimeModule {
+public:
+  /// Reads Bitcode (which is only read) into Context, and verifies it.
+  /// Returns null and sets ErrorMessage if it can't be read, or is broken.
+  static RuntimeModule *load(const llvm::MemoryBuffer &Bitcode,
+                             llvm::LLVMContext &Context,
+                             std::string &ErrorMessage);
+  ~RuntimeModule();
+
+  llvm::LLVMContext &getContext() const;
+
+  /// Returns a copy of the part of the Assertions module that a module
+  /// using assertions of these kinds, and declaring the globals named in
+  /// Referenced, needs.
+  ///
+  /// Kept are the run-time functions of these kinds (__init_<kind>,
+  /// __update_<kind>, __update_<kind>_<type>, __alloc_<kind>, ...) and
+  /// their default states (<kind>_state_default), the entry points the
+  /// passes call (the site registry, pools, rings, ...), the referenced
+  /// globals, and whatever these refer to. The rest is left out.
+  llvm::Module *getPartFor(const llvm::StringSet<> &Kinds,
+                           const llvm::StringSet<> &Referenced) const;
+
+private:
+  llvm::OwningPtr<llvm::Module> Full;
+
+  explicit RuntimeModule(llvm::Module *M) : Full(M) {}
+};
+
+/// Links what M needs of the Assertions module (see getPartFor) into M,
+/// which must be in the same context. Returns false and sets ErrorMessage if
+/// it can't. Optionally gives the number of run-time functions linked.
+bool LinkRuntime(llvm::Module &M, const RuntimeModule &Runtime,
+                 std::string &ErrorMessage,
+                 unsigned *NumFunctions = nullptr);
+
+}
+
+#endif
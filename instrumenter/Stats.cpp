@@ -0,0 +1,123 @@
+#include "Stats.h"
+
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+
+#include <sys/resource.h>
+
+using namespace llvm;
+
+namespace assertions {
+
+// In kilobytes on Linux, but bytes on Darwin.
+static long getPeakRSSKB() {
+  struct rusage Usage;
+  if (getrusage(RUSAGE_SELF, &Usage))
+    return 0;
+#ifdef __APPLE__
+  return Usage.ru_maxrss / 1024;
+#else
+  return Usage.ru_maxrss;
+#endif
+}
+
+Stats::Timer::Timer(Stats &S, StringRef Phase)
+  : S(S), Index(S.getPhase(Phase)),
+    Start(std::chrono::steady_clock::now()),
+    StartPeakRSSKB(S.MeasureMemory ? getPeakRSSKB() : 0) {}
+
+Stats::Timer::~Timer() {
+  Phase &P = S.Phases[Index].second;
+  P.Seconds += std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - Start).count();
+  // The peak is the process', so only its growth is the phase's doing.
+  if (S.MeasureMemory)
+    P.PeakRSSGrowthKB += getPeakRSSKB() - StartPeakRSSKB;
+}
+
+unsigned Stats::getPhase(StringRef Name) {
+  for (unsigned I = 0, E = Phases.size(); I != E; ++I) {
+    if (Phases[I].first == Name)
+      return I;
+  }
+  Phases.push_back(std::make_pair(Name.str(), Phase()));
+  return Phases.size() - 1;
+}
+
+unsigned Stats::countInstructions(const Module &M) {
+  unsigned N = 0;
+  for (Module::const_iterator F = M.begin(), FE = M.end(); F != FE; ++F) {
+    for (Function::const_iterator BB = F->begin(), E = F->end(); BB != E; ++BB)
+      N += BB->size();
+  }
+  return N;
+}
+
+static void writeString(raw_ostream &OS, StringRef Str) {
+  OS << '"';
+  for (char C : Str) {
+    if (C == '"' || C == '\\')
+      OS << '\\' << C;
+    else if ((unsigned char) C < 0x20)
+      OS << format("\\u%04x", C);
+    else
+      OS << C;
+  }
+  OS << '"';
+}
+
+void Stats::writeJSON(raw_ostream &OS, StringRef Input) const {
+  OS << "{\n  \"module\": ";
+  writeString(OS, Input);
+  OS << ",\n  \"phases\": [";
+  for (unsigned I = 0, E = Phases.size(); I != E; ++I) {
+    OS << (I ? ",\n" : "\n") << "    {\"name\": ";
+    writeString(OS, Phases[I].first);
+    OS << format(", \"seconds\": %.6f", Phases[I].second.Seconds);
+    if (MeasureMemory)
+      OS << ", \"peak_rss_growth_kb\": " << Phases[I].second.PeakRSSGrowthKB;
+    OS << "}";
+  }
+  OS << "\n  ],\n";
+  if (!MeasureMemory) {
+    OS << "  \"peak_rss_growth_kb\": \"omitted, other modules were being "
+       << "instrumented at the same time\",\n";
+  }
+  OS << "  \"sites_per_kind\": {";
+  // Sorted, so that reports can be diffed.
+  std::vector<StringRef> Kinds;
+  for (auto I = SitesPerKind.begin(), E = SitesPerKind.end(); I != E; ++I)
+    Kinds.push_back(I->getKey());
+  std::sort(Kinds.begin(), Kinds.end());
+  for (unsigned I = 0, E = Kinds.size(); I != E; ++I) {
+    OS << (I ? ", " : "");
+    writeString(OS, Kinds[I]);
+    OS << ": " << SitesPerKind.lookup(Kinds[I]);
+  }
+  OS << "},\n"
+     << "  \"functions_rewritten\": " << FunctionsRewritten << ",\n"
+     << "  \"allocas_added\": " << Allocas << ",\n"
+     << "  \"pool_states\": " << PoolStates << ",\n"
+     << "  \"global_strings_added\": " << GlobalStrings << ",\n"
+     << "  \"props_arrays_added\": " << PropsArrays << ",\n"
+     << "  \"checks_proven\": " << ProvenChecks << ",\n"
+     << "  \"checks_deferred\": " << DeferredChecks << ",\n"
+     << "  \"checks_specialized\": " << SpecializedChecks << ",\n"
+     << "  \"field_checks\": " << FieldChecks << ",\n"
+     << "  \"field_releases\": " << FieldReleases << ",\n"
+     << "  \"range_checks\": " << RangeChecks << ",\n"
+     << "  \"site_switches\": " << SiteSwitches << ",\n"
+     << "  \"checks_profiled\": " << ProfiledChecks << ",\n"
+     << "  \"functions_cloned\": " << ClonedFunctions << ",\n"
+     << "  \"checks_queued\": " << QueuedChecks << ",\n"
+     << "  \"runtime_functions_linked\": " << RuntimeFunctions << ",\n"
+     << "  \"instructions_before\": " << InstructionsBefore << ",\n"
+     << "  \"instructions_after\": " << InstructionsAfter << "\n"
+     << "}";
+}
+
+}
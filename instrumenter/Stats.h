@@ -0,0 +1,101 @@
+#ifndef ASSERTIONS_INSTRUMENTER_STATS_H
+#define ASSERTIONS_INSTRUMENTER_STATS_H
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+
+#include <chrono>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace llvm {
+  class Module;
+  class raw_ostream;
+}
+
+namespace assertions {
+
+/// What instrumenting a module took, and what it added to it. Filled in by
+/// the driver and the passes, and written out with -stats-json.
+class Stats {
+public:
+  // Adds the wall time spent in its scope to the named phase (a pass, or a
+  // step of the driver), and how much the peak memory use of the process
+  // grew meanwhile (unless MeasureMemory is off).
+  class Timer {
+  public:
+    Timer(Stats &S, llvm::StringRef Phase);
+    ~Timer();
+  private:
+    Stats &S;
+    unsigned Index;
+    std::chrono::steady_clock::time_point Start;
+    long StartPeakRSSKB;
+  };
+
+  // Whether to charge the growth of the process' peak memory to phases.
+  // Turned off when other modules are instrumented by other threads at the
+  // same time, as it would be theirs as much as this module's.
+  bool MeasureMemory = true;
+
+  // A new site was added to the module's table of sites.
+  void addSite(llvm::StringRef Kind) { ++SitesPerKind[Kind]; }
+
+  // Functions given extra state parameters by the callee-side pass.
+  unsigned FunctionsRewritten = 0;
+  // State and accumulator allocas.
+  unsigned Allocas = 0;
+  // States taken from the run-time's pool instead, when functions are
+  // entered.
+  unsigned PoolStates = 0;
+  // Global strings and props arrays, after sharing equal ones.
+  unsigned GlobalStrings = 0;
+  unsigned PropsArrays = 0;
+  // Update checks left out because they always hold, and the ones moved
+  // out of loops.
+  unsigned ProvenChecks = 0;
+  unsigned DeferredChecks = 0;
+  // Check functions specialized for the props of an assertion.
+  unsigned SpecializedChecks = 0;
+  // Stores to asserted struct fields checked, and the calls freeing objects
+  // with such fields that drop their states.
+  unsigned FieldChecks = 0;
+  unsigned FieldReleases = 0;
+  // Calls to range functions, after writes to asserted arrays or on the
+  // exits of loops writing them.
+  unsigned RangeChecks = 0;
+  // Check sites the run-time can switch on and off.
+  unsigned SiteSwitches = 0;
+  // Check calls counted per site (-assertions-profile).
+  unsigned ProfiledChecks = 0;
+  // Functions given an unchecked clone (-assertions-clones).
+  unsigned ClonedFunctions = 0;
+  // Calls queued for the checker thread instead (-assertions-async).
+  unsigned QueuedChecks = 0;
+  // Run-time functions linked in, for the kinds of assertions used.
+  unsigned RuntimeFunctions = 0;
+  // Size of the input module, and of the output (run-time included).
+  unsigned InstructionsBefore = 0;
+  unsigned InstructionsAfter = 0;
+
+  static unsigned countInstructions(const llvm::Module &M);
+
+  // Writes the report as a JSON object, without a newline after it.
+  void writeJSON(llvm::raw_ostream &OS, llvm::StringRef Input) const;
+
+private:
+  struct Phase {
+    double Seconds = 0;
+    long PeakRSSGrowthKB = 0;
+  };
+  // In the order they first ran.
+  std::vector<std::pair<std::string, Phase>> Phases;
+  llvm::StringMap<unsigned> SitesPerKind;
+
+  unsigned getPhase(llvm::StringRef Name);
+};
+
+}
+
+#endif
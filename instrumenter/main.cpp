@@ -16,12 +16,18 @@
 //#include "Assertion.h"
 #include "Callee.h"
 #include "Caller.h"
+#include "Cloner.h"
 #include "Common.h"
+#include "Outliner.h"
+#include "RuntimeModule.h"
+#include "Stats.h"
 
 #include "llvm/IR/DataLayout.h"
+#include "llvm/IR/Function.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
-#include "llvm/Linker.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringExtras.h"
 #include "llvm/IRReader/IRReader.h"
 #include "llvm/CodeGen/CommandFlags.h"
 #include "llvm/Bitcode/ReaderWriter.h"
@@ -31,15 +37,32 @@
 #include "llvm/Target/TargetLibraryInfo.h"
 #include "llvm/Target/TargetMachine.h"
 #include "llvm/ADT/Triple.h"
+#include "llvm/MC/SubtargetFeature.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FormattedStream.h"
+#include "llvm/Support/Host.h"
 #include "llvm/Support/Signals.h"
 #include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/PrettyStackTrace.h"
 #include "llvm/Support/SourceMgr.h"          // SMDiagnostic
 #include "llvm/Support/SystemUtils.h"
 #include "llvm/Support/TargetRegistry.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/Threading.h"
 #include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Support/system_error.h"
+#include "llvm/InitializePasses.h"
 #include "llvm/PassManager.h"
+#include "llvm/PassRegistry.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/Transforms/IPO/PassManagerBuilder.h"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 using namespace llvm;
 using namespace assertions;
@@ -69,6 +92,30 @@ VerifyEach("verify-each", cl::desc("Verify after each transform"));
 static cl::opt<bool>
 Verbose("v", cl::desc("Print information about actions taken"));
 
+static cl::opt<char>
+OptLevel("O",
+  cl::desc("Optimize the instrumented module, inlining the run-time "
+           "kernels: -O0, -O1, -O2 or -O3 (default: don't)"),
+  cl::Prefix, cl::ZeroOrMore, cl::init(' '));
+
+static cl::opt<std::string>
+BatchFilename("batch",
+  cl::desc("Instrument each '<input> <output>' pair listed in this file, "
+           "one per line, instead of a single module"),
+  cl::value_desc("filename"));
+
+static cl::opt<unsigned>
+NumJobs("j",
+  cl::desc("Number of modules to instrument at once with -batch "
+           "(default: one per core)"),
+  cl::init(0));
+
+static cl::opt<std::string>
+StatsFilename("stats-json",
+  cl::desc("Write timings and what was added to the module, as JSON (an "
+           "array of one report per module with -batch)"),
+  cl::value_desc("filename"));
+
 // Filename of compiled bc Assertions module provided by CMake.
 #ifdef ASSERTIONS_MODULE_PATH
 #define STR2(X) #X
@@ -90,39 +137,136 @@ static inline void addPass(PassManagerBase &PM, Pass *P) {
   if (PrintEachXForm) PM.add(createPrintModulePass(&errs()));
 }
 
+
 const char *Argv0 = nullptr;
 
-Module *LoadModule(StringRef Filename, LLVMContext& Context) {
+Module *LoadModule(StringRef Filename, LLVMContext& Context,
+                   raw_ostream &Errs = errs()) {
   SMDiagnostic Err;
   Module *M = ParseIRFile(Filename, Err, Context);
 
   if (M == nullptr) {
-    Err.print(Argv0, errs());
+    Err.print(Argv0, Errs);
   }
   return M;
 }
 
-//===----------------------------------------------------------------------===//
-//
-int main(int argc, char **argv) {
-  sys::PrintStackTraceOnErrorSignal();
-  llvm::PrettyStackTraceProgram X(argc, argv);
+namespace {
 
-  llvm_shutdown_obj Y;  // Call llvm_shutdown() on exit.
-  LLVMContext &Context = getGlobalContext();
+// A module to instrument, and how it went.
+struct Job {
+  std::string Input;
+  std::string Output;
+  Stats Stat;
+  // Diagnostics, printed once the job is done so that the output of
+  // concurrent jobs doesn't interleave.
+  std::string Errors;
+  raw_string_ostream Errs;
+  bool Failed;
 
-  cl::ParseCommandLineOptions(argc, argv, "Assertions bitcode instrumenter\n");
+  Job(StringRef In, StringRef Out)
+    : Input(In), Output(Out), Errs(Errors), Failed(false) {}
+};
+
+}
+
+// Errors emitted by the passes (LLVMContext::emitError) fail the job
+// instead of exiting, so that the other modules of a batch still get done.
+static void HandleDiagnostic(const SMDiagnostic &Diag, void *Context,
+                             unsigned) {
+  auto *J = static_cast<Job *>(Context);
+  Diag.print(Argv0, J->Errs);
+  if (Diag.getKind() == SourceMgr::DK_Error)
+    J->Failed = true;
+}
+
+// Inlines the run-time kernels into the instrumented code, and optimizes the
+// result as clang would at -O<OptLevel>.
+static void OptimizeModule(Module &M) {
+  unsigned Level = OptLevel - '0';
+  // The kernels the outliner could shrink are always_inline already. Ask
+  // for the others to be inlined too, as they are on the hot paths.
+  for (Module::iterator F = M.begin(), E = M.end(); F != E; ++F) {
+    if (KernelOutliner::isKernel(*F) &&
+        !F->hasFnAttribute(Attribute::AlwaysInline) &&
+        !F->hasFnAttribute(Attribute::NoInline))
+      F->addFnAttr(Attribute::InlineHint);
+  }
+
+  PassManagerBuilder Builder;
+  Builder.OptLevel = Level;
+  Builder.Inliner = Level ? createFunctionInliningPass(Level > 2 ? 275 : 225)
+                          : createAlwaysInlinerPass();
+  Builder.LoopVectorize = Builder.SLPVectorize = Level > 2;
+  Builder.LibraryInfo = new TargetLibraryInfo(Triple(M.getTargetTriple()));
+
+  FunctionPassManager FPM(&M);
+  PassManager MPM;
+  if (!M.getDataLayout().empty()) {
+    FPM.add(new DataLayout(M.getDataLayout()));
+    MPM.add(new DataLayout(M.getDataLayout()));
+  }
+  Builder.populateFunctionPassManager(FPM);
+  Builder.populateModulePassManager(MPM);
+  FPM.doInitialization();
+  for (Module::iterator F = M.begin(), E = M.end(); F != E; ++F)
+    FPM.run(*F);
+  FPM.doFinalization();
+  MPM.run(M);
+}
+
+// The target machine to generate code for M with, as llc would pick it.
+static TargetMachine *GetTargetMachine(Module &M, std::string &Error) {
+  Triple TheTriple(M.getTargetTriple());
+  if (TheTriple.getTriple().empty())
+    TheTriple.setTriple(sys::getDefaultTargetTriple());
+  const Target *TheTarget = TargetRegistry::lookupTarget(MArch, TheTriple,
+                                                         Error);
+  if (!TheTarget)
+    return nullptr;
+
+  std::string FeaturesStr;
+  if (MAttrs.size()) {
+    SubtargetFeatures Features;
+    for (unsigned i = 0; i != MAttrs.size(); ++i)
+      Features.AddFeature(MAttrs[i]);
+    FeaturesStr = Features.getString();
+  }
+
+  CodeGenOpt::Level OLvl = CodeGenOpt::Default;
+  switch (OptLevel) {
+    case '0': OLvl = CodeGenOpt::None; break;
+    case '1': OLvl = CodeGenOpt::Less; break;
+    case '3': OLvl = CodeGenOpt::Aggressive; break;
+  }
+
+  // Like llc: .init_array only with -use-init-array, which the target's
+  // toolchain has to support.
+  TargetOptions Options;
+  Options.UseInitArray = UseInitArray;
+  return TheTarget->createTargetMachine(TheTriple.getTriple(), MCPU,
+                                        FeaturesStr, Options, RelocModel,
+                                        CMModel, OLvl);
+}
+
+// Instruments J.Input into J.Output, linking in the parts of the Assertions
+// module (Runtime, in Context) that it uses.
+static bool InstrumentModule(Job &J, LLVMContext &Context,
+                             const RuntimeModule &Runtime) {
+  raw_ostream &Errs = J.Errs;
+  Stats &Stat = J.Stat;
+  Context.setInlineAsmDiagnosticHandler(HandleDiagnostic, &J);
 
-  Argv0 = argv[0];
-  // Load the input module...
   llvm::OwningPtr<Module> M;
-  M.reset(LoadModule(InputFilename, Context));
-  // Load the assertions module...
-  llvm::OwningPtr<Module> AsM;
-  AsM.reset(LoadModule(ASSERTIONS_FNAME, Context));
-  if (!M.get() || !AsM.get()) {
-    return 1;
+  {
+    Stats::Timer T(Stat, "load");
+    // Load the input module...
+    M.reset(LoadModule(J.Input, Context, Errs));
+  }
+  if (!M.get()) {
+    return false;
   }
+  Stat.InstructionsBefore = Stats::countInstructions(*M);
 
 
   // Create a PassManager to hold and optimize the collection of passes we are
@@ -143,62 +287,94 @@ int main(int argc, char **argv) {
   if (TD)
     Passes.add(TD);
 
-  OwningPtr<Common> Co(new Common(*M.get()));
+  OwningPtr<Common> Co(new Common(*M.get(), Stat));
+  addPass(Passes, new assertions::KernelOutliner(Stat));
+  addPass(Passes, new assertions::FunctionCloner(*Co.get()));
   addPass(Passes, new assertions::CalleeInstrumenter(*Co.get()));
   addPass(Passes, new assertions::CallerInstrumenter(*Co.get()));
 
-  // Before executing passes, print the final values of the LLVM options.
-  cl::PrintOptionValues();
-
-  Linker L(M.get());
-  if (Verbose) errs() << "Linking in the Assertions module\n";
+  if (Verbose) Errs << "Linking in the Assertions module\n";
 
   std::string ErrorMessage;
-  // Link the module M into the Assertions module. Not the other way around,
-  // because we want to keep the linkonce_odr'd functions alive.
-  if (L.linkInModule(AsM.get(), &ErrorMessage)) {
-    errs() << argv[0] << ": link error: " << ErrorMessage << "\n";
-    return 1;
+  {
+    Stats::Timer T(Stat, "link");
+    if (!LinkRuntime(*M, Runtime, ErrorMessage,
+                     &Stat.RuntimeFunctions)) {
+      Errs << Argv0 << ": " << J.Input << ": " << ErrorMessage << "\n";
+      return false;
+    }
+
+    if (verifyModule(*M)) {
+      Errs << Argv0 << ": " << J.Input << ": linked module is broken!\n";
+      return false;
+    }
   }
-  AsM.take(); // dispose
-  // errs() << *AsM;
 
-  if (verifyModule(*M)) {
-    errs() << argv[0] << ": linked module is broken!\n";
-    return 1;
-  }
+  if (Verbose) Errs << "Running instrumentation passes\n";
 
-  if (Verbose) errs() << "Running instrumentation passes\n";
-
-  // Now that we have all of the passes ready, run them.
+  // Now that we have all of the passes ready, run them. They time
+  // themselves.
   Passes.run(*M.get());
   // errs() << *AsM;
+  if (J.Failed)
+    return false;
 
-  // Output stream...
-  if (OutputFilename.empty())
-    OutputFilename = "-";
+  if (OptLevel != ' ') {
+    if (Verbose) Errs << "Optimizing\n";
+    Stats::Timer T(Stat, "optimize");
+    OptimizeModule(*M);
+  }
+  Stat.InstructionsAfter = Stats::countInstructions(*M);
+
+  // Without -filetype, the output is bitcode, or LLVM assembly with -S.
+  bool EmitCode = FileType.getNumOccurrences();
+  OwningPtr<TargetMachine> TM;
+  if (EmitCode) {
+    TM.reset(GetTargetMachine(*M, ErrorMessage));
+    if (!TM.get()) {
+      Errs << Argv0 << ": " << J.Input << ": " << ErrorMessage << "\n";
+      return false;
+    }
+  }
 
+  // Output stream...
   std::string ErrorInfo;
-  tool_output_file Out(OutputFilename.c_str(), ErrorInfo,
-                       raw_fd_ostream::F_Binary);
+  tool_output_file Out(J.Output.c_str(), ErrorInfo, raw_fd_ostream::F_Binary);
   if (!ErrorInfo.empty()) {
-    errs() << ErrorInfo << '\n';
-    return 1;
+    Errs << ErrorInfo << '\n';
+    return false;
   }
 
 
 
-  if (Verbose) errs() << "Writing bitcode...\n";
+  if (Verbose) Errs << (EmitCode ? "Generating code...\n"
+                                 : "Writing bitcode...\n");
 
   // If the output is set to be emitted to standard out, and standard out is a
   // console, print out a warning message and refuse to do it.  We don't
   // impress anyone by spewing tons of binary goo to a terminal.
   bool NoOutput = false;
-  if (!Force && !OutputAssembly)
+  bool Binary = EmitCode ? FileType == TargetMachine::CGFT_ObjectFile
+                         : !OutputAssembly;
+  if (!Force && Binary)
     if (CheckBitcodeOutputToConsole(Out.os(), true))
       NoOutput = true;
 
-  if (!NoOutput) {
+  if (!NoOutput && EmitCode) {
+    Stats::Timer T(Stat, "codegen");
+    PassManager PM;
+    PM.add(new TargetLibraryInfo(Triple(M->getTargetTriple())));
+    TM->addAnalysisPasses(PM);
+    PM.add(new DataLayout(*TM->getDataLayout()));
+    formatted_raw_ostream FOS(Out.os());
+    if (TM->addPassesToEmitFile(PM, FOS, FileType)) {
+      Errs << Argv0 << ": target does not support generation of this "
+           << "file type!\n";
+      return false;
+    }
+    PM.run(*M);
+  } else if (!NoOutput) {
+    Stats::Timer T(Stat, "write");
     if (OutputAssembly) {
       Out.os() << *M;
     } else
@@ -209,6 +385,181 @@ int main(int argc, char **argv) {
   if (!NoOutput)
     Out.keep();
 
-  return 0;
+  return true;
 }
 
+// Reads the "<input> <output>" pairs of a batch file. Blank lines and lines
+// starting with '#' are skipped.
+static bool ReadBatchFile(StringRef Filename, std::vector<Job *> &Jobs) {
+  OwningPtr<MemoryBuffer> Buf;
+  if (error_code EC = MemoryBuffer::getFileOrSTDIN(Filename, Buf)) {
+    errs() << Argv0 << ": " << Filename << ": " << EC.message() << "\n";
+    return false;
+  }
+  SmallVector<StringRef, 64> Lines;
+  Buf->getBuffer().split(Lines, "\n", -1, false);
+  for (unsigned I = 0, E = Lines.size(); I != E; ++I) {
+    StringRef Line = Lines[I].trim();
+    if (Line.empty() || Line.startswith("#"))
+      continue;
+    std::pair<StringRef, StringRef> InOut = getToken(Line);
+    StringRef Out = InOut.second.trim();
+    if (Out.empty() || Out.find_first_of(" \t") != StringRef::npos) {
+      errs() << Argv0 << ": " << Filename << ":" << I + 1
+             << ": expected '<input> <output>'\n";
+      return false;
+    }
+    Jobs.push_back(new Job(InOut.first, Out));
+  }
+  return true;
+}
+
+// Instruments the jobs on NumThreads threads, each with its own context.
+// Each thread reads the run-time from RuntimeBitcode into its context once.
+static void RunBatch(std::vector<Job *> &Jobs,
+                     const MemoryBuffer &RuntimeBitcode, unsigned NumThreads) {
+  std::atomic<unsigned> Next(0);
+  std::mutex ErrsLock;
+  auto Worker = [&]() {
+    LLVMContext Context;
+    std::string ErrorMessage;
+    OwningPtr<RuntimeModule> Runtime(
+      RuntimeModule::load(RuntimeBitcode, Context, ErrorMessage));
+    for (unsigned I = Next++; I < Jobs.size(); I = Next++) {
+      Job &J = *Jobs[I];
+      if (!Runtime.get())
+        J.Errs << Argv0 << ": " << RuntimeBitcode.getBufferIdentifier()
+               << ": " << ErrorMessage << "\n";
+      if (!Runtime.get() || !InstrumentModule(J, Context, *Runtime))
+        J.Failed = true;
+      if (!J.Errs.str().empty()) {
+        std::lock_guard<std::mutex> Guard(ErrsLock);
+        errs() << J.Errors;
+      }
+    }
+  };
+  std::vector<std::thread> Threads;
+  for (unsigned I = 1; I < NumThreads; ++I)
+    Threads.push_back(std::thread(Worker));
+  Worker();
+  for (std::thread &T : Threads)
+    T.join();
+}
+
+//===----------------------------------------------------------------------===//
+//
+int main(int argc, char **argv) {
+  sys::PrintStackTraceOnErrorSignal();
+  llvm::PrettyStackTraceProgram X(argc, argv);
+
+  llvm_shutdown_obj Y;  // Call llvm_shutdown() on exit.
+  LLVMContext &Context = getGlobalContext();
+
+  // Register the analyses our passes depend on (e.g. LoopInfo), so that the
+  // PassManager can schedule them.
+  PassRegistry &Registry = *PassRegistry::getPassRegistry();
+  initializeCore(Registry);
+  initializeAnalysis(Registry);
+  // And what -O and -filetype use.
+  initializeScalarOpts(Registry);
+  initializeVectorization(Registry);
+  initializeIPO(Registry);
+  initializeIPA(Registry);
+  initializeInstCombine(Registry);
+  initializeTransformUtils(Registry);
+  initializeCodeGen(Registry);
+  initializeTarget(Registry);
+
+  InitializeAllTargets();
+  InitializeAllTargetMCs();
+  InitializeAllAsmPrinters();
+  InitializeAllAsmParsers();
+
+  cl::ParseCommandLineOptions(argc, argv, "Assertions bitcode instrumenter\n");
+
+  Argv0 = argv[0];
+  if (OptLevel != ' ' && (OptLevel < '0' || OptLevel > '3')) {
+    errs() << argv[0] << ": invalid optimization level -O" << OptLevel
+           << "\n";
+    return 1;
+  }
+  std::vector<Job *> Jobs;
+  if (BatchFilename.empty()) {
+    // Output stream...
+    if (OutputFilename.empty())
+      OutputFilename = "-";
+    Jobs.push_back(new Job(InputFilename, OutputFilename));
+  } else if (!ReadBatchFile(BatchFilename, Jobs)) {
+    return 1;
+  }
+
+  // Read the assertions module once, whatever the number of modules. It is
+  // parsed and verified once per context, and each module then copies what
+  // it needs from it.
+  OwningPtr<MemoryBuffer> RuntimeBitcode;
+  if (error_code EC = MemoryBuffer::getFile(ASSERTIONS_FNAME, RuntimeBitcode)) {
+    errs() << argv[0] << ": " << ASSERTIONS_FNAME << ": " << EC.message()
+           << "\n";
+    return 1;
+  }
+
+  // Before executing passes, print the final values of the LLVM options.
+  cl::PrintOptionValues();
+
+  unsigned NumThreads = NumJobs ? NumJobs : std::thread::hardware_concurrency();
+  NumThreads = std::max(1u, std::min<unsigned>(NumThreads, Jobs.size()));
+  bool Failed = false;
+  if (BatchFilename.empty()) {
+    Job &J = *Jobs[0];
+    std::string ErrorMessage;
+    OwningPtr<RuntimeModule> Runtime(
+      RuntimeModule::load(*RuntimeBitcode, Context, ErrorMessage));
+    if (!Runtime.get()) {
+      errs() << argv[0] << ": " << ASSERTIONS_FNAME << ": " << ErrorMessage
+             << "\n";
+      return 1;
+    }
+    Failed = !InstrumentModule(J, Context, *Runtime);
+    errs() << J.Errs.str();
+  } else {
+    if (NumThreads > 1 && !llvm_start_multithreaded()) {
+      errs() << argv[0] << ": LLVM was built without threads, "
+             << "instrumenting one module at a time\n";
+      NumThreads = 1;
+    }
+    // The peak memory use is the process', shared by the jobs running.
+    if (NumThreads > 1) {
+      for (Job *J : Jobs)
+        J->Stat.MeasureMemory = false;
+    }
+    RunBatch(Jobs, *RuntimeBitcode, NumThreads);
+    for (Job *J : Jobs)
+      Failed |= J->Failed;
+  }
+
+  // One report per module, in the order they were given.
+  if (!StatsFilename.empty()) {
+    std::string ErrorInfo;
+    tool_output_file StatsOut(StatsFilename.c_str(), ErrorInfo);
+    if (!ErrorInfo.empty()) {
+      errs() << ErrorInfo << '\n';
+      return 1;
+    }
+    raw_ostream &OS = StatsOut.os();
+    if (BatchFilename.empty()) {
+      Jobs[0]->Stat.writeJSON(OS, Jobs[0]->Input);
+    } else {
+      OS << "[\n";
+      for (unsigned I = 0, E = Jobs.size(); I != E; ++I) {
+        OS << (I ? ",\n" : "");
+        Jobs[I]->Stat.writeJSON(OS, Jobs[I]->Input);
+      }
+      OS << "]";
+    }
+    OS << "\n";
+    StatsOut.keep();
+  }
+
+  DeleteContainerPointers(Jobs);
+  return Failed ? 1 : 0;
+}